@@ -2,6 +2,8 @@ use std::env;
 use std::path::PathBuf;
 use std::process::Command;
 
+use sha2::{Digest, Sha256};
+
 /// Cross-compile the evgrab helper for ARM targets.
 ///
 /// The helper is a tiny C program that exclusively grabs an evdev device
@@ -12,8 +14,30 @@ use std::process::Command;
 ///   1. Environment variable (ARMV7_CC / AARCH64_CC)
 ///   2. Common musl cross-compiler names
 ///   3. Common glibc cross-compiler names
+///
+/// A static musl binary is a fraction of the size of a static glibc one,
+/// so it uploads and starts faster.
+///
+/// `EVGRAB_PROFILE_ARMV7` / `EVGRAB_PROFILE_AARCH64` pick the optimisation
+/// flags per architecture, falling back to `EVGRAB_PROFILE`:
+///   size   (default) `-Os` with unused code removed at link time
+///   speed  `-O2` tuned for the tablet's CPU (`ARMV7_MCPU` / `AARCH64_MCPU`
+///          override it; an empty value leaves the compiler's default)
+/// That lets the reMarkable 2 (armv7) and the Paper Pro models (aarch64)
+/// each ship the profile that measured faster on them: `evgrab --selftest`
+/// on the tablet reports which profile it was built with and how fast it
+/// forwards events.
+///
+/// Each binary's SHA256 is exported as `EVGRAB_<ARCH>_SHA256`; the helper
+/// is installed on the tablet under a name derived from it.
 fn main() {
     println!("cargo:rerun-if-changed=helper/evgrab.c");
+    println!("cargo:rerun-if-env-changed=EVGRAB_PROFILE");
+    for arch in ["ARMV7", "AARCH64"] {
+        for var in [format!("EVGRAB_PROFILE_{}", arch), format!("{}_CC", arch), format!("{}_MCPU", arch)] {
+            println!("cargo:rerun-if-env-changed={}", var);
+        }
+    }
 
     let out_dir = PathBuf::from(env::var("OUT_DIR").unwrap());
 
@@ -24,11 +48,18 @@ fn main() {
 fn build_helper(arch: &str, out_dir: &PathBuf) {
     let cc = find_compiler(arch);
     let output = out_dir.join(format!("evgrab-{}", arch));
+    let profile = env::var(format!("EVGRAB_PROFILE_{}", arch.to_uppercase()))
+        .or_else(|_| env::var("EVGRAB_PROFILE"))
+        .unwrap_or_else(|_| "size".to_string());
+    let flags = profile_flags(&profile, arch);
 
-    eprintln!("Compiling evgrab for {} using {}", arch, cc);
+    eprintln!("Compiling evgrab for {} using {} ({})", arch, cc, profile);
 
     let status = Command::new(&cc)
-        .args(["-static", "-Os", "-o"])
+        .arg("-static")
+        .args(&flags)
+        .arg(format!("-DEVGRAB_VARIANT=\"{}\"", profile))
+        .arg("-o")
         .arg(&output)
         .arg("helper/evgrab.c")
         .status()
@@ -63,6 +94,41 @@ fn build_helper(arch: &str, out_dir: &PathBuf) {
     if let Some(strip) = find_tool("strip", arch) {
         let _ = Command::new(strip).arg(&output).status();
     }
+
+    let binary = std::fs::read(&output).expect("Failed to read the compiled helper");
+    println!(
+        "cargo:rustc-env=EVGRAB_{}_SHA256={:x}",
+        arch.to_uppercase(),
+        Sha256::digest(&binary)
+    );
+}
+
+fn profile_flags(profile: &str, arch: &str) -> Vec<String> {
+    match profile {
+        "size" => ["-Os", "-ffunction-sections", "-fdata-sections", "-Wl,--gc-sections"]
+            .map(String::from)
+            .to_vec(),
+        "speed" => {
+            let mcpu_var = format!("{}_MCPU", arch.to_uppercase());
+            let mcpu = env::var(mcpu_var).unwrap_or_else(|_| default_mcpu(arch).to_string());
+            let mut flags = vec!["-O2".to_string()];
+            if !mcpu.is_empty() {
+                flags.push(format!("-mcpu={}", mcpu));
+            }
+            flags
+        }
+        _ => panic!("Unknown evgrab profile '{}' for {}: use 'size' or 'speed'", profile, arch),
+    }
+}
+
+/// The CPU of the tablets using each architecture: the i.MX7D of the
+/// reMarkable 2 and the i.MX8M Mini of the Paper Pro.
+fn default_mcpu(arch: &str) -> &'static str {
+    match arch {
+        "armv7" => "cortex-a7",
+        "aarch64" => "cortex-a53",
+        _ => panic!("Unknown target architecture: {}", arch),
+    }
 }
 
 fn find_compiler(arch: &str) -> String {
@@ -102,8 +168,8 @@ fn find_compiler(arch: &str) -> String {
 fn compiler_candidates(arch: &str) -> Vec<&'static str> {
     match arch {
         "armv7" => vec![
-            "arm-none-linux-gnueabihf-gcc",
             "arm-linux-musleabihf-gcc",
+            "arm-none-linux-gnueabihf-gcc",
             "arm-linux-gnueabihf-gcc",
         ],
         "aarch64" => vec![
@@ -116,7 +182,7 @@ fn compiler_candidates(arch: &str) -> Vec<&'static str> {
 
 fn find_tool(tool: &str, arch: &str) -> Option<String> {
     let prefixes = match arch {
-        "armv7" => &["arm-none-linux-gnueabihf-", "arm-linux-musleabihf-", "arm-linux-gnueabihf-"][..],
+        "armv7" => &["arm-linux-musleabihf-", "arm-none-linux-gnueabihf-", "arm-linux-gnueabihf-"][..],
         "aarch64" => &["aarch64-linux-musl-", "aarch64-linux-gnu-"][..],
         _ => return None,
     };
@@ -1,87 +1,1315 @@
 /*
- * evgrab - Grab an evdev device and stream events to stdout.
- * Exits if watchdog file /tmp/rm-pad-watchdog is older than 5 seconds.
+ * evgrab - Grab evdev devices and stream events to stdout.
+ * Exits if nothing arrives on stdin for 5 seconds: the host sends a
+ * heartbeat byte every couple of seconds, so a dead connection releases
+ * the grab quickly. EOF on stdin exits immediately. The exit status is 0
+ * after SIGTERM, SIGINT or that EOF, and 1 after any error, including the
+ * watchdog firing.
+ *
+ * Usage: evgrab [-n] [-c] [-l] [-u] [-d dev:code:band] [-z dev:code:max]
+ *               [-x dev:type] [-r hz] <device>...
+ *        evgrab --selftest
+ *   -n  don't grab (EVIOCGRAB) the devices, only forward their events
+ *   -c  use the compact payload encoding (see encode_compact)
+ *   -l  stream frames over a plain TCP connection instead of stdout
+ *   -u  like -l, but send batches of pure pen motion as UDP datagrams
+ *   -d  drop changes of ABS `code` on device `dev` smaller than `band`
+ *   -z  clamp ABS `code` on device `dev` to `max`
+ *   -x  drop all events of `type` from device `dev`
+ *   -r  merge batches of plain motion down to at most `hz` per device
+ * Devices are numbered from 0 in command-line order; codes and types may
+ * be given in hex.
+ *
+ * All devices are polled at once and share stdout. Events are drained from
+ * each device in batches and written out as whole SYN_REPORT-terminated
+ * frames, each prefixed with a frame_header naming the device (its index
+ * on the command line) and the payload length in bytes.
+ *
+ * The stream starts with a hello frame from CONTROL_DEVICE carrying the
+ * protocol version and the enabled FRAME_* features, so the host can check
+ * what it is talking to before decoding anything. When the devices are idle
+ * an empty keepalive frame is sent every second, so the host wakes up to
+ * send its heartbeat. A PING byte from the host is answered with a clock
+ * frame holding CLOCK_REALTIME (the evdev event clock) in microseconds, so
+ * the host can estimate the clock offset for latency measurement.
+ *
+ * Both the watchdog and the keepalive run off a 1 Hz timerfd in the poll
+ * set, so the event path itself never checks the clock.
+ *
+ * With -l, stdout only carries the hello and a listen frame announcing an
+ * ephemeral TCP port and a random token. The first connection to that port
+ * that presents the token receives the rest of the stream (starting with
+ * another hello), without the SSH channel's encryption overhead. Heartbeats
+ * still arrive on stdin, so losing SSH still releases the grab.
+ *
+ * With -u, the host follows the token with the port of its UDP socket.
+ * Batches that only move the pen (see is_motion_only) go there as single
+ * raw datagrams. A batch holds only the axes that changed, so each frame of
+ * a datagram is filled up with the last value of every other motion axis
+ * (see send_datagram): any one datagram puts the pen where it is, and losing
+ * one only skips positions. Everything else, including any change of
+ * contact, pressure or buttons, stays on TCP. Every frame then carries a
+ * per-device sequence number (FRAME_SEQ) so the host can drop datagrams
+ * overtaken by later frames, and ignore the motion in TCP frames overtaken
+ * by a datagram.
+ *
+ * The filters (-d, -z, -x) run before anything is encoded; see
+ * filter_events. Frames they leave empty are not sent at all.
+ *
+ * With -r, batches that only update non-MT ABS values without crossing
+ * between zero and non-zero pressure are merged per device and sent as a
+ * single frame at most `hz` times a second, matching the host's output
+ * rate; see govern. Any other batch goes out at once, preceded by whatever
+ * motion is held, so contact and button changes are never delayed.
+ *
+ * --selftest measures the event path on the device it runs on: see
+ * selftest. build.rs compiles the helper for size or for speed
+ * (EVGRAB_PROFILE); comparing the two there shows which one to ship.
  */
 
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/input.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
-#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
-#define WATCHDOG_FILE "/tmp/rm-pad-watchdog"
+/* Ticks (seconds) without a heartbeat from the host before exiting */
 #define WATCHDOG_TIMEOUT 5
 
+/* Maximum number of devices served by one process */
+#define MAX_DEVICES 4
+
+/* Maximum number of events buffered per device between reads */
+#define BATCH_EVENTS 64
+
+/* Multitouch slots tracked for delta encoding (matches the host) */
+#define MT_SLOTS 16
+
+/* ABS codes the filters cover, and the MT codes tracked per slot */
+#define FILTER_ABS_CODES 0x40
+#define MT_CODES 16
+
+/* Events a device can send at once: held motion, its SYN, then a batch */
+#define OUT_EVENTS (FILTER_ABS_CODES + 1 + BATCH_EVENTS + 1)
+
+/* Filter state: no value forwarded yet */
+#define UNKNOWN INT32_MIN
+
+/* Pen axes whose full state every datagram carries (see send_datagram) */
+#define MOTION_AXES 5
+static const uint16_t motion_axes[MOTION_AXES] = {
+    ABS_X, ABS_Y, ABS_DISTANCE, ABS_TILT_X, ABS_TILT_Y,
+};
+
+/* Events in one datagram, keeping it below a typical MTU */
+#define DATAGRAM_EVENTS (1200 / sizeof(struct input_event))
+
+#define PROTOCOL_VERSION 1
+
+/* Device index of frames generated by evgrab itself */
+#define CONTROL_DEVICE 0xff
+
+/* Control frame types, carried in frame_header.flags */
+#define CONTROL_HELLO 0x00
+#define CONTROL_KEEPALIVE 0x01
+#define CONTROL_CLOCK 0x02
+#define CONTROL_LISTEN 0x03
+
+/* Size of the token the host must present on the data connection */
+#define TOKEN_SIZE 16
+
+/* Milliseconds to wait for the host to open the data connection */
+#define ACCEPT_TIMEOUT_MS 5000
+
+/* Heartbeat byte that also asks for a clock frame */
+#define PING 'p'
+
+/* frame_header flags */
+#define FRAME_COMPACT 0x01
+#define FRAME_SEQ 0x02
+
+/* Build profile reported by --selftest, set by build.rs */
+#ifndef EVGRAB_VARIANT
+#define EVGRAB_VARIANT "custom"
+#endif
+
+/* Length of a --selftest run, and the pen frames its producer writes at once */
+#define SELFTEST_SECONDS 2
+#define SELFTEST_FRAMES 8
+
+#ifndef input_event_sec
+#define input_event_sec time.tv_sec
+#define input_event_usec time.tv_usec
+#endif
+
+/* Precedes every frame on stdout (native byte order) */
+struct frame_header {
+    uint8_t device;  /* index of the device on the command line */
+    uint8_t flags;   /* FRAME_* bits describing the payload */
+    uint16_t length; /* payload size in bytes */
+};
+
+/* Delta-encoding state, mirrored by the host decoder */
+struct compact_state {
+    int64_t last_time_us;
+    int32_t last_pos[2];           /* ABS_X, ABS_Y */
+    int32_t last_mt[MT_SLOTS][2];  /* ABS_MT_POSITION_X/Y per slot */
+    int slot;
+};
+
+struct filter {
+    int active;                          /* any filter set for this device */
+    uint32_t drop_types;                 /* bit per EV_* type to drop */
+    int32_t deadband[FILTER_ABS_CODES];  /* smallest change forwarded (0: any) */
+    int32_t max[FILTER_ABS_CODES];       /* values are clamped to this */
+    int32_t last[FILTER_ABS_CODES];      /* last value forwarded, per code */
+    int32_t last_mt[MT_SLOTS][MT_CODES]; /* ... and per slot for MT codes */
+    int in_slot;                         /* current slot on the device */
+    int out_slot;                        /* current slot as sent to the host */
+    size_t frame_events;                 /* events forwarded in this frame */
+};
+
+/* Motion held back by -r */
+struct governor {
+    int held;                          /* a merged frame is waiting */
+    uint64_t mask;                     /* bit per ABS code held */
+    int32_t value[FILTER_ABS_CODES];   /* latest value per held code */
+    struct timeval time;               /* time of the latest merged frame */
+    int touching;                      /* last pressure sent was non-zero */
+    int64_t last_sent_us;              /* CLOCK_MONOTONIC of the last send */
+};
+
+struct device {
+    const char *path;
+    int fd;
+    struct frame_header header;
+    struct input_event buf[BATCH_EVENTS];
+    size_t count; /* buffered events */
+    size_t ready; /* leading events queued for the current write */
+    struct compact_state compact;
+    struct filter filter;
+    struct input_event filtered[BATCH_EVENTS + 1];
+    struct governor governor;
+    struct input_event merged[OUT_EVENTS];
+    uint8_t packed[OUT_EVENTS * 16];
+    uint32_t seq; /* sequence number of the last batch sent (FRAME_SEQ) */
+    int32_t motion[MOTION_AXES]; /* last value sent per motion axis, or UNKNOWN */
+    struct input_event datagram[DATAGRAM_EVENTS];
+};
+
 static volatile int running = 1;
 
+/* Where frames go: stdout, or the data connection with -l */
+static int out_fd = STDOUT_FILENO;
+
+/* Connected UDP socket for motion-only batches with -u, or -1 */
+static int datagram_fd = -1;
+
+/* Shortest time between merged frames with -r, or 0 */
+static int64_t rate_interval_us = 0;
+
 static void handle_signal(int sig) {
     (void)sig;
     running = 0;
 }
 
-/* Returns 1 if watchdog is OK, 0 if stale/missing */
-static int check_watchdog(void) {
-    struct stat st;
-    if (stat(WATCHDOG_FILE, &st) < 0)
+/*
+ * Consume heartbeat bytes from stdin. Returns 1 if one of them was a PING,
+ * 0 otherwise, -1 on EOF.
+ */
+static int read_heartbeat(void) {
+    char buf[64];
+    ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR)
         return 0;
-    return (time(NULL) - st.st_mtime) <= WATCHDOG_TIMEOUT;
+    if (n <= 0)
+        return -1;
+    return memchr(buf, PING, (size_t)n) != NULL;
 }
 
-int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <device>\n", argv[0]);
-        return 1;
+/* Create a timerfd that fires once a second. */
+static int open_ticker(void) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    struct itimerspec its = {
+        .it_interval = { .tv_sec = 1 },
+        .it_value = { .tv_sec = 1 },
+    };
+    if (timerfd_settime(fd, 0, &its, NULL) < 0) {
+        close(fd);
+        return -1;
     }
+    return fd;
+}
 
-    signal(SIGTERM, handle_signal);
-    signal(SIGINT, handle_signal);
-    signal(SIGPIPE, SIG_IGN);
+/* Number of ticks since the last read (0 if none). */
+static uint64_t read_ticks(int fd) {
+    uint64_t ticks;
+    if (read(fd, &ticks, sizeof(ticks)) != sizeof(ticks))
+        return 0;
+    return ticks;
+}
 
-    int fd = open(argv[1], O_RDONLY);
-    if (fd < 0) {
-        fprintf(stderr, "evgrab: open %s: %s\n", argv[1], strerror(errno));
-        return 1;
+/* Write all iovecs, retrying on short writes. Returns 0 on success. */
+static int writev_all(struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(out_fd, iov, iovcnt);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return 0;
+}
+
+/* Number of leading events that form complete frames (0 if none). */
+static size_t complete_frames(const struct input_event *buf, size_t count) {
+    for (size_t i = count; i > 0; i--) {
+        if (buf[i - 1].type == EV_SYN && buf[i - 1].code == SYN_REPORT)
+            return i;
+    }
+    return 0;
+}
+
+/*
+ * Whether a batch only moves the pen, so losing it (see send_datagram)
+ * costs nothing but skipped positions: absolute position, hover distance
+ * and tilt updates.
+ */
+static int is_motion_only(const struct input_event *buf, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        const struct input_event *ev = &buf[i];
+        if (ev->type == EV_SYN && ev->code == SYN_REPORT)
+            continue;
+        if (ev->type == EV_MSC)
+            continue;
+        if (ev->type != EV_ABS)
+            return 0;
+        switch (ev->code) {
+        case ABS_X:
+        case ABS_Y:
+        case ABS_DISTANCE:
+        case ABS_TILT_X:
+        case ABS_TILT_Y:
+            continue;
+        default:
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static size_t put_varint(uint8_t *out, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (uint8_t)v;
+    return n;
+}
+
+static uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+/* Previous value slot for delta-encoded codes, or NULL */
+static int32_t *delta_base(struct compact_state *st, const struct input_event *ev) {
+    if (ev->type != EV_ABS)
+        return NULL;
+    switch (ev->code) {
+    case ABS_X:
+        return &st->last_pos[0];
+    case ABS_Y:
+        return &st->last_pos[1];
+    case ABS_MT_POSITION_X:
+        return &st->last_mt[st->slot][0];
+    case ABS_MT_POSITION_Y:
+        return &st->last_mt[st->slot][1];
+    default:
+        return NULL;
+    }
+}
+
+/*
+ * Compact payload: a sequence of frames, each
+ *   varint zigzag(timestamp delta in us, relative to the previous frame)
+ *   varint (event count << 1 | terminated by SYN_REPORT)
+ *   per event: u8 type, varint code, varint zigzag(value)
+ * The terminating SYN_REPORT itself is not sent. ABS_X/ABS_Y and
+ * ABS_MT_POSITION_X/Y (per slot) are sent as deltas to their last value.
+ */
+static size_t encode_compact(struct compact_state *st, const struct input_event *evs,
+                             size_t count, uint8_t *out) {
+    size_t len = 0;
+    size_t start = 0;
+
+    while (start < count) {
+        size_t end = start;
+        while (end < count && !(evs[end].type == EV_SYN && evs[end].code == SYN_REPORT))
+            end++;
+        int terminated = end < count;
+        const struct input_event *last = &evs[terminated ? end : end - 1];
+
+        int64_t time_us = (int64_t)last->input_event_sec * 1000000 + last->input_event_usec;
+        len += put_varint(out + len, zigzag(time_us - st->last_time_us));
+        st->last_time_us = time_us;
+        len += put_varint(out + len, ((uint64_t)(end - start) << 1) | (uint64_t)terminated);
+
+        for (size_t i = start; i < end; i++) {
+            const struct input_event *ev = &evs[i];
+            int64_t value = ev->value;
+            int32_t *base = delta_base(st, ev);
+            if (base) {
+                value -= *base;
+                *base = ev->value;
+            }
+            if (ev->type == EV_ABS && ev->code == ABS_MT_SLOT)
+                st->slot = ev->value < 0 ? 0 : ev->value >= MT_SLOTS ? MT_SLOTS - 1 : ev->value;
+
+            out[len++] = (uint8_t)ev->type;
+            len += put_varint(out + len, ev->code);
+            len += put_varint(out + len, zigzag(value));
+        }
+
+        start = terminated ? end + 1 : end;
+    }
+
+    return len;
+}
+
+static void init_filter(struct filter *f) {
+    memset(f, 0, sizeof(*f));
+    for (int code = 0; code < FILTER_ABS_CODES; code++) {
+        f->max[code] = INT32_MAX;
+        f->last[code] = UNKNOWN;
+    }
+    for (int slot = 0; slot < MT_SLOTS; slot++) {
+        for (int i = 0; i < MT_CODES; i++)
+            f->last_mt[slot][i] = UNKNOWN;
+    }
+}
+
+static int is_mt_code(uint16_t code) {
+    return code >= ABS_MT_SLOT && code < ABS_MT_SLOT + MT_CODES;
+}
+
+/* Whether a (clamped) ABS value survives its dead-band; records it if so. */
+static int keep_abs(struct filter *f, uint16_t code, int32_t value) {
+    int32_t *last = is_mt_code(code) ? &f->last_mt[f->in_slot][code - ABS_MT_SLOT]
+                                     : &f->last[code];
+
+    if (code == ABS_MT_TRACKING_ID) {
+        /* A new contact: its first position always goes through */
+        for (int i = 0; i < MT_CODES; i++)
+            f->last_mt[f->in_slot][i] = UNKNOWN;
+    }
+
+    int32_t band = f->deadband[code];
+    /* Once clamped, repeats of the limit carry no information */
+    if (f->max[code] != INT32_MAX && band < 1)
+        band = 1;
+    if (band > 0 && *last != UNKNOWN && llabs((int64_t)value - *last) < band)
+        return 0;
+
+    *last = value;
+    return 1;
+}
+
+/*
+ * Apply a device's filters to `count` events, writing the survivors to
+ * `out`, which has room for count + 1. Frames left empty are dropped along
+ * with their SYN_REPORT. ABS_MT_SLOT is forwarded lazily, just before the
+ * next MT event that survives, so a slot whose updates were all dropped
+ * costs nothing; that can add at most one event to the batch.
+ */
+static size_t filter_events(struct filter *f, const struct input_event *in, size_t count,
+                            struct input_event *out) {
+    size_t n = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        struct input_event ev = in[i];
+
+        if (ev.type == EV_SYN && ev.code == SYN_REPORT) {
+            if (f->frame_events > 0)
+                out[n++] = ev;
+            f->frame_events = 0;
+            continue;
+        }
+        if (ev.type < 32 && (f->drop_types & (1u << ev.type)))
+            continue;
+
+        if (ev.type == EV_ABS && ev.code < FILTER_ABS_CODES) {
+            if (ev.code == ABS_MT_SLOT) {
+                f->in_slot = ev.value < 0 ? 0 : ev.value >= MT_SLOTS ? MT_SLOTS - 1 : ev.value;
+                continue;
+            }
+            if (ev.value > f->max[ev.code])
+                ev.value = f->max[ev.code];
+            if (!keep_abs(f, ev.code, ev.value))
+                continue;
+
+            if (is_mt_code(ev.code) && f->in_slot != f->out_slot) {
+                out[n] = ev;
+                out[n].code = ABS_MT_SLOT;
+                out[n].value = f->in_slot;
+                n++;
+                f->frame_events++;
+                f->out_slot = f->in_slot;
+            }
+        }
+
+        out[n++] = ev;
+        f->frame_events++;
+    }
+
+    return n;
+}
+
+static int64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Whether a batch can be merged with held motion: nothing but non-MT ABS
+ * values, with pressure staying on the same side of zero.
+ */
+static int is_mergeable(const struct governor *g, const struct input_event *buf, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        const struct input_event *ev = &buf[i];
+        if (ev->type == EV_SYN && ev->code == SYN_REPORT)
+            continue;
+        if (ev->type == EV_MSC)
+            continue;
+        if (ev->type != EV_ABS || ev->code >= FILTER_ABS_CODES || is_mt_code(ev->code))
+            return 0;
+        if (ev->code == ABS_PRESSURE && (ev->value > 0) != g->touching)
+            return 0;
+    }
+    return 1;
+}
+
+/* Append the held motion to `out` as one frame and forget it. */
+static size_t take_held(struct governor *g, struct input_event *out) {
+    size_t n = 0;
+    for (int code = 0; code < FILTER_ABS_CODES; code++) {
+        if (!(g->mask & (1ull << code)))
+            continue;
+        out[n].time = g->time;
+        out[n].type = EV_ABS;
+        out[n].code = (uint16_t)code;
+        out[n].value = g->value[code];
+        n++;
+    }
+    out[n].time = g->time;
+    out[n].type = EV_SYN;
+    out[n].code = SYN_REPORT;
+    out[n].value = 0;
+    n++;
+
+    g->held = 0;
+    g->mask = 0;
+    return n;
+}
+
+/*
+ * Rate-limit a device's batch (`count` may be 0 to only flush held motion
+ * that is due). Returns the number of events to send now, pointing `*evs`
+ * at them: the batch itself, held motion, or both in `dev->merged`.
+ */
+static size_t govern(struct device *dev, const struct input_event **evs, size_t count,
+                     int64_t now_us) {
+    struct governor *g = &dev->governor;
+    int due = now_us - g->last_sent_us >= rate_interval_us;
+    size_t n = 0;
+
+    if (count > 0 && is_mergeable(g, *evs, count)) {
+        for (size_t i = 0; i < count; i++) {
+            const struct input_event *ev = &(*evs)[i];
+            if (ev->type == EV_ABS) {
+                g->mask |= 1ull << ev->code;
+                g->value[ev->code] = ev->value;
+            }
+        }
+        g->time = (*evs)[count - 1].time;
+        g->held = 1;
+        if (!due)
+            return 0;
+        count = 0;
+    } else if (count > 0) {
+        /* An edge: whatever is held goes first */
+        for (size_t i = 0; i < count; i++) {
+            if ((*evs)[i].type == EV_ABS && (*evs)[i].code == ABS_PRESSURE)
+                g->touching = (*evs)[i].value > 0;
+        }
+        if (!g->held) {
+            g->last_sent_us = now_us;
+            return count;
+        }
+    } else if (!g->held || !due) {
+        return 0;
+    }
+
+    n = take_held(g, dev->merged);
+    memcpy(dev->merged + n, *evs, count * sizeof(dev->merged[0]));
+    *evs = dev->merged;
+    g->last_sent_us = now_us;
+    return n + count;
+}
+
+/* Milliseconds until the first held frame is due, or -1 if none is held. */
+static int held_timeout_ms(const struct device *devices, int ndev, int64_t now_us) {
+    int timeout = -1;
+    for (int i = 0; i < ndev; i++) {
+        const struct governor *g = &devices[i].governor;
+        if (!g->held)
+            continue;
+        int64_t wait_us = g->last_sent_us + rate_interval_us - now_us;
+        int ms = wait_us <= 0 ? 0 : (int)((wait_us + 999) / 1000);
+        if (timeout < 0 || ms < timeout)
+            timeout = ms;
+    }
+    return timeout;
+}
+
+/* Parse "a:b[:c]" into `n` integers (decimal or 0x hex). Returns 0 on success. */
+static int parse_spec(const char *spec, long *vals, int n) {
+    char *end;
+    for (int i = 0; i < n; i++) {
+        vals[i] = strtol(spec, &end, 0);
+        if (end == spec || *end != (i == n - 1 ? '\0' : ':'))
+            return -1;
+        spec = end + 1;
+    }
+    return 0;
+}
+
+/* Read pending events from a device. Returns 0 on success, -1 on error. */
+static int drain_device(struct device *dev) {
+    /* evdev only ever returns whole events */
+    ssize_t n = read(dev->fd, dev->buf + dev->count,
+                     (BATCH_EVENTS - dev->count) * sizeof(dev->buf[0]));
+    if (n < 0 && errno == EINTR)
+        return 0;
+    if (n <= 0 || n % sizeof(dev->buf[0]) != 0)
+        return -1;
+    dev->count += (size_t)n / sizeof(dev->buf[0]);
+
+    /* Flush complete frames; a full buffer without SYN is flushed as-is */
+    dev->ready = complete_frames(dev->buf, dev->count);
+    if (dev->ready == 0 && dev->count == BATCH_EVENTS)
+        dev->ready = dev->count;
+    return 0;
+}
+
+static int open_device(struct device *dev, int grab) {
+    dev->fd = open(dev->path, O_RDONLY);
+    if (dev->fd < 0) {
+        fprintf(stderr, "evgrab: open %s: %s\n", dev->path, strerror(errno));
+        return -1;
+    }
+
+    if (grab && ioctl(dev->fd, EVIOCGRAB, 1) < 0) {
+        fprintf(stderr, "evgrab: grab %s: %s\n", dev->path, strerror(errno));
+        return -1;
+    }
+
+    fprintf(stderr, "evgrab: %s %s\n", grab ? "grabbed" : "opened", dev->path);
+    return 0;
+}
+
+static int write_hello(uint8_t features) {
+    struct {
+        struct frame_header header;
+        uint16_t version;
+        uint16_t features;
+    } hello = {
+        .header = {
+            .device = CONTROL_DEVICE,
+            .flags = CONTROL_HELLO,
+            .length = 2 * sizeof(uint16_t),
+        },
+        .version = PROTOCOL_VERSION,
+        .features = features,
+    };
+    struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+    return writev_all(&iov, 1);
+}
+
+static int write_keepalive(void) {
+    struct frame_header header = { .device = CONTROL_DEVICE, .flags = CONTROL_KEEPALIVE };
+    struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+    return writev_all(&iov, 1);
+}
+
+static int write_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    struct {
+        struct frame_header header;
+        int64_t time_us;
+    } __attribute__((packed)) clock = {
+        .header = {
+            .device = CONTROL_DEVICE,
+            .flags = CONTROL_CLOCK,
+            .length = sizeof(int64_t),
+        },
+        .time_us = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000,
+    };
+    struct iovec iov = { .iov_base = &clock, .iov_len = sizeof(clock) };
+    return writev_all(&iov, 1);
+}
+
+/* Index of a pen motion axis in motion_axes, or -1 */
+static int motion_axis(const struct input_event *ev) {
+    if (ev->type != EV_ABS)
+        return -1;
+    for (int i = 0; i < MOTION_AXES; i++) {
+        if (motion_axes[i] == ev->code)
+            return i;
+    }
+    return -1;
+}
+
+/* Record the motion axes of a batch that goes out over TCP. */
+static void track_motion(struct device *dev, const struct input_event *evs, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        int axis = motion_axis(&evs[i]);
+        if (axis >= 0)
+            dev->motion[axis] = evs[i].value;
+    }
+}
+
+/*
+ * Send a motion-only batch as one raw (never compact, so a lost datagram
+ * can't desynchronise the delta state) FRAME_SEQ datagram. Every frame
+ * carries the value of each motion axis known so far, not just the ones
+ * that changed, so it doesn't depend on any datagram before it. Frames
+ * that don't fit are dropped oldest first. Send errors are ignored: the
+ * batch is expendable.
+ */
+static void send_datagram(struct device *dev, const struct input_event *evs, size_t count) {
+    size_t frames = 0;
+    for (size_t i = 0; i < count; i++)
+        frames += evs[i].type == EV_SYN && evs[i].code == SYN_REPORT;
+    size_t room = DATAGRAM_EVENTS / (MOTION_AXES + 1);
+    size_t skip = frames > room ? frames - room : 0;
+
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        const struct input_event *ev = &evs[i];
+        int axis = motion_axis(ev);
+        if (axis >= 0)
+            dev->motion[axis] = ev->value;
+        if (!(ev->type == EV_SYN && ev->code == SYN_REPORT))
+            continue;
+        if (skip > 0) {
+            skip--;
+            continue;
+        }
+
+        for (int a = 0; a < MOTION_AXES; a++) {
+            if (dev->motion[a] == UNKNOWN)
+                continue;
+            dev->datagram[n] = *ev;
+            dev->datagram[n].type = EV_ABS;
+            dev->datagram[n].code = motion_axes[a];
+            dev->datagram[n].value = dev->motion[a];
+            n++;
+        }
+        dev->datagram[n++] = *ev;
     }
 
-    if (ioctl(fd, EVIOCGRAB, 1) < 0) {
-        fprintf(stderr, "evgrab: grab %s: %s\n", argv[1], strerror(errno));
+    size_t len = n * sizeof(dev->datagram[0]);
+    struct frame_header header = {
+        .device = dev->header.device,
+        .flags = FRAME_SEQ,
+        .length = (uint16_t)(sizeof(dev->seq) + len),
+    };
+    struct iovec iov[3] = {
+        { .iov_base = &header, .iov_len = sizeof(header) },
+        { .iov_base = &dev->seq, .iov_len = sizeof(dev->seq) },
+        { .iov_base = dev->datagram, .iov_len = len },
+    };
+    (void)writev(datagram_fd, iov, 3);
+}
+
+static int write_listen(uint16_t port, const uint8_t *token) {
+    struct {
+        struct frame_header header;
+        uint16_t port;
+        uint8_t token[TOKEN_SIZE];
+    } __attribute__((packed)) listen_frame = {
+        .header = {
+            .device = CONTROL_DEVICE,
+            .flags = CONTROL_LISTEN,
+            .length = sizeof(uint16_t) + TOKEN_SIZE,
+        },
+        .port = port,
+    };
+    memcpy(listen_frame.token, token, TOKEN_SIZE);
+    struct iovec iov = { .iov_base = &listen_frame, .iov_len = sizeof(listen_frame) };
+    return writev_all(&iov, 1);
+}
+
+static int read_token(uint8_t *token) {
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    ssize_t n = read(fd, token, TOKEN_SIZE);
+    close(fd);
+    return n == TOKEN_SIZE ? 0 : -1;
+}
+
+/*
+ * Read exactly `len` bytes, waiting at most `timeout_ms` for each chunk.
+ * On failure errno is ETIMEDOUT or ECONNRESET if the peer was too slow or
+ * closed the connection.
+ */
+static int read_exact(int fd, void *buf, size_t len, int timeout_ms) {
+    size_t have = 0;
+
+    while (have < len) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int ret = poll(&pfd, 1, timeout_ms);
+        if (ret <= 0) {
+            if (ret == 0)
+                errno = ETIMEDOUT;
+            return -1;
+        }
+        ssize_t n = read(fd, (uint8_t *)buf + have, len - have);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == 0)
+                errno = ECONNRESET;
+            return -1;
+        }
+        have += (size_t)n;
+    }
+    return 0;
+}
+
+/*
+ * Check that a new data connection presents the token. Returns 1 if it
+ * does, 0 otherwise.
+ */
+static int check_token(int conn, const uint8_t *token, int timeout_ms) {
+    uint8_t buf[TOKEN_SIZE];
+    if (read_exact(conn, buf, TOKEN_SIZE, timeout_ms) < 0)
+        return 0;
+    return memcmp(buf, token, TOKEN_SIZE) == 0;
+}
+
+/*
+ * Open the UDP socket for motion-only batches, connected to the host's
+ * port on the data connection's peer.
+ */
+static int open_datagram_socket(int conn, uint16_t port) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getpeername(conn, (struct sockaddr *)&addr, &addr_len) < 0)
+        return -1;
+    addr.sin_port = htons(port);
+
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
         close(fd);
-        return 1;
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Listen on an ephemeral TCP port, announce it on stdout and wait for the
+ * host to connect with the token (and, with `datagrams`, its UDP port).
+ * Returns the connection, or -1.
+ */
+static int open_data_connection(int datagrams) {
+    uint8_t token[TOKEN_SIZE];
+    if (read_token(token) < 0) {
+        fprintf(stderr, "evgrab: /dev/urandom: %s\n", strerror(errno));
+        return -1;
+    }
+
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        fprintf(stderr, "evgrab: socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_ANY) };
+    socklen_t addr_len = sizeof(addr);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 1) < 0 ||
+        getsockname(sock, (struct sockaddr *)&addr, &addr_len) < 0) {
+        fprintf(stderr, "evgrab: listen: %s\n", strerror(errno));
+        close(sock);
+        return -1;
     }
 
-    fprintf(stderr, "evgrab: grabbed %s\n", argv[1]);
+    if (write_listen(ntohs(addr.sin_port), token) < 0) {
+        close(sock);
+        return -1;
+    }
 
-    struct input_event ev;
-    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += ACCEPT_TIMEOUT_MS / 1000;
 
+    int conn = -1;
     while (running) {
-        /* Check watchdog every poll cycle */
-        if (!check_watchdog()) {
-            fprintf(stderr, "evgrab: watchdog stale, exiting\n");
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int remaining_ms = (int)((deadline.tv_sec - now.tv_sec) * 1000 +
+                                 (deadline.tv_nsec - now.tv_nsec) / 1000000);
+        if (remaining_ms <= 0) {
+            fprintf(stderr, "evgrab: no data connection from host\n");
             break;
         }
 
-        int ret = poll(&pfd, 1, 1000); /* 1 second timeout */
-        if (ret < 0 && errno != EINTR)
-            break;
-        if (ret <= 0)
+        struct pollfd pfd = { .fd = sock, .events = POLLIN };
+        if (poll(&pfd, 1, remaining_ms) <= 0)
             continue;
 
-        ssize_t n = read(fd, &ev, sizeof(ev));
-        if (n != sizeof(ev))
+        conn = accept(sock, NULL, NULL);
+        if (conn < 0)
+            continue;
+        if (!check_token(conn, token, remaining_ms)) {
+            fprintf(stderr, "evgrab: rejected data connection without token\n");
+        } else if (!datagrams) {
             break;
+        } else {
+            uint16_t port;
+            if (read_exact(conn, &port, sizeof(port), remaining_ms) < 0) {
+                fprintf(stderr, "evgrab: reading the udp port: %s\n", strerror(errno));
+            } else {
+                datagram_fd = open_datagram_socket(conn, port);
+                if (datagram_fd >= 0)
+                    break;
+                fprintf(stderr, "evgrab: udp: %s\n", strerror(errno));
+            }
+        }
+        close(conn);
+        conn = -1;
+    }
+    close(sock);
 
-        if (write(STDOUT_FILENO, &ev, sizeof(ev)) != sizeof(ev))
+    if (conn >= 0) {
+        int one = 1;
+        setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return conn;
+}
+
+/*
+ * Write synthetic pen frames (position, pressure, distance, tilt, SYN) to
+ * `fd` as fast as it takes them, with timestamps 2 ms apart, until the
+ * reader goes away.
+ */
+static void selftest_producer(int fd) {
+    static const uint16_t codes[] = {
+        ABS_X, ABS_Y, ABS_PRESSURE, ABS_DISTANCE, ABS_TILT_X, ABS_TILT_Y,
+    };
+    enum { FRAME_EVENTS = sizeof(codes) / sizeof(codes[0]) + 1 };
+    struct input_event evs[SELFTEST_FRAMES * FRAME_EVENTS];
+    int64_t time_us = 0;
+
+    memset(evs, 0, sizeof(evs));
+    for (;;) {
+        for (int f = 0; f < SELFTEST_FRAMES; f++) {
+            struct input_event *frame = &evs[f * FRAME_EVENTS];
+            time_us += 2000;
+            for (int i = 0; i < FRAME_EVENTS; i++) {
+                int syn = i == FRAME_EVENTS - 1;
+                frame[i].input_event_sec = time_us / 1000000;
+                frame[i].input_event_usec = time_us % 1000000;
+                frame[i].type = syn ? EV_SYN : EV_ABS;
+                frame[i].code = syn ? SYN_REPORT : codes[i];
+                frame[i].value = syn ? 0 : (int32_t)((time_us / 2000 + i * 37) % 4096);
+            }
+        }
+        if (write(fd, evs, sizeof(evs)) < 0 && errno != EINTR)
+            return;
+    }
+}
+
+/*
+ * Push synthetic pen frames from a child process through a pipe and the
+ * same read, compact encoding and writev steps as the forwarding loop (to
+ * /dev/null) for SELFTEST_SECONDS, and report on stdout the sustained rate
+ * and the system calls and CPU time each event cost. The producer always
+ * keeps the pipe full, so this is the most the helper can forward; at the
+ * devices' real rates it reads fewer events per call.
+ */
+static int selftest(void) {
+    static struct device dev;
+    int fds[2];
+    if (pipe(fds) < 0) {
+        fprintf(stderr, "evgrab: pipe: %s\n", strerror(errno));
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t child = fork();
+    if (child < 0) {
+        fprintf(stderr, "evgrab: fork: %s\n", strerror(errno));
+        return 1;
+    }
+    if (child == 0) {
+        close(fds[0]);
+        selftest_producer(fds[1]);
+        _exit(0);
+    }
+    close(fds[1]);
+
+    dev.path = "selftest";
+    dev.fd = fds[0];
+    out_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (out_fd < 0) {
+        fprintf(stderr, "evgrab: /dev/null: %s\n", strerror(errno));
+        return 1;
+    }
+
+    struct pollfd pfd = { .fd = dev.fd, .events = POLLIN };
+    uint64_t events = 0;
+    uint64_t syscalls = 0;
+    struct timespec cpu_start, cpu_end;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+    int64_t start_us = monotonic_us();
+    int64_t elapsed_us = 0;
+    int status = 0;
+
+    while (elapsed_us < SELFTEST_SECONDS * 1000000) {
+        syscalls += 2;
+        if (poll(&pfd, 1, -1) < 0 || drain_device(&dev) < 0) {
+            status = 1;
             break;
+        }
+        if (dev.ready > 0) {
+            struct iovec iov[2] = {
+                { .iov_base = &dev.header, .iov_len = sizeof(dev.header) },
+                { .iov_base = dev.packed },
+            };
+            dev.header.length =
+                (uint16_t)encode_compact(&dev.compact, dev.buf, dev.ready, dev.packed);
+            iov[1].iov_len = dev.header.length;
+            syscalls++;
+            if (writev_all(iov, 2) < 0) {
+                status = 1;
+                break;
+            }
+            events += dev.ready;
+            dev.count -= dev.ready;
+            memmove(dev.buf, dev.buf + dev.ready, dev.count * sizeof(dev.buf[0]));
+        }
+        elapsed_us = monotonic_us() - start_us;
     }
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
 
-    close(fd);
+    /* The producer stops once its next write fails */
+    close(dev.fd);
+    close(out_fd);
+    waitpid(child, NULL, 0);
+    if (status != 0 || events == 0) {
+        fprintf(stderr, "evgrab: selftest failed: %s\n", strerror(errno));
+        return 1;
+    }
+
+    double cpu_ns = (double)(cpu_end.tv_sec - cpu_start.tv_sec) * 1e9 +
+                    (double)(cpu_end.tv_nsec - cpu_start.tv_nsec);
+    printf("variant=%s events=%llu seconds=%.2f events_per_s=%.0f syscalls_per_event=%.3f "
+           "cpu_ns_per_event=%.0f\n",
+           EVGRAB_VARIANT, (unsigned long long)events, elapsed_us / 1e6, events * 1e6 / elapsed_us,
+           (double)syscalls / events, cpu_ns / events);
     return 0;
 }
+
+int main(int argc, char **argv) {
+    static struct device devices[MAX_DEVICES];
+    int grab = 1;
+    uint8_t features = 0;
+    int tcp = 0;
+    int datagrams = 0;
+    int opt;
+    long spec[3];
+
+    if (argc == 2 && strcmp(argv[1], "--selftest") == 0)
+        return selftest();
+
+    for (int i = 0; i < MAX_DEVICES; i++) {
+        init_filter(&devices[i].filter);
+        for (int a = 0; a < MOTION_AXES; a++)
+            devices[i].motion[a] = UNKNOWN;
+    }
+
+    while ((opt = getopt(argc, argv, "nclud:z:x:r:")) != -1) {
+        switch (opt) {
+        case 'n':
+            grab = 0;
+            break;
+        case 'c':
+            features |= FRAME_COMPACT;
+            break;
+        case 'l':
+            tcp = 1;
+            break;
+        case 'u':
+            tcp = 1;
+            datagrams = 1;
+            break;
+        case 'd':
+        case 'z':
+            if (parse_spec(optarg, spec, 3) < 0 || spec[0] < 0 || spec[0] >= MAX_DEVICES ||
+                spec[1] < 0 || spec[1] >= FILTER_ABS_CODES)
+                goto usage;
+            if (opt == 'd')
+                devices[spec[0]].filter.deadband[spec[1]] = (int32_t)spec[2];
+            else
+                devices[spec[0]].filter.max[spec[1]] = (int32_t)spec[2];
+            devices[spec[0]].filter.active = 1;
+            break;
+        case 'x':
+            if (parse_spec(optarg, spec, 2) < 0 || spec[0] < 0 || spec[0] >= MAX_DEVICES ||
+                spec[1] < 0 || spec[1] >= 32)
+                goto usage;
+            devices[spec[0]].filter.drop_types |= 1u << spec[1];
+            devices[spec[0]].filter.active = 1;
+            break;
+        case 'r':
+            if (parse_spec(optarg, spec, 1) < 0 || spec[0] <= 0 || spec[0] > 1000000)
+                goto usage;
+            rate_interval_us = 1000000 / spec[0];
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    int ndev = argc - optind;
+    if (ndev < 1 || ndev > MAX_DEVICES)
+        goto usage;
+
+    signal(SIGTERM, handle_signal);
+    signal(SIGINT, handle_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* One slot per device, then stdin for the host's heartbeat and the ticker */
+    struct pollfd pfds[MAX_DEVICES + 2];
+    int ticker = -1;
+    int status = 1;
+
+    for (int i = 0; i < ndev; i++)
+        devices[i].fd = -1;
+
+    for (int i = 0; i < ndev; i++) {
+        devices[i].path = argv[optind + i];
+        devices[i].header.device = (uint8_t)i;
+        devices[i].header.flags = features | (datagrams ? FRAME_SEQ : 0);
+        if (open_device(&devices[i], grab) < 0)
+            goto out;
+        pfds[i].fd = devices[i].fd;
+        pfds[i].events = POLLIN;
+    }
+
+    ticker = open_ticker();
+    if (ticker < 0) {
+        fprintf(stderr, "evgrab: timerfd: %s\n", strerror(errno));
+        goto out;
+    }
+
+    pfds[ndev].fd = STDIN_FILENO;
+    pfds[ndev].events = POLLIN;
+    pfds[ndev + 1].fd = ticker;
+    pfds[ndev + 1].events = POLLIN;
+
+    if (write_hello(features) < 0)
+        goto out;
+
+    if (tcp) {
+        out_fd = open_data_connection(datagrams);
+        if (out_fd < 0)
+            goto out;
+        if (write_hello(features) < 0)
+            goto out;
+    }
+
+    uint64_t silent_ticks = 0; /* ticks since the last heartbeat */
+    int wrote = 0;             /* frames written since the last tick */
+
+    /* From here on only a signal or the host closing the stream is a clean exit */
+    status = 0;
+
+    while (running) {
+        int timeout = rate_interval_us > 0 ? held_timeout_ms(devices, ndev, monotonic_us()) : -1;
+        int ret = poll(pfds, (nfds_t)ndev + 2, timeout);
+        if (ret < 0 && errno != EINTR) {
+            status = 1;
+            break;
+        }
+        if (ret < 0 || (ret == 0 && timeout < 0))
+            continue;
+        int64_t now_us = rate_interval_us > 0 ? monotonic_us() : 0;
+
+        if (pfds[ndev + 1].revents & POLLIN) {
+            silent_ticks += read_ticks(ticker);
+            if (silent_ticks > WATCHDOG_TIMEOUT) {
+                fprintf(stderr, "evgrab: no heartbeat from host, exiting\n");
+                status = 1;
+                break;
+            }
+            if (!wrote && write_keepalive() < 0) {
+                status = 1;
+                break;
+            }
+            wrote = 0;
+        }
+
+        if (pfds[ndev].revents & (POLLIN | POLLHUP | POLLERR)) {
+            int ping = read_heartbeat();
+            if (ping < 0) {
+                fprintf(stderr, "evgrab: host closed the stream, exiting\n");
+                break;
+            }
+            if (ping && write_clock() < 0) {
+                status = 1;
+                break;
+            }
+            silent_ticks = 0;
+        }
+
+        /* Gather the complete frames of every ready device into one write */
+        struct iovec iov[3 * MAX_DEVICES];
+        int iovcnt = 0;
+        int failed = 0;
+
+        for (int i = 0; i < ndev; i++) {
+            struct device *dev = &devices[i];
+            dev->ready = 0;
+
+            if (pfds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                fprintf(stderr, "evgrab: %s went away\n", dev->path);
+                failed = 1;
+                break;
+            }
+
+            const struct input_event *evs = dev->buf;
+            size_t nevs = 0;
+            if (pfds[i].revents & POLLIN) {
+                if (drain_device(dev) < 0) {
+                    failed = 1;
+                    break;
+                }
+                nevs = dev->ready;
+                if (nevs > 0 && dev->filter.active) {
+                    evs = dev->filtered;
+                    nevs = filter_events(&dev->filter, dev->buf, dev->ready, dev->filtered);
+                }
+            }
+            /* Held motion may be due even when the device is quiet */
+            if (rate_interval_us > 0)
+                nevs = govern(dev, &evs, nevs, now_us);
+            if (nevs == 0)
+                continue;
+
+            if (datagram_fd >= 0) {
+                dev->seq++;
+                if (is_motion_only(evs, nevs)) {
+                    send_datagram(dev, evs, nevs);
+                    continue;
+                }
+                track_motion(dev, evs, nevs);
+            }
+
+            iov[iovcnt].iov_base = &dev->header;
+            iov[iovcnt].iov_len = sizeof(dev->header);
+            iovcnt++;
+            if (datagram_fd >= 0) {
+                iov[iovcnt].iov_base = &dev->seq;
+                iov[iovcnt].iov_len = sizeof(dev->seq);
+                iovcnt++;
+            }
+            if (features & FRAME_COMPACT) {
+                dev->header.length = (uint16_t)encode_compact(&dev->compact, evs, nevs,
+                                                              dev->packed);
+                iov[iovcnt].iov_base = dev->packed;
+            } else {
+                dev->header.length = (uint16_t)(nevs * sizeof(evs[0]));
+                iov[iovcnt].iov_base = (void *)evs;
+            }
+            iov[iovcnt].iov_len = dev->header.length;
+            iovcnt++;
+            if (datagram_fd >= 0)
+                dev->header.length += sizeof(dev->seq);
+        }
+
+        if (failed) {
+            status = 1;
+            break;
+        }
+        if (iovcnt > 0) {
+            if (writev_all(iov, iovcnt) < 0) {
+                status = 1;
+                break;
+            }
+            wrote = 1;
+        }
+
+        for (int i = 0; i < ndev; i++) {
+            struct device *dev = &devices[i];
+            if (dev->ready == 0)
+                continue;
+            dev->count -= dev->ready;
+            memmove(dev->buf, dev->buf + dev->ready, dev->count * sizeof(dev->buf[0]));
+        }
+    }
+
+out:
+    for (int i = 0; i < ndev; i++) {
+        if (devices[i].fd >= 0)
+            close(devices[i].fd);
+    }
+    if (ticker >= 0)
+        close(ticker);
+    if (out_fd != STDOUT_FILENO && out_fd >= 0)
+        close(out_fd);
+    if (datagram_fd >= 0)
+        close(datagram_fd);
+    return status;
+
+usage:
+    fprintf(stderr,
+            "Usage: %s [-n] [-c] [-l] [-u] [-d dev:code:band] [-z dev:code:max] [-x dev:type] "
+            "[-r hz] <device>...\n"
+            "       %s --selftest\n",
+            argv[0], argv[0]);
+    return 1;
+}
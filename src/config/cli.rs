@@ -2,6 +2,7 @@ use clap::{Parser, Subcommand};
 use std::path::PathBuf;
 
 use crate::orientation::Orientation;
+use crate::transport::Transport;
 
 #[derive(Parser)]
 #[command(name = "rm-pad")]
@@ -11,9 +12,10 @@ pub struct Cli {
     #[command(subcommand)]
     pub command: Option<Command>,
 
-    /// reMarkable host (IP or hostname)
-    #[arg(long, env = "RMPAD_HOST")]
-    pub host: Option<String>,
+    /// reMarkable host (IP or hostname); repeat, or separate with commas,
+    /// to drive several tablets
+    #[arg(long, env = "RMPAD_HOST", value_delimiter = ',')]
+    pub host: Vec<String>,
 
     /// SSH key path for authentication
     #[arg(long)]
@@ -55,10 +57,53 @@ pub struct Cli {
     #[arg(long)]
     pub palm_grace_ms: Option<u64>,
 
+    /// Send raw input_events instead of the compact frame encoding
+    #[arg(long)]
+    pub no_compact_stream: bool,
+
+    /// Extrapolate the pen position this many milliseconds ahead (0 = off)
+    #[arg(long)]
+    pub pen_prediction_ms: Option<u64>,
+
+    /// Drop touch position changes smaller than this at the tablet (device
+    /// units, 0 = off)
+    #[arg(long)]
+    pub touch_deadband: Option<u32>,
+
+    /// Drop pen hover distance changes smaller than this at the tablet
+    /// (device units, 0 = off)
+    #[arg(long)]
+    pub hover_deadband: Option<u32>,
+
+    /// Report pen hover distances beyond this as this value (0 = off)
+    #[arg(long)]
+    pub hover_distance_max: Option<u32>,
+
+    /// Forward at most this many motion-only frames per second; contact,
+    /// pressure and button changes always go out at once (0 = unlimited)
+    #[arg(long)]
+    pub output_rate_hz: Option<u32>,
+
+    /// Write input this many milliseconds after the tablet captured it,
+    /// keeping its original spacing through network bursts (0 = off)
+    #[arg(long)]
+    pub pacing_ms: Option<u64>,
+
     /// Screen orientation (portrait, landscape-right, landscape-left, inverted)
     #[arg(long, value_parser = clap::value_parser!(Orientation))]
     pub orientation: Option<Orientation>,
 
+    /// How input travels from the tablet: ssh (encrypted), tcp (plain TCP
+    /// set up over SSH, for trusted links) or udp (tcp, with pen motion
+    /// over UDP)
+    #[arg(long, value_parser = clap::value_parser!(Transport))]
+    pub transport: Option<Transport>,
+
+    /// Unix socket for stats and control commands [default:
+    /// $XDG_RUNTIME_DIR/rm-pad.sock; empty = off]
+    #[arg(long)]
+    pub control_socket: Option<String>,
+
     /// Path to config file
     #[arg(long, env = "RMPAD_CONFIG")]
     pub config: Option<PathBuf>,
@@ -70,5 +115,24 @@ pub enum Command {
     Dump {
         /// Device to dump: "touch" or "pen"
         device: String,
+
+        /// Also record the raw events (with timestamps) to FILE
+        #[arg(long, value_name = "FILE")]
+        record: Option<PathBuf>,
+    },
+
+    /// Benchmark the grab helper on the tablet: events per second it can
+    /// forward, and the system calls and CPU time each event costs
+    Selftest,
+
+    /// Replay a recording through the input pipeline and report its cost
+    #[cfg(feature = "bench")]
+    Bench {
+        /// Recording made with `dump --record`
+        file: PathBuf,
+
+        /// Number of passes over the recording
+        #[arg(long, default_value_t = 20)]
+        iterations: u32,
     },
 }
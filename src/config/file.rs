@@ -1,7 +1,9 @@
 use serde::Deserialize;
+use std::collections::HashMap;
 use std::path::{Path, PathBuf};
 
 use crate::orientation::Orientation;
+use crate::transport::Transport;
 
 const DEFAULT_HOST: &str = "10.11.99.1";
 
@@ -10,6 +12,8 @@ const DEFAULT_HOST: &str = "10.11.99.1";
 pub struct FileConfig {
     #[serde(default = "default_host")]
     pub host: String,
+    /// Several tablets; replaces `host` when set.
+    pub hosts: Option<Vec<String>>,
     pub key_path: Option<String>,
     pub password: Option<String>,
     pub pen_device: Option<String>,
@@ -24,13 +28,42 @@ pub struct FileConfig {
     pub no_palm_rejection: bool,
     pub palm_grace_ms: Option<u64>,
     #[serde(default)]
+    pub no_compact_stream: bool,
+    pub pen_prediction_ms: Option<u64>,
+    pub touch_deadband: Option<u32>,
+    pub hover_deadband: Option<u32>,
+    pub hover_distance_max: Option<u32>,
+    pub output_rate_hz: Option<u32>,
+    pub pacing_ms: Option<u64>,
+    #[serde(default)]
     pub orientation: Orientation,
+    #[serde(default)]
+    pub transport: Transport,
+    pub control_socket: Option<String>,
+    /// Settings for single tablets, by host.
+    #[serde(default)]
+    pub tablets: HashMap<String, TabletConfig>,
+}
+
+/// A `[tablets."<host>"]` table: settings for one tablet that override the
+/// ones above for it.
+#[derive(Debug, Default, Clone, Deserialize)]
+#[serde(deny_unknown_fields)]
+pub struct TabletConfig {
+    pub key_path: Option<String>,
+    pub password: Option<String>,
+    pub pen_device: Option<String>,
+    pub touch_device: Option<String>,
+    pub touch_only: Option<bool>,
+    pub pen_only: Option<bool>,
+    pub orientation: Option<Orientation>,
 }
 
 impl Default for FileConfig {
     fn default() -> Self {
         Self {
             host: DEFAULT_HOST.into(),
+            hosts: None,
             grab_input: true,
             key_path: None,
             password: None,
@@ -40,7 +73,17 @@ impl Default for FileConfig {
             pen_only: false,
             no_palm_rejection: false,
             palm_grace_ms: None,
+            no_compact_stream: false,
+            pen_prediction_ms: None,
+            touch_deadband: None,
+            hover_deadband: None,
+            hover_distance_max: None,
+            output_rate_hz: None,
+            pacing_ms: None,
             orientation: Orientation::default(),
+            transport: Transport::default(),
+            control_socket: None,
+            tablets: HashMap::new(),
         }
     }
 }
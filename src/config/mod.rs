@@ -3,10 +3,12 @@ mod file;
 
 pub use cli::{Cli, Command};
 
+use std::collections::HashMap;
 use std::path::PathBuf;
 
 use crate::device::DeviceProfile;
 use crate::orientation::Orientation;
+use crate::transport::Transport;
 
 /// Authentication method for SSH connection.
 #[derive(Clone)]
@@ -18,7 +20,10 @@ pub enum Auth {
 /// Merged configuration from CLI args and TOML file.
 #[derive(Debug, Clone)]
 pub struct Config {
+    /// The tablet this config connects to: the first of `hosts` until
+    /// `for_host` picks another.
     pub host: String,
+    pub hosts: Vec<String>,
     pub key_path: Option<String>,
     pub password: Option<String>,
     pub pen_device: String,
@@ -28,7 +33,20 @@ pub struct Config {
     pub grab_input: bool,
     pub no_palm_rejection: bool,
     pub palm_grace_ms: u64,
+    pub no_compact_stream: bool,
+    pub pen_prediction_ms: u64,
+    pub touch_deadband: u32,
+    pub hover_deadband: u32,
+    pub hover_distance_max: u32,
+    pub output_rate_hz: u32,
+    pub pacing_ms: u64,
     pub orientation: Orientation,
+    pub transport: Transport,
+    /// Where to serve stats and commands; `None` when disabled.
+    pub control_socket: Option<PathBuf>,
+    /// Per-tablet settings from the file, less those the command line sets;
+    /// `for_host` applies them.
+    tablets: HashMap<String, file::TabletConfig>,
 }
 
 impl Config {
@@ -41,8 +59,40 @@ impl Config {
             .or_else(file::load_from_default_paths)
             .unwrap_or_default();
 
-        Self {
-            host: cli.host.clone().unwrap_or(file_config.host),
+        let hosts = match (&cli.host[..], file_config.hosts) {
+            ([], Some(hosts)) if !hosts.is_empty() => hosts,
+            ([], _) => vec![file_config.host],
+            (hosts, _) => hosts.to_vec(),
+        };
+
+        // The command line overrides the per-tablet settings too; picking
+        // the streams there picks them for every tablet
+        let mut tablets = file_config.tablets;
+        for tablet in tablets.values_mut() {
+            if cli.key_path.is_some() {
+                tablet.key_path = None;
+            }
+            if cli.password.is_some() {
+                tablet.password = None;
+            }
+            if cli.pen_device.is_some() {
+                tablet.pen_device = None;
+            }
+            if cli.touch_device.is_some() {
+                tablet.touch_device = None;
+            }
+            if cli.touch_only || cli.pen_only {
+                tablet.touch_only = None;
+                tablet.pen_only = None;
+            }
+            if cli.orientation.is_some() {
+                tablet.orientation = None;
+            }
+        }
+
+        let config = Self {
+            host: hosts[0].clone(),
+            hosts,
             key_path: cli.key_path.clone().or(file_config.key_path),
             password: cli.password.clone().or(file_config.password),
             pen_device: cli
@@ -65,8 +115,56 @@ impl Config {
                 .palm_grace_ms
                 .or(file_config.palm_grace_ms)
                 .unwrap_or(500),
+            no_compact_stream: cli.no_compact_stream || file_config.no_compact_stream,
+            pen_prediction_ms: cli
+                .pen_prediction_ms
+                .or(file_config.pen_prediction_ms)
+                .unwrap_or(0),
+            touch_deadband: cli.touch_deadband.or(file_config.touch_deadband).unwrap_or(0),
+            hover_deadband: cli.hover_deadband.or(file_config.hover_deadband).unwrap_or(0),
+            hover_distance_max: cli
+                .hover_distance_max
+                .or(file_config.hover_distance_max)
+                .unwrap_or(0),
+            output_rate_hz: cli.output_rate_hz.or(file_config.output_rate_hz).unwrap_or(0),
+            pacing_ms: cli.pacing_ms.or(file_config.pacing_ms).unwrap_or(0),
             orientation: cli.orientation.unwrap_or(file_config.orientation),
+            transport: cli.transport.unwrap_or(file_config.transport),
+            control_socket: control_socket_path(cli.control_socket.clone().or(file_config.control_socket)),
+            tablets,
+        };
+        config.for_host(&config.host)
+    }
+
+    /// This config, connecting to `host` with the settings for it.
+    pub fn for_host(&self, host: &str) -> Self {
+        let mut config = Self {
+            host: host.into(),
+            ..self.clone()
+        };
+        let Some(tablet) = self.tablets.get(host) else {
+            return config;
+        };
+
+        if let Some(key_path) = &tablet.key_path {
+            config.key_path = Some(key_path.clone());
+        }
+        if let Some(password) = &tablet.password {
+            config.password = Some(password.clone());
         }
+        if let Some(pen_device) = &tablet.pen_device {
+            config.pen_device = pen_device.clone();
+        }
+        if let Some(touch_device) = &tablet.touch_device {
+            config.touch_device = touch_device.clone();
+        }
+        // Picking the streams for a tablet replaces the choice for all
+        if tablet.touch_only.is_some() || tablet.pen_only.is_some() {
+            config.touch_only = tablet.touch_only.unwrap_or(false);
+            config.pen_only = tablet.pen_only.unwrap_or(false);
+        }
+        config.orientation = tablet.orientation.unwrap_or(config.orientation);
+        config
     }
 
     pub fn auth(&self) -> Auth {
@@ -96,6 +194,16 @@ impl Config {
     }
 }
 
+/// The configured control socket, defaulting to one in the user's runtime
+/// directory; an empty path turns it off.
+fn control_socket_path(configured: Option<String>) -> Option<PathBuf> {
+    match configured {
+        Some(path) if path.is_empty() => None,
+        Some(path) => Some(expand_tilde(&path)),
+        None => std::env::var_os("XDG_RUNTIME_DIR").map(|dir| PathBuf::from(dir).join("rm-pad.sock")),
+    }
+}
+
 /// Expand a leading `~` or `~/` to the user's home directory.
 fn expand_tilde(path: &str) -> PathBuf {
     if path == "~" {
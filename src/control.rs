@@ -0,0 +1,484 @@
+//! Control socket: live counters for monitoring, and commands that change
+//! a running rm-pad without restarting the SSH streams.
+//!
+//! A client connects, writes one line and reads the answer until the
+//! socket closes:
+//!
+//! - `stats`: the counters in the Prometheus text format
+//! - `pause pen|touch`, `resume pen|touch`: stop or restart forwarding one
+//!   stream (a paused stream is lifted and its frames dropped)
+//! - `palm-grace MS`: set the palm rejection grace period
+//! - `orientation NAME`: switch orientation, as the rotation signals do
+//! - `reload`: re-read the config file and apply what can change live
+//!   (palm grace and orientation)
+//!
+//! Commands are answered with `ok` or `error: ...` once they are queued
+//! for every tablet's forwarding loop, which applies them between frames,
+//! also while the tablet is disconnected. Stats are labelled with the
+//! tablet's host.
+
+use std::fs;
+use std::io::{self, BufRead, BufReader, Read, Write};
+use std::mem::MaybeUninit;
+use std::os::fd::{AsRawFd, FromRawFd, OwnedFd, RawFd};
+use std::os::unix::fs::PermissionsExt;
+use std::os::unix::net::{UnixListener, UnixStream};
+use std::path::Path;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::mpsc::{self, Receiver, Sender};
+use std::sync::{Arc, Mutex};
+use std::time::Duration;
+
+use crate::config::Config;
+use crate::input::{LatencySnapshot, Quantiles, Rotation, RotationSignals};
+use crate::orientation::Orientation;
+
+/// A client gets this long to send its request and take the answer.
+const CLIENT_TIMEOUT: Duration = Duration::from_secs(2);
+
+/// Longest request line; anything longer is not a command.
+const MAX_REQUEST: u64 = 256;
+
+/// Counters for one input stream.
+#[derive(Default)]
+pub struct StreamCounters {
+    /// Frames received from the tablet.
+    pub frames_in: AtomicU64,
+    /// Frames written to the virtual device.
+    pub frames_out: AtomicU64,
+}
+
+/// Counters shared between a tablet's forwarding loop and the control
+/// socket. The loop only stores into them, so reading never slows it down.
+#[derive(Default)]
+pub struct Metrics {
+    pub pen: StreamCounters,
+    pub touch: StreamCounters,
+    /// Bytes of helper frames received, including control frames.
+    pub bytes_received: AtomicU64,
+    /// Touch frames that had a contact held back as a palm.
+    pub palm_suppressed: AtomicU64,
+    /// Helper connections set up since start.
+    pub connections: AtomicU64,
+    pub connected: AtomicBool,
+    /// Published on every heartbeat rather than per frame.
+    latency: Mutex<LatencySnapshot>,
+}
+
+pub type SharedMetrics = Arc<Metrics>;
+
+impl Metrics {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    pub fn publish_latency(&self, snapshot: LatencySnapshot) {
+        *self.latency.lock().unwrap() = snapshot;
+    }
+}
+
+/// One tablet as the control socket sees it.
+pub struct Tablet {
+    pub host: String,
+    pub metrics: SharedMetrics,
+    pub commands: CommandSender,
+}
+
+/// Every tablet's counters in the Prometheus text exposition format.
+fn render(tablets: &[Tablet]) -> String {
+    let mut out = Exposition { text: String::new(), tablets };
+    let load = |counter: &AtomicU64| counter.load(Ordering::Relaxed);
+    let unlabelled = |value| vec![(String::new(), value)];
+
+    out.family("rmpad_frames_in_total", "counter", "Input frames received from the tablet", |metrics, _| {
+        per_stream(metrics, |counters| load(&counters.frames_in))
+    });
+    out.family("rmpad_frames_out_total", "counter", "Frames written to the virtual devices", |metrics, _| {
+        per_stream(metrics, |counters| load(&counters.frames_out))
+    });
+    out.family("rmpad_bytes_received_total", "counter", "Bytes received from the helper", |metrics, _| {
+        unlabelled(load(&metrics.bytes_received))
+    });
+    out.family("rmpad_palm_suppressed_total", "counter", "Touch frames with a palm held back", |metrics, _| {
+        unlabelled(load(&metrics.palm_suppressed))
+    });
+    out.family("rmpad_reconnects_total", "counter", "Connections set up after the first", |metrics, _| {
+        unlabelled(load(&metrics.connections).saturating_sub(1))
+    });
+    out.family("rmpad_connected", "gauge", "Whether input is being forwarded", |metrics, _| {
+        unlabelled(metrics.connected.load(Ordering::Relaxed) as u64)
+    });
+    out.family("rmpad_heartbeat_rtt_microseconds", "gauge", "Round trip of the last heartbeat", |_, latency| {
+        latency.rtt_us.map_or_else(Vec::new, |rtt_us| unlabelled(rtt_us as u64))
+    });
+
+    out.family(
+        "rmpad_latency_microseconds",
+        "gauge",
+        "Latency percentiles over the current 30 s reporting interval",
+        |_, latency| {
+            let mut samples = Vec::new();
+            for (stream, stage, quantiles) in latency_stages(latency) {
+                for (quantile, value) in [("0.5", quantiles.p50), ("0.99", quantiles.p99), ("1", quantiles.max)] {
+                    let labels = format!("{},stage=\"{}\",quantile=\"{}\"", stream_label(stream), stage, quantile);
+                    samples.push((labels, value));
+                }
+            }
+            samples
+        },
+    );
+    out.family("rmpad_latency_frames", "gauge", "Frames behind the latency percentiles", |_, latency| {
+        latency_stages(latency)
+            .map(|(stream, stage, quantiles)| {
+                (format!("{},stage=\"{}\"", stream_label(stream), stage), quantiles.count)
+            })
+            .collect()
+    });
+    out.text
+}
+
+struct Exposition<'a> {
+    text: String,
+    tablets: &'a [Tablet],
+}
+
+impl Exposition<'_> {
+    /// Write one metric family. `samples` gives a tablet's values, with
+    /// any labels besides `tablet`.
+    fn family(
+        &mut self,
+        name: &str,
+        ty: &str,
+        help: &str,
+        samples: impl Fn(&Metrics, &LatencySnapshot) -> Vec<(String, u64)>,
+    ) {
+        self.text += &format!("# HELP {} {}\n# TYPE {} {}\n", name, help, name, ty);
+        for tablet in self.tablets {
+            let latency = *tablet.metrics.latency.lock().unwrap();
+            for (labels, value) in samples(&tablet.metrics, &latency) {
+                self.text += &format!("{}{{tablet=\"{}\"{}}} {}\n", name, tablet.host, labels, value);
+            }
+        }
+    }
+}
+
+fn per_stream(metrics: &Metrics, value: impl Fn(&StreamCounters) -> u64) -> Vec<(String, u64)> {
+    vec![
+        (stream_label("pen"), value(&metrics.pen)),
+        (stream_label("touch"), value(&metrics.touch)),
+    ]
+}
+
+fn stream_label(stream: &str) -> String {
+    format!(",stream=\"{}\"", stream)
+}
+
+/// The stages with samples in this interval, per stream.
+fn latency_stages(latency: &LatencySnapshot) -> impl Iterator<Item = (&'static str, &'static str, Quantiles)> {
+    [("pen", latency.pen), ("touch", latency.touch)]
+        .into_iter()
+        .flat_map(|(stream, stages)| {
+            ["transit", "processing"]
+                .into_iter()
+                .zip(stages)
+                .map(move |(stage, quantiles)| (stream, stage, quantiles))
+        })
+        .filter(|(_, _, quantiles)| quantiles.count > 0)
+}
+
+/// Which stream a command applies to.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Target {
+    Pen,
+    Touch,
+}
+
+/// A change for the forwarding loop to apply.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Command {
+    Pause(Target),
+    Resume(Target),
+    PalmGrace(u64),
+    Orientation(Orientation),
+    /// From the rotation signals; see `signals.rs`.
+    Rotate(Rotation),
+}
+
+#[derive(Debug, PartialEq)]
+enum Request {
+    Stats,
+    Reload,
+    Apply(Command),
+}
+
+fn parse_request(line: &str) -> Result<Request, String> {
+    let mut words = line.split_whitespace();
+    let (Some(verb), argument, None) = (words.next(), words.next(), words.next()) else {
+        return Err("expected a command and at most one argument".into());
+    };
+    let target = || match argument {
+        Some("pen") => Ok(Target::Pen),
+        Some("touch") => Ok(Target::Touch),
+        _ => Err(format!("{} needs 'pen' or 'touch'", verb)),
+    };
+
+    match (verb, argument) {
+        ("stats", None) => Ok(Request::Stats),
+        ("reload", None) => Ok(Request::Reload),
+        ("pause", _) => Ok(Request::Apply(Command::Pause(target()?))),
+        ("resume", _) => Ok(Request::Apply(Command::Resume(target()?))),
+        ("palm-grace", Some(ms)) => ms
+            .parse()
+            .map(|ms| Request::Apply(Command::PalmGrace(ms)))
+            .map_err(|_| format!("invalid grace period '{}'", ms)),
+        ("orientation", Some(name)) => Ok(Request::Apply(Command::Orientation(name.parse()?))),
+        _ => Err(format!("unknown command '{}'", line.trim())),
+    }
+}
+
+/// A forwarding loop's end of the command channel: commands wait in a
+/// channel, and an eventfd becomes readable when there are any, so the
+/// loop's reactor wakes for them.
+pub struct CommandQueue {
+    wake: Arc<OwnedFd>,
+    commands: Receiver<Command>,
+}
+
+impl CommandQueue {
+    /// Take the commands queued since the last call.
+    pub fn drain(&self) -> impl Iterator<Item = Command> + '_ {
+        // Reset the eventfd before emptying the channel, so a command sent
+        // in between wakes the loop again
+        let mut count = 0u64;
+        unsafe {
+            libc::read(self.wake.as_raw_fd(), (&raw mut count).cast(), 8);
+        }
+        self.commands.try_iter()
+    }
+}
+
+impl AsRawFd for CommandQueue {
+    fn as_raw_fd(&self) -> RawFd {
+        self.wake.as_raw_fd()
+    }
+}
+
+#[derive(Clone)]
+pub struct CommandSender {
+    wake: Arc<OwnedFd>,
+    commands: Sender<Command>,
+}
+
+impl CommandSender {
+    /// Queue `command`; false once the forwarding loop is gone.
+    pub fn send(&self, command: Command) -> bool {
+        if self.commands.send(command).is_err() {
+            return false;
+        }
+        let one = 1u64;
+        unsafe {
+            libc::write(self.wake.as_raw_fd(), (&raw const one).cast(), 8);
+        }
+        true
+    }
+}
+
+/// A command channel for one forwarding loop.
+pub fn channel() -> io::Result<(CommandSender, CommandQueue)> {
+    let wake = unsafe {
+        let fd = libc::eventfd(0, libc::EFD_NONBLOCK | libc::EFD_CLOEXEC);
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Arc::new(OwnedFd::from_raw_fd(fd))
+    };
+    let (sender, receiver) = mpsc::channel();
+    Ok((
+        CommandSender { wake: wake.clone(), commands: sender },
+        CommandQueue { wake, commands: receiver },
+    ))
+}
+
+struct Server {
+    tablets: Vec<Tablet>,
+    reload: Box<dyn Fn() -> Config + Send>,
+}
+
+/// Listen on `path` from a thread of its own; commands go to every
+/// tablet. `reload` loads the config as at start.
+pub fn serve(path: &Path, tablets: Vec<Tablet>, reload: impl Fn() -> Config + Send + 'static) -> io::Result<()> {
+    let listener = bind(path)?;
+    fs::set_permissions(path, fs::Permissions::from_mode(0o600))?;
+
+    let server = Server {
+        tablets,
+        reload: Box::new(reload),
+    };
+    // The rotation signals have their own reader; none may reach this thread
+    without_signals(|| {
+        std::thread::Builder::new()
+            .name("control".into())
+            .spawn(move || server.run(listener))
+    })?;
+    Ok(())
+}
+
+/// Pass the rotation signals on to every tablet, from a thread of its own.
+pub fn forward_signals(signals: RotationSignals, tablets: Vec<CommandSender>) -> io::Result<()> {
+    std::thread::Builder::new().name("signals".into()).spawn(move || loop {
+        match signals.wait() {
+            Ok(rotation) => {
+                for tablet in &tablets {
+                    tablet.send(Command::Rotate(rotation));
+                }
+            }
+            Err(e) => {
+                log::warn!("Reading orientation signals failed: {}", e);
+                return;
+            }
+        }
+    })?;
+    Ok(())
+}
+
+/// Bind the socket, replacing one left behind by an earlier run.
+fn bind(path: &Path) -> io::Result<UnixListener> {
+    match UnixListener::bind(path) {
+        Err(e) if e.kind() == io::ErrorKind::AddrInUse => {
+            if UnixStream::connect(path).is_ok() {
+                return Err(io::Error::new(io::ErrorKind::AddrInUse, "another rm-pad is listening there"));
+            }
+            fs::remove_file(path)?;
+            UnixListener::bind(path)
+        }
+        result => result,
+    }
+}
+
+/// Run `f` with all signals blocked, so threads it starts inherit that.
+fn without_signals<T>(f: impl FnOnce() -> T) -> T {
+    unsafe {
+        let mut all = MaybeUninit::<libc::sigset_t>::uninit();
+        let mut previous = MaybeUninit::<libc::sigset_t>::uninit();
+        libc::sigfillset(all.as_mut_ptr());
+        libc::pthread_sigmask(libc::SIG_BLOCK, all.as_ptr(), previous.as_mut_ptr());
+        let result = f();
+        libc::pthread_sigmask(libc::SIG_SETMASK, previous.as_ptr(), std::ptr::null_mut());
+        result
+    }
+}
+
+impl Server {
+    fn run(self, listener: UnixListener) {
+        for client in listener.incoming() {
+            let result = client.and_then(|client| self.handle(client));
+            if let Err(e) = result {
+                log::debug!("Control client failed: {}", e);
+            }
+        }
+    }
+
+    fn handle(&self, mut client: UnixStream) -> io::Result<()> {
+        client.set_read_timeout(Some(CLIENT_TIMEOUT))?;
+        client.set_write_timeout(Some(CLIENT_TIMEOUT))?;
+
+        let mut line = String::new();
+        BufReader::new((&client).take(MAX_REQUEST)).read_line(&mut line)?;
+        let answer = match parse_request(&line) {
+            Ok(request) => self.answer(request),
+            Err(e) => format!("error: {}\n", e),
+        };
+        client.write_all(answer.as_bytes())
+    }
+
+    fn answer(&self, request: Request) -> String {
+        match request {
+            Request::Stats => render(&self.tablets),
+            Request::Apply(command) => {
+                log::info!("Control command: {:?}", command);
+                self.send(|_| vec![command])
+            }
+            Request::Reload => {
+                let config = (self.reload)();
+                log::info!(
+                    "Reloaded config: palm_grace_ms={}; other settings apply after a restart",
+                    config.palm_grace_ms
+                );
+                self.send(|tablet| {
+                    let orientation = config.for_host(&tablet.host).orientation;
+                    log::info!("[{}] Reloaded orientation={}", tablet.host, orientation);
+                    vec![Command::PalmGrace(config.palm_grace_ms), Command::Orientation(orientation)]
+                })
+            }
+        }
+    }
+
+    /// Send each tablet its share of a request.
+    fn send(&self, commands: impl Fn(&Tablet) -> Vec<Command>) -> String {
+        for tablet in &self.tablets {
+            for command in commands(tablet) {
+                if !tablet.commands.send(command) {
+                    return format!("error: input forwarding for {} has stopped\n", tablet.host);
+                }
+            }
+        }
+        "ok\n".into()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_parse_request() {
+        assert_eq!(parse_request("stats\n"), Ok(Request::Stats));
+        assert_eq!(parse_request("pause touch\n"), Ok(Request::Apply(Command::Pause(Target::Touch))));
+        assert_eq!(parse_request(" resume pen "), Ok(Request::Apply(Command::Resume(Target::Pen))));
+        assert_eq!(parse_request("palm-grace 250"), Ok(Request::Apply(Command::PalmGrace(250))));
+        assert_eq!(
+            parse_request("orientation inverted"),
+            Ok(Request::Apply(Command::Orientation(Orientation::Inverted)))
+        );
+        assert!(parse_request("pause").is_err());
+        assert!(parse_request("palm-grace soon").is_err());
+        assert!(parse_request("stats now").is_err());
+        assert!(parse_request("").is_err());
+    }
+
+    #[test]
+    fn test_socket_queues_commands_and_serves_stats() {
+        let path = std::env::temp_dir().join(format!("rm-pad-test-{}.sock", std::process::id()));
+        let mut queues = Vec::new();
+        let mut tablets = Vec::new();
+        for host in ["left", "right"] {
+            let (commands, queue) = channel().unwrap();
+            queues.push(queue);
+            tablets.push(Tablet { host: host.into(), metrics: Arc::new(Metrics::new()), commands });
+        }
+        tablets[1].metrics.touch.frames_in.store(7, Ordering::Relaxed);
+        serve(&path, tablets, || unreachable!()).unwrap();
+
+        let request = |line: &str| {
+            let mut client = UnixStream::connect(&path).unwrap();
+            client.write_all(line.as_bytes()).unwrap();
+            let mut answer = String::new();
+            client.read_to_string(&mut answer).unwrap();
+            answer
+        };
+        assert_eq!(request("pause touch\n"), "ok\n");
+        assert!(request("pause mouse\n").starts_with("error:"));
+        let stats = request("stats\n");
+        assert!(stats.contains("rmpad_frames_in_total{tablet=\"left\",stream=\"touch\"} 0\n"));
+        assert!(stats.contains("rmpad_frames_in_total{tablet=\"right\",stream=\"touch\"} 7\n"));
+
+        for queue in &queues {
+            assert_eq!(queue.drain().collect::<Vec<_>>(), [Command::Pause(Target::Touch)]);
+            assert_eq!(queue.drain().count(), 0);
+        }
+
+        // A second instance must not take over a live socket
+        assert!(serve(&path, Vec::new(), || unreachable!()).is_err());
+        fs::remove_file(&path).unwrap();
+    }
+}
@@ -40,6 +40,12 @@ impl DeviceProfile {
         &RM2
     }
 
+    /// Look up a built-in profile by its `name`.
+    #[cfg(any(test, feature = "bench"))]
+    pub fn by_name(name: &str) -> Option<&'static Self> {
+        [&RM2, &RMPP].into_iter().find(|p| p.name == name)
+    }
+
     /// Detect device via SSH connection.
     /// 
     /// Reads the device model from /proc/device-tree/model on the remote device.
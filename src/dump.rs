@@ -1,35 +1,55 @@
-use std::io::Read;
+use std::fs::File;
+use std::io::{BufWriter, Read, Write};
+use std::path::Path;
 
 use crate::config::Config;
 use crate::device::DeviceProfile;
 use crate::input::parse_input_event;
+use crate::record::{write_header, RecordedStream, RecordingHeader};
 use crate::ssh;
 
 pub fn run_touch(
     config: &Config,
-    device: &DeviceProfile,
+    device: &'static DeviceProfile,
+    record: Option<&Path>,
 ) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
-    run_dump(config, device.input_event_size, &config.touch_device, "touch")
+    run_dump(config, device, &config.touch_device, RecordedStream::Touch, record)
 }
 
 pub fn run_pen(
     config: &Config,
-    device: &DeviceProfile,
+    device: &'static DeviceProfile,
+    record: Option<&Path>,
 ) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
-    run_dump(config, device.input_event_size, &config.pen_device, "pen")
+    run_dump(config, device, &config.pen_device, RecordedStream::Pen, record)
 }
 
 fn run_dump(
     config: &Config,
-    input_event_size: usize,
+    profile: &'static DeviceProfile,
     device: &str,
-    name: &str,
+    stream: RecordedStream,
+    record: Option<&Path>,
 ) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
-    let (_cleanup, mut channel) = ssh::open_input_stream(device, config, false)?;
+    let (_cleanup, mut channel) = ssh::open_input_stream(device, config)?;
 
+    let mut recording = match record {
+        Some(path) => {
+            let mut out = BufWriter::new(File::create(path)?);
+            write_header(&mut out, &RecordingHeader { stream, profile })?;
+            eprintln!("Recording to {}", path.display());
+            Some(out)
+        }
+        None => None,
+    };
+
+    let name = match stream {
+        RecordedStream::Pen => "pen",
+        RecordedStream::Touch => "touch",
+    };
     eprintln!("Dumping {} events from {} (Ctrl+C to stop)\n", name, device);
 
-    let mut buf = vec![0u8; input_event_size];
+    let mut buf = vec![0u8; profile.input_event_size];
     let mut count: u64 = 0;
 
     loop {
@@ -39,9 +59,17 @@ fn run_dump(
             continue;
         };
 
+        // Flushed per frame since the dump only ends with Ctrl+C
+        if let Some(out) = recording.as_mut() {
+            out.write_all(&buf)?;
+            if ev.is_syn_report() {
+                out.flush()?;
+            }
+        }
+
         count += 1;
-        let name = format_event_code(ev.event_type().raw(), ev.raw_code());
-        println!("{:6}  {}  value={}", count, name, ev.raw_value());
+        let name = format_event_code(ev.ty, ev.code);
+        println!("{:6}  {}  value={}", count, name, ev.value);
     }
 }
 
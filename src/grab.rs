@@ -1,9 +1,9 @@
 //! Upload and manage the evgrab helper binary on the reMarkable.
 //!
-//! The evgrab helper is a tiny static ARM binary that exclusively grabs an
-//! evdev device via EVIOCGRAB and pipes events to stdout. This prevents
-//! xochitl from seeing input without stopping the process (which would
-//! trigger the watchdog).
+//! The evgrab helper is a tiny static ARM binary that exclusively grabs
+//! evdev devices via EVIOCGRAB and pipes their events, tagged per device,
+//! to stdout. This prevents xochitl from seeing input without stopping the
+//! process (which would trigger the watchdog).
 //!
 //! Binaries for both armv7 (rM2) and aarch64 (rMPP/rMPM) are embedded at
 //! compile time and the correct one is uploaded over SSH on first connect.
@@ -11,13 +11,20 @@
 use std::fmt;
 use std::io::{Read, Write};
 
-use sha2::{Digest, Sha256};
 use ssh2::Session;
 
+use crate::transport::Transport;
+
 const GRAB_ARMV7: &[u8] = include_bytes!(concat!(env!("OUT_DIR"), "/evgrab-armv7"));
 const GRAB_AARCH64: &[u8] = include_bytes!(concat!(env!("OUT_DIR"), "/evgrab-aarch64"));
 
-const REMOTE_PATH: &str = "/tmp/rm-pad-grab";
+/// SHA256 of each embedded binary, computed by build.rs.
+const HASH_ARMV7: &str = env!("EVGRAB_ARMV7_SHA256");
+const HASH_AARCH64: &str = env!("EVGRAB_AARCH64_SHA256");
+
+/// Helpers are installed as `<prefix>-<first 16 hex digits of the hash>`;
+/// the helper's log goes to `<prefix>.log`.
+const REMOTE_PREFIX: &str = "/tmp/rm-pad-grab";
 
 #[derive(Debug, Clone, Copy)]
 pub enum Arch {
@@ -34,91 +41,57 @@ impl fmt::Display for Arch {
     }
 }
 
-/// Detect the tablet's CPU architecture by running `uname -m` over SSH.
-pub fn detect_arch(session: &Session) -> Result<Arch, Box<dyn std::error::Error + Send + Sync>> {
-    let mut channel = session.channel_session()?;
-    channel.exec("uname -m")?;
+impl Arch {
+    const ALL: [Arch; 2] = [Arch::Armv7, Arch::Aarch64];
 
-    let mut output = String::new();
-    channel.read_to_string(&mut output)?;
-
-    // Explicitly close our end so the session is left in a clean state
-    // for subsequent channels (SFTP, exec, etc.).
-    channel.close()?;
-    channel.wait_close()?;
+    fn binary(self) -> &'static [u8] {
+        match self {
+            Arch::Armv7 => GRAB_ARMV7,
+            Arch::Aarch64 => GRAB_AARCH64,
+        }
+    }
 
-    match output.trim() {
-        "armv7l" => Ok(Arch::Armv7),
-        "aarch64" => Ok(Arch::Aarch64),
-        other => Err(format!("Unsupported tablet architecture: {}", other).into()),
+    /// Where this architecture's helper lives on the tablet. The name
+    /// carries the binary's hash, so a file at that path that is
+    /// executable is known to be the right helper without hashing it.
+    pub fn remote_path(self) -> String {
+        let hash = match self {
+            Arch::Armv7 => HASH_ARMV7,
+            Arch::Aarch64 => HASH_AARCH64,
+        };
+        format!("{}-{}", REMOTE_PREFIX, &hash[..16])
     }
 }
 
-/// Compute SHA256 hash of the embedded binary for the given architecture.
-fn compute_binary_hash(arch: Arch) -> String {
-    let binary = match arch {
-        Arch::Armv7 => GRAB_ARMV7,
-        Arch::Aarch64 => GRAB_AARCH64,
-    };
-    let mut hasher = Sha256::new();
-    hasher.update(binary);
-    format!("{:x}", hasher.finalize())
-}
+/// Detect the tablet's CPU architecture and whether the matching helper is
+/// already installed, in a single exec.
+pub fn probe_tablet(session: &Session) -> Result<(Arch, bool), Box<dyn std::error::Error + Send + Sync>> {
+    let mut command = String::from("uname -m");
+    for arch in Arch::ALL {
+        command.push_str(&format!("; test -x {path} && echo {path}", path = arch.remote_path()));
+    }
 
-/// Check if the remote binary exists and matches our embedded binary hash.
-/// Returns Ok(true) if hash matches, Ok(false) if file doesn't exist or hash doesn't match.
-fn check_remote_binary_hash(
-    session: &Session,
-    arch: Arch,
-) -> Result<bool, Box<dyn std::error::Error + Send + Sync>> {
-    let expected_hash = compute_binary_hash(arch);
-    
     let mut channel = session.channel_session()?;
-    channel.exec(&format!("sha256sum {} 2>/dev/null | cut -d' ' -f1", REMOTE_PATH))?;
+    channel.exec(&command)?;
 
     let mut output = String::new();
     channel.read_to_string(&mut output)?;
-    channel.close()?;
-    channel.wait_close()?;
-
-    let status = channel.exit_status()?;
-    if status != 0 {
-        // File doesn't exist or command failed
-        log::debug!("Remote binary not found or sha256sum failed");
-        return Ok(false);
-    }
-
-    let remote_hash = output.trim();
-    if remote_hash == expected_hash {
-        log::debug!("Remote binary hash matches: {}", &expected_hash[..16]);
-        Ok(true)
-    } else {
-        log::debug!(
-            "Remote binary hash mismatch: expected {}..., got {}...",
-            &expected_hash[..16],
-            &remote_hash[..16.min(remote_hash.len())]
-        );
-        Ok(false)
-    }
-}
-
-/// Remove the remote binary if it exists.
-fn remove_remote_binary(
-    session: &Session,
-) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
-    let mut channel = session.channel_session()?;
-    channel.exec(&format!("rm -f {}", REMOTE_PATH))?;
 
+    // Explicitly close our end so the session is left in a clean state
+    // for subsequent channels (SFTP, exec, etc.).
     channel.close()?;
     channel.wait_close()?;
 
-    let status = channel.exit_status()?;
-    if status != 0 {
-        return Err(format!("Failed to remove remote binary (exit status {})", status).into());
-    }
+    let mut lines = output.lines().map(str::trim);
+    let arch = match lines.next().unwrap_or("") {
+        "armv7l" => Arch::Armv7,
+        "aarch64" => Arch::Aarch64,
+        other => return Err(format!("Unsupported tablet architecture: {}", other).into()),
+    };
+    let path = arch.remote_path();
+    let installed = lines.any(|line| line == path);
 
-    log::debug!("Removed remote binary");
-    Ok(())
+    Ok((arch, installed))
 }
 
 /// Upload the correct grab helper binary to the tablet.
@@ -130,24 +103,27 @@ pub fn upload_helper(
     session: &Session,
     arch: Arch,
 ) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
-    let binary = match arch {
-        Arch::Armv7 => GRAB_ARMV7,
-        Arch::Aarch64 => GRAB_AARCH64,
-    };
+    let binary = arch.binary();
+    let path = arch.remote_path();
 
     log::info!(
         "Uploading grab helper ({}, {} bytes) to {}",
         arch,
         binary.len(),
-        REMOTE_PATH
+        path
     );
 
     let mut channel = session.channel_session()?;
-    // Write to a PID-unique temp file and atomically rename into place.
-    // This avoids corruption when pen and touch threads upload concurrently.
+    // Write to a PID-unique temp file and atomically rename into place, so
+    // an interrupted upload never leaves a truncated helper behind. Other
+    // helper versions (including the unversioned path older releases used)
+    // are removed in the background afterwards.
     channel.exec(&format!(
-        "cat > {path}.$$ && chmod +x {path}.$$ && mv -f {path}.$$ {path}",
-        path = REMOTE_PATH
+        "cat > {path}.$$ && chmod +x {path}.$$ && mv -f {path}.$$ {path} && \
+         (for f in {prefix} {prefix}-*; do [ \"$f\" = {path} ] || rm -f \"$f\"; done \
+         </dev/null >/dev/null 2>&1 &)",
+        path = path,
+        prefix = REMOTE_PREFIX
     ))?;
 
     channel.write_all(binary)?;
@@ -165,33 +141,130 @@ pub fn upload_helper(
     Ok(())
 }
 
-/// Ensure the remote binary exists and matches our embedded binary.
-/// Removes and re-uploads if hash doesn't match.
+/// Upload the helper unless `probe_tablet` found it installed.
 pub fn ensure_binary_valid(
     session: &Session,
     arch: Arch,
+    installed: bool,
 ) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
-    match check_remote_binary_hash(session, arch)? {
-        true => {
-            log::debug!("Using existing remote binary (hash verified)");
-            Ok(())
-        }
-        false => {
-            log::info!("Remote binary missing or hash mismatch, removing and re-uploading");
-            remove_remote_binary(session)?;
-            upload_helper(session, arch)
+    if installed {
+        log::debug!("Using existing remote binary {}", arch.remote_path());
+        return Ok(());
+    }
+
+    log::info!("Grab helper not installed on the tablet, uploading");
+    upload_helper(session, arch)
+}
+
+/// A filter the helper applies to one device's events before sending them.
+/// `device` is the device's index on the helper's command line.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Filter {
+    /// Drop changes of ABS `code` smaller than `band`.
+    DeadBand { device: u8, code: u16, band: u32 },
+    /// Clamp ABS `code` to at most `max`.
+    Clamp { device: u8, code: u16, max: u32 },
+    /// Drop every event of type `ty`.
+    Drop { device: u8, ty: u16 },
+}
+
+impl fmt::Display for Filter {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match *self {
+            Filter::DeadBand { device, code, band } => write!(f, "-d {}:{:#x}:{}", device, code, band),
+            Filter::Clamp { device, code, max } => write!(f, "-z {}:{:#x}:{}", device, code, max),
+            Filter::Drop { device, ty } => write!(f, "-x {}:{:#x}", device, ty),
         }
     }
 }
 
-/// Build the remote command that grabs a device and streams events.
+/// Options passed to the helper on its command line.
+#[derive(Debug, Clone, Copy)]
+pub struct HelperOptions<'a> {
+    /// Grab the devices exclusively (otherwise only read them).
+    pub grab: bool,
+    /// Use the compact frame encoding.
+    pub compact: bool,
+    /// How frames travel to the host.
+    pub transport: Transport,
+    /// Events to drop on the tablet.
+    pub filters: &'a [Filter],
+    /// Merge pen motion down to this many batches per second (0 = off).
+    pub output_rate_hz: u32,
+}
+
+/// Build the remote command that streams events from the given devices.
+///
+/// Each frame the helper writes is tagged with the index of its device in
+/// `device_paths`.
 ///
 /// Stderr is redirected to a log file on the tablet for diagnostics.
 /// Uses `exec` to replace the shell with the grab helper so that signal
 /// delivery (on SSH disconnect) goes directly to the right process.
-pub fn grab_command(device_path: &str) -> String {
+pub fn grab_command(arch: Arch, device_paths: &[&str], options: HelperOptions) -> String {
+    let mut flags = String::new();
+    if !options.grab {
+        flags.push_str(" -n");
+    }
+    if options.compact {
+        flags.push_str(" -c");
+    }
+    match options.transport {
+        Transport::Ssh => {}
+        Transport::Tcp => flags.push_str(" -l"),
+        Transport::Udp => flags.push_str(" -u"),
+    }
+    for filter in options.filters {
+        flags.push_str(&format!(" {}", filter));
+    }
+    if options.output_rate_hz > 0 {
+        flags.push_str(&format!(" -r {}", options.output_rate_hz));
+    }
+
     format!(
-        "exec {} {} 2>>{}.log",
-        REMOTE_PATH, device_path, REMOTE_PATH
+        "exec {}{} {} 2>>{}.log",
+        arch.remote_path(),
+        flags,
+        device_paths.join(" "),
+        REMOTE_PREFIX
     )
 }
+
+/// Build the remote command that runs the helper's self-benchmark.
+pub fn selftest_command(arch: Arch) -> String {
+    format!("{} --selftest 2>&1", arch.remote_path())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_helper_path_carries_binary_hash() {
+        let aarch64 = Arch::Aarch64.remote_path();
+        assert_eq!(aarch64, format!("{}-{}", REMOTE_PREFIX, &HASH_AARCH64[..16]));
+
+        let filters = [
+            Filter::Drop { device: 1, ty: 0x01 },
+            Filter::DeadBand { device: 1, code: 0x35, band: 2 },
+        ];
+        let options = HelperOptions {
+            grab: true,
+            compact: true,
+            transport: Transport::Ssh,
+            filters: &filters,
+            output_rate_hz: 60,
+        };
+        let cmd = grab_command(Arch::Aarch64, &["/dev/input/event1", "/dev/input/event2"], options);
+        assert!(cmd.starts_with(&format!(
+            "exec {} -c -x 1:0x1 -d 1:0x35:2 -r 60 /dev/input/event1 /dev/input/event2",
+            aarch64
+        )));
+    }
+
+    #[test]
+    fn test_selftest_runs_installed_helper() {
+        let cmd = selftest_command(Arch::Armv7);
+        assert_eq!(cmd, format!("{} --selftest 2>&1", Arch::Armv7.remote_path()));
+    }
+}
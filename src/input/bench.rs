@@ -0,0 +1,112 @@
+//! `rm-pad bench`: replay a recording through the pen or touch pipeline
+//! against a sink that discards its output, and report the cost per frame.
+
+use std::io;
+use std::path::Path;
+use std::sync::Arc;
+use std::time::Instant;
+
+use evdevil::event::InputEvent;
+
+use crate::alloc_count::allocations;
+use crate::config::{Cli, Config};
+use crate::palm::PalmState;
+use crate::record::{parse_recording, RecordedStream};
+
+use super::event::{block_decoder, RawEvent, COALESCE_BACKLOG};
+use super::pen::PenProcessor;
+use super::sink::EventSink;
+use super::touch::TouchProcessor;
+
+struct NullSink;
+
+impl EventSink for NullSink {
+    fn write(&self, events: &[InputEvent]) -> io::Result<()> {
+        std::hint::black_box(events);
+        Ok(())
+    }
+}
+
+pub fn run_bench(cli: &Cli, path: &Path, iterations: u32) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
+    let data = std::fs::read(path)?;
+    let (header, raw) = parse_recording(&data)?;
+    let config = Config::load(cli, header.profile);
+
+    let event_size = header.profile.input_event_size;
+    let decode = block_decoder(event_size);
+    let mut events = Vec::new();
+    let times: Vec<i64> = raw
+        .chunks_exact(event_size)
+        .map(|raw_event| decode(raw_event, &mut events).unwrap_or(0))
+        .collect();
+
+    // Feed the pipeline one SYN_REPORT-terminated frame at a time, as the
+    // stream does, stamped with the time of its last event
+    let mut frames: Vec<(&[RawEvent], i64)> = Vec::new();
+    let mut start = 0;
+    for (i, &time_us) in times.iter().enumerate() {
+        if events[i].is_syn_report() {
+            frames.push((&events[start..=i], time_us));
+            start = i + 1;
+        }
+    }
+    if frames.is_empty() {
+        return Err("Recording contains no events".into());
+    }
+
+    println!(
+        "{}: {} {:?} frames ({} events) from {}",
+        path.display(), frames.len(), header.stream, events.len(), header.profile.name
+    );
+
+    // The first pass warms up caches and any lazily allocated state. Each
+    // pass replays the recording live (one frame at a time) and then as a
+    // catch-up, with all of it queued at once as after a stall.
+    let iterations = iterations.max(1);
+    let mut best_ns = [f64::MAX; 2];
+    let mut total_allocs = 0u64;
+    for pass in 0..=iterations {
+        for (mode, catch_up) in [false, true].into_iter().enumerate() {
+            let palm = Some(Arc::new(PalmState::new()));
+            let mut pen = PenProcessor::with_sink(
+                NullSink, header.profile, config.orientation, palm.clone(), config.pen_prediction_ms,
+            );
+            let mut touch = TouchProcessor::with_sink(NullSink, header.profile, config.orientation, palm, config.palm_grace_ms);
+
+            let allocs_before = allocations();
+            let start = Instant::now();
+            for (i, &(frame, time_us)) in frames.iter().enumerate() {
+                let queued = if catch_up { (frames.len() - 1 - i).min(COALESCE_BACKLOG) } else { 0 };
+                match header.stream {
+                    RecordedStream::Pen => pen.handle_frame(frame, time_us, queued)?,
+                    RecordedStream::Touch => touch.handle_frame(frame)?,
+                }
+            }
+            let elapsed = start.elapsed();
+            let allocs = allocations() - allocs_before;
+
+            if pass > 0 {
+                best_ns[mode] = best_ns[mode].min(elapsed.as_nanos() as f64 / frames.len() as f64);
+                total_allocs += allocs;
+            }
+        }
+    }
+
+    // Decoding the whole recording as one block, as a backlog is after a stall
+    let mut decoded = Vec::with_capacity(events.len());
+    let mut best_decode_ns = f64::MAX;
+    for _ in 0..=iterations {
+        decoded.clear();
+        let start = Instant::now();
+        decode(std::hint::black_box(raw), &mut decoded);
+        best_decode_ns = best_decode_ns.min(start.elapsed().as_nanos() as f64 / events.len() as f64);
+    }
+    std::hint::black_box(&decoded);
+
+    let measured_frames = 2.0 * frames.len() as f64 * iterations as f64;
+    println!("best {:.0} ns/frame over {} passes", best_ns[0], iterations);
+    println!("catching up: {:.0} ns/frame", best_ns[1]);
+    println!("{:.3} allocations/frame", total_allocs as f64 / measured_frames);
+    println!("decoding: {:.2} ns/event", best_decode_ns);
+    Ok(())
+}
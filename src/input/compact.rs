@@ -0,0 +1,213 @@
+//! Decoder for the evgrab helper's compact frame encoding.
+//!
+//! A compact payload is a sequence of frames, each consisting of
+//! - varint zigzag(timestamp delta in µs, relative to the previous frame)
+//! - varint (event count << 1 | terminated-by-SYN_REPORT bit)
+//! - per event: u8 type, varint code, varint zigzag(value)
+//!
+//! The terminating SYN_REPORT is implicit. ABS_X/ABS_Y and
+//! ABS_MT_POSITION_X/Y (per slot) carry deltas to their previous value, so
+//! one decoder must be kept per device for the lifetime of the stream.
+
+use super::event::{
+    RawEvent, ABS_MT_POSITION_X, ABS_MT_POSITION_Y, ABS_MT_SLOT, EV_ABS, EV_SYN, SYN_REPORT,
+};
+
+const ABS_X: u16 = 0x00;
+const ABS_Y: u16 = 0x01;
+
+/// Multitouch slots tracked for delta decoding (matches evgrab).
+const MT_SLOTS: usize = 16;
+
+/// Per-device state mirroring the encoder in `helper/evgrab.c`.
+pub struct CompactDecoder {
+    last_time_us: i64,
+    last_pos: [i32; 2],
+    last_mt: [[i32; 2]; MT_SLOTS],
+    slot: usize,
+}
+
+impl CompactDecoder {
+    pub fn new() -> Self {
+        Self {
+            last_time_us: 0,
+            last_pos: [0; 2],
+            last_mt: [[0; 2]; MT_SLOTS],
+            slot: 0,
+        }
+    }
+
+    /// Decode a payload, appending its events to `out`.
+    ///
+    /// Returns the timestamp (µs) of the last frame in the payload.
+    pub fn decode(
+        &mut self,
+        payload: &[u8],
+        out: &mut Vec<RawEvent>,
+    ) -> Result<i64, Box<dyn std::error::Error + Send + Sync>> {
+        let mut reader = Reader { buf: payload, pos: 0 };
+
+        while !reader.is_empty() {
+            self.last_time_us = self.last_time_us.wrapping_add(unzigzag(reader.varint()?));
+
+            let header = reader.varint()?;
+            let count = header >> 1;
+            if count > payload.len() as u64 {
+                return Err("Corrupt compact frame: event count exceeds payload".into());
+            }
+
+            for _ in 0..count {
+                let ty = reader.byte()? as u16;
+                let code = reader.varint()? as u16;
+                let mut value = unzigzag(reader.varint()?);
+
+                if let Some(base) = self.delta_base(ty, code) {
+                    value = value.wrapping_add(*base as i64);
+                    *base = value as i32;
+                }
+                let value = value as i32;
+
+                if ty == EV_ABS && code == ABS_MT_SLOT {
+                    self.slot = (value.max(0) as usize).min(MT_SLOTS - 1);
+                }
+
+                out.push(RawEvent::new(ty, code, value));
+            }
+
+            if header & 1 != 0 {
+                out.push(RawEvent::new(EV_SYN, SYN_REPORT, 0));
+            }
+        }
+
+        Ok(self.last_time_us)
+    }
+
+    fn delta_base(&mut self, ty: u16, code: u16) -> Option<&mut i32> {
+        if ty != EV_ABS {
+            return None;
+        }
+        match code {
+            ABS_X => Some(&mut self.last_pos[0]),
+            ABS_Y => Some(&mut self.last_pos[1]),
+            ABS_MT_POSITION_X => Some(&mut self.last_mt[self.slot][0]),
+            ABS_MT_POSITION_Y => Some(&mut self.last_mt[self.slot][1]),
+            _ => None,
+        }
+    }
+}
+
+struct Reader<'a> {
+    buf: &'a [u8],
+    pos: usize,
+}
+
+impl Reader<'_> {
+    fn is_empty(&self) -> bool {
+        self.pos >= self.buf.len()
+    }
+
+    fn byte(&mut self) -> Result<u8, Box<dyn std::error::Error + Send + Sync>> {
+        let b = *self.buf.get(self.pos).ok_or("Truncated compact frame")?;
+        self.pos += 1;
+        Ok(b)
+    }
+
+    fn varint(&mut self) -> Result<u64, Box<dyn std::error::Error + Send + Sync>> {
+        let mut value = 0u64;
+        for shift in (0..64).step_by(7) {
+            let b = self.byte()?;
+            value |= ((b & 0x7f) as u64) << shift;
+            if b & 0x80 == 0 {
+                return Ok(value);
+            }
+        }
+        Err("Corrupt compact frame: varint too long".into())
+    }
+}
+
+fn unzigzag(v: u64) -> i64 {
+    ((v >> 1) as i64) ^ -((v & 1) as i64)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn put_varint(out: &mut Vec<u8>, mut v: u64) {
+        while v >= 0x80 {
+            out.push((v as u8) | 0x80);
+            v >>= 7;
+        }
+        out.push(v as u8);
+    }
+
+    fn zigzag(v: i64) -> u64 {
+        ((v << 1) ^ (v >> 63)) as u64
+    }
+
+    fn put_event(out: &mut Vec<u8>, ty: u8, code: u16, value: i64) {
+        out.push(ty);
+        put_varint(out, code as u64);
+        put_varint(out, zigzag(value));
+    }
+
+    fn raw(events: &[RawEvent]) -> Vec<(u16, u16, i32)> {
+        events.iter().map(|e| (e.ty, e.code, e.value)).collect()
+    }
+
+    #[test]
+    fn test_decode_pen_deltas_across_frames() {
+        let mut payload = Vec::new();
+        put_varint(&mut payload, zigzag(1_000_000));
+        put_varint(&mut payload, (2 << 1) | 1);
+        put_event(&mut payload, 3, ABS_X, 100);
+        put_event(&mut payload, 3, ABS_Y, 200);
+        put_varint(&mut payload, zigzag(5000));
+        put_varint(&mut payload, (2 << 1) | 1);
+        put_event(&mut payload, 3, ABS_X, -3);
+        put_event(&mut payload, 3, 0x18, 42);
+
+        let mut decoder = CompactDecoder::new();
+        let mut out = Vec::new();
+        let ts = decoder.decode(&payload, &mut out).unwrap();
+
+        assert_eq!(ts, 1_005_000);
+        assert_eq!(
+            raw(&out),
+            vec![(3, 0, 100), (3, 1, 200), (0, 0, 0), (3, 0, 97), (3, 0x18, 42), (0, 0, 0)]
+        );
+    }
+
+    #[test]
+    fn test_decode_mt_deltas_per_slot() {
+        let mut payload = Vec::new();
+        put_varint(&mut payload, 0);
+        put_varint(&mut payload, (4 << 1) | 1);
+        put_event(&mut payload, 3, ABS_MT_SLOT, 1);
+        put_event(&mut payload, 3, ABS_MT_POSITION_X, 500);
+        put_event(&mut payload, 3, ABS_MT_SLOT, 0);
+        put_event(&mut payload, 3, ABS_MT_POSITION_X, 10);
+        put_varint(&mut payload, 0);
+        put_varint(&mut payload, 2 << 1);
+        put_event(&mut payload, 3, ABS_MT_SLOT, 1);
+        put_event(&mut payload, 3, ABS_MT_POSITION_X, 2);
+
+        let mut decoder = CompactDecoder::new();
+        let mut out = Vec::new();
+        decoder.decode(&payload, &mut out).unwrap();
+
+        let values: Vec<i32> = raw(&out).into_iter().map(|(_, _, v)| v).collect();
+        assert_eq!(values, vec![1, 500, 0, 10, 0, 1, 502]);
+    }
+
+    #[test]
+    fn test_decode_truncated_payload() {
+        let mut payload = Vec::new();
+        put_varint(&mut payload, 0);
+        put_varint(&mut payload, (1 << 1) | 1);
+        payload.push(3);
+
+        let mut out = Vec::new();
+        assert!(CompactDecoder::new().decode(&payload, &mut out).is_err());
+    }
+}
@@ -0,0 +1,141 @@
+//! Receiving end of the helper's UDP datagrams (`transport = "udp"`).
+//!
+//! Datagrams only carry pen motion, each frame with the full state of every
+//! motion axis (see `MOTION_AXES`), so the newest one makes all before it
+//! worthless: each drain keeps just the newest datagram per device, and the
+//! forwarding loop drops any that a later frame has already overtaken.
+
+use std::io;
+use std::net::{IpAddr, Ipv4Addr, Ipv6Addr, SocketAddr, UdpSocket};
+use std::os::fd::{AsRawFd, RawFd};
+
+use super::event::{parse_frame_header, seq_is_newer, split_seq, FrameHeader, FRAME_HEADER_SIZE, FRAME_SEQ};
+
+/// Largest datagram the helper sends (a full batch of 64-bit events).
+const MAX_DATAGRAM: usize = 2048;
+
+/// Devices served by one helper process.
+const MAX_DEVICES: usize = 4;
+
+struct Slot {
+    buf: [u8; MAX_DATAGRAM],
+    len: usize,
+    seq: u32,
+    pending: bool,
+}
+
+pub struct DatagramReceiver {
+    socket: UdpSocket,
+    peer: IpAddr,
+    slots: Box<[Slot; MAX_DEVICES]>,
+}
+
+impl DatagramReceiver {
+    /// Bind an ephemeral port accepting datagrams from `peer` only.
+    pub fn bind(peer: IpAddr) -> io::Result<Self> {
+        let any: IpAddr = match peer {
+            IpAddr::V4(_) => Ipv4Addr::UNSPECIFIED.into(),
+            IpAddr::V6(_) => Ipv6Addr::UNSPECIFIED.into(),
+        };
+        let socket = UdpSocket::bind(SocketAddr::new(any, 0))?;
+        socket.set_nonblocking(true)?;
+
+        Ok(Self {
+            socket,
+            peer,
+            slots: Box::new(std::array::from_fn(|_| Slot {
+                buf: [0; MAX_DATAGRAM],
+                len: 0,
+                seq: 0,
+                pending: false,
+            })),
+        })
+    }
+
+    pub fn port(&self) -> io::Result<u16> {
+        Ok(self.socket.local_addr()?.port())
+    }
+
+    /// Read every waiting datagram, keeping the newest per device.
+    pub fn drain(&mut self) -> io::Result<()> {
+        let mut buf = [0u8; MAX_DATAGRAM];
+        loop {
+            let (len, from) = match self.socket.recv_from(&mut buf) {
+                Ok(received) => received,
+                Err(e) if e.kind() == io::ErrorKind::WouldBlock => return Ok(()),
+                Err(e) if e.kind() == io::ErrorKind::Interrupted => continue,
+                Err(e) => return Err(e),
+            };
+            if from.ip() != self.peer || len < FRAME_HEADER_SIZE {
+                continue;
+            }
+
+            let header = parse_frame_header(buf[..FRAME_HEADER_SIZE].try_into().unwrap());
+            let payload = &buf[FRAME_HEADER_SIZE..len];
+            let Some((seq, _)) = split_seq(payload) else {
+                continue;
+            };
+            let Some(slot) = self.slots.get_mut(header.device as usize) else {
+                continue;
+            };
+            if header.flags & FRAME_SEQ == 0 || header.length != payload.len() {
+                continue;
+            }
+            if slot.pending && !seq_is_newer(seq, slot.seq) {
+                continue;
+            }
+
+            slot.buf[..len].copy_from_slice(&buf[..len]);
+            slot.len = len;
+            slot.seq = seq;
+            slot.pending = true;
+        }
+    }
+
+    /// Hand out a datagram kept by `drain`, as a frame header and payload
+    /// (still starting with its sequence number).
+    pub fn take(&mut self) -> Option<(FrameHeader, &[u8])> {
+        let slot = self.slots.iter_mut().find(|slot| slot.pending)?;
+        slot.pending = false;
+        let header = parse_frame_header(slot.buf[..FRAME_HEADER_SIZE].try_into().unwrap());
+        Some((header, &slot.buf[FRAME_HEADER_SIZE..slot.len]))
+    }
+}
+
+impl AsRawFd for DatagramReceiver {
+    fn as_raw_fd(&self) -> RawFd {
+        self.socket.as_raw_fd()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn datagram(device: u8, seq: u32) -> Vec<u8> {
+        let mut out = vec![device, FRAME_SEQ, 4, 0];
+        out.extend_from_slice(&seq.to_le_bytes());
+        out
+    }
+
+    #[test]
+    fn test_keeps_newest_datagram_per_device() {
+        let local = IpAddr::V4(Ipv4Addr::LOCALHOST);
+        let mut receiver = DatagramReceiver::bind(local).unwrap();
+        let sender = UdpSocket::bind((local, 0)).unwrap();
+        let to = (local, receiver.port().unwrap());
+
+        for (device, seq) in [(0, 5), (0, 7), (0, 6), (1, 2)] {
+            sender.send_to(&datagram(device, seq), to).unwrap();
+        }
+        sender.send_to(&[0, FRAME_SEQ], to).unwrap();
+        std::thread::sleep(std::time::Duration::from_millis(20));
+
+        receiver.drain().unwrap();
+        let mut seen = Vec::new();
+        while let Some((header, payload)) = receiver.take() {
+            seen.push((header.device, split_seq(payload).unwrap().0));
+        }
+        assert_eq!(seen, vec![(0, 7), (1, 2)]);
+    }
+}
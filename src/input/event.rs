@@ -1,46 +1,397 @@
-use evdevil::event::{EventType, InputEvent};
+use std::io::{self, Read};
+
+use crate::transport::TOKEN_SIZE;
 
 pub const INPUT_EVENT_SIZE_32: usize = 16;
 pub const INPUT_EVENT_SIZE_64: usize = 24;
 
+/// Size of the header the evgrab helper puts in front of every frame.
+pub const FRAME_HEADER_SIZE: usize = 4;
+
+/// Helper protocol version this host understands.
+pub const PROTOCOL_VERSION: u16 = 1;
+
+/// Device index of frames generated by the helper itself.
+pub const CONTROL_DEVICE: u8 = 0xff;
+
+/// Control frame types, carried in the header flags of `CONTROL_DEVICE` frames.
+pub const CONTROL_HELLO: u8 = 0x00;
+pub const CONTROL_KEEPALIVE: u8 = 0x01;
+pub const CONTROL_CLOCK: u8 = 0x02;
+pub const CONTROL_LISTEN: u8 = 0x03;
+
+/// Frame payload uses the compact encoding (see `compact.rs`).
+pub const FRAME_COMPACT: u8 = 0x01;
+/// Frame payload starts with the device's LE u32 sequence number
+/// (`transport = "udp"`, see `datagram.rs`).
+pub const FRAME_SEQ: u8 = 0x02;
+
 pub const EV_SYN: u16 = 0x00;
 pub const EV_KEY: u16 = 0x01;
 pub const EV_ABS: u16 = 0x03;
 pub const SYN_REPORT: u16 = 0;
 
 pub const ABS_MT_SLOT: u16 = 0x2f;
+pub const ABS_MT_TOUCH_MAJOR: u16 = 0x30;
 pub const ABS_MT_POSITION_X: u16 = 0x35;
 pub const ABS_MT_POSITION_Y: u16 = 0x36;
 pub const ABS_MT_TRACKING_ID: u16 = 0x39;
 pub const ABS_PRESSURE: u16 = 0x18;
+pub const ABS_DISTANCE: u16 = 0x19;
+
+/// Pen axes a datagram carries the full state of: ABS_X, ABS_Y,
+/// ABS_DISTANCE, ABS_TILT_X and ABS_TILT_Y.
+pub const MOTION_AXES: [u16; 5] = [0x00, 0x01, ABS_DISTANCE, 0x1a, 0x1b];
+
+/// While at least this many pen frames are already waiting behind the
+/// current one, hover frames are merged into the next, so a stalled link
+/// doesn't replay the hover path in slow motion after recovering.
+pub const COALESCE_BACKLOG: usize = 4;
+
+/// Size of the host-side buffer frames are read into. Large enough for
+/// the biggest frame a header can describe.
+const READ_BUFFER_SIZE: usize = 128 * 1024;
+
+/// The type, code and value of an input event, without its timestamp.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct RawEvent {
+    pub ty: u16,
+    pub code: u16,
+    pub value: i32,
+}
+
+impl RawEvent {
+    pub const fn new(ty: u16, code: u16, value: i32) -> Self {
+        Self { ty, code, value }
+    }
+
+    pub fn is_syn_report(&self) -> bool {
+        self.ty == EV_SYN && self.code == SYN_REPORT
+    }
+}
 
 /// Parse a Linux input_event from raw bytes (32-bit or 64-bit format).
-pub fn parse_input_event(buf: &[u8]) -> Option<InputEvent> {
+pub fn parse_input_event(buf: &[u8]) -> Option<RawEvent> {
     match buf.len() {
-        INPUT_EVENT_SIZE_32 => parse_input_event_32(buf),
-        INPUT_EVENT_SIZE_64 => parse_input_event_64(buf),
-        len if len >= INPUT_EVENT_SIZE_64 => parse_input_event_64(buf),
-        len if len >= INPUT_EVENT_SIZE_32 => parse_input_event_32(buf),
+        INPUT_EVENT_SIZE_32 => Some(parse_event_at(buf, 8)),
+        INPUT_EVENT_SIZE_64 => Some(parse_event_at(buf, 16)),
+        len if len >= INPUT_EVENT_SIZE_64 => Some(parse_event_at(buf, 16)),
+        len if len >= INPUT_EVENT_SIZE_32 => Some(parse_event_at(buf, 8)),
         _ => None,
     }
 }
 
-fn parse_input_event_32(buf: &[u8]) -> Option<InputEvent> {
-    let ty = u16::from_le_bytes([buf[8], buf[9]]);
-    let code = u16::from_le_bytes([buf[10], buf[11]]);
-    let value = i32::from_le_bytes([buf[12], buf[13], buf[14], buf[15]]);
+/// Decodes a block of raw input_events into `out` and returns the
+/// timestamp (µs) of the last one.
+pub type BlockDecoder = fn(&[u8], &mut Vec<RawEvent>) -> Option<i64>;
 
-    Some(InputEvent::new(EventType::from_raw(ty), code, value))
+/// The decoder for input_events of `event_size` bytes, picked once per
+/// stream; each is specialized for its layout, so decoding never branches
+/// on the event size.
+pub fn block_decoder(event_size: usize) -> BlockDecoder {
+    match event_size {
+        INPUT_EVENT_SIZE_32 => decode_block::<INPUT_EVENT_SIZE_32>,
+        _ => decode_block::<INPUT_EVENT_SIZE_64>,
+    }
 }
 
-fn parse_input_event_64(buf: &[u8]) -> Option<InputEvent> {
-    let ty = u16::from_le_bytes([buf[16], buf[17]]);
-    let code = u16::from_le_bytes([buf[18], buf[19]]);
-    let value = i32::from_le_bytes([buf[20], buf[21], buf[22], buf[23]]);
+fn decode_block<const SIZE: usize>(payload: &[u8], out: &mut Vec<RawEvent>) -> Option<i64> {
+    let (events, _) = payload.as_chunks::<SIZE>();
+    out.extend(events.iter().map(|buf| parse_event_at(buf, SIZE - 8)));
+    events.last().map(event_time_us::<SIZE>)
+}
 
-    Some(InputEvent::new(EventType::from_raw(ty), code, value))
+/// The timeval in front of an input_event: two 32-bit fields on 32-bit
+/// tablets, two 64-bit ones otherwise.
+fn event_time_us<const SIZE: usize>(buf: &[u8; SIZE]) -> i64 {
+    let (sec, usec) = if SIZE == INPUT_EVENT_SIZE_32 {
+        (
+            i32::from_le_bytes(buf[0..4].try_into().unwrap()) as i64,
+            i32::from_le_bytes(buf[4..8].try_into().unwrap()) as i64,
+        )
+    } else {
+        (
+            i64::from_le_bytes(buf[0..8].try_into().unwrap()),
+            i64::from_le_bytes(buf[8..16].try_into().unwrap()),
+        )
+    };
+    sec * 1_000_000 + usec
 }
 
-pub fn key_event(code: u16, value: i32) -> InputEvent {
-    InputEvent::new(EventType::from_raw(EV_KEY), code, value)
+fn parse_event_at(buf: &[u8], offset: usize) -> RawEvent {
+    let b = &buf[offset..offset + 8];
+    RawEvent {
+        ty: u16::from_le_bytes([b[0], b[1]]),
+        code: u16::from_le_bytes([b[2], b[3]]),
+        value: i32::from_le_bytes([b[4], b[5], b[6], b[7]]),
+    }
+}
+
+/// Header of a frame from the evgrab helper.
+#[derive(Debug, Clone, Copy)]
+pub struct FrameHeader {
+    /// Index of the source device on the helper's command line.
+    pub device: u8,
+    /// `FRAME_*` bits describing the payload.
+    pub flags: u8,
+    /// Payload size in bytes (a whole number of input_events).
+    pub length: usize,
+}
+
+/// Parse a frame header (device, flags, little-endian u16 length).
+pub fn parse_frame_header(buf: &[u8; FRAME_HEADER_SIZE]) -> FrameHeader {
+    FrameHeader {
+        device: buf[0],
+        flags: buf[1],
+        length: u16::from_le_bytes([buf[2], buf[3]]) as usize,
+    }
+}
+
+/// Check the helper's hello frame and return the features it enabled.
+pub fn parse_hello(header: &FrameHeader, payload: &[u8]) -> Result<u8, Box<dyn std::error::Error + Send + Sync>> {
+    if header.device != CONTROL_DEVICE || header.flags != CONTROL_HELLO || payload.len() < 4 {
+        return Err("Helper did not send a hello frame".into());
+    }
+
+    let version = u16::from_le_bytes([payload[0], payload[1]]);
+    if version != PROTOCOL_VERSION {
+        return Err(format!(
+            "Helper speaks protocol version {}, expected {}",
+            version, PROTOCOL_VERSION
+        )
+        .into());
+    }
+
+    Ok(u16::from_le_bytes([payload[2], payload[3]]) as u8)
+}
+
+/// Parse a clock frame: the helper's CLOCK_REALTIME in microseconds.
+pub fn parse_clock(payload: &[u8]) -> Option<i64> {
+    Some(i64::from_le_bytes(payload.get(..8)?.try_into().ok()?))
+}
+
+/// Parse a listen frame: the TCP port (LE u16) the helper waits on for the
+/// data connection, followed by the token to present there.
+pub fn parse_listen(payload: &[u8]) -> Option<(u16, [u8; TOKEN_SIZE])> {
+    let port = u16::from_le_bytes(payload.get(..2)?.try_into().ok()?);
+    let token = payload.get(2..2 + TOKEN_SIZE)?.try_into().ok()?;
+    Some((port, token))
+}
+
+/// Split a `FRAME_SEQ` payload into its sequence number and events.
+pub fn split_seq(payload: &[u8]) -> Option<(u32, &[u8])> {
+    let seq = u32::from_le_bytes(payload.get(..4)?.try_into().ok()?);
+    Some((seq, &payload[4..]))
+}
+
+/// Whether sequence number `seq` comes after `last`, allowing for wrap.
+pub fn seq_is_newer(seq: u32, last: u32) -> bool {
+    (seq.wrapping_sub(last) as i32) > 0
+}
+
+/// Reads helper frames from a stream through one large reusable buffer.
+///
+/// Each `read()` pulls in as much as the stream has available, so bursts
+/// of small frames cost one call into the transport instead of two per
+/// frame.
+pub struct FrameReader<R> {
+    inner: R,
+    buf: Box<[u8]>,
+    start: usize,
+    end: usize,
+}
+
+impl<R: Read> FrameReader<R> {
+    pub fn new(inner: R) -> Self {
+        Self {
+            inner,
+            buf: vec![0u8; READ_BUFFER_SIZE].into_boxed_slice(),
+            start: 0,
+            end: 0,
+        }
+    }
+
+    /// The underlying stream, e.g. for writing to it.
+    pub fn get_mut(&mut self) -> &mut R {
+        &mut self.inner
+    }
+
+    /// Take back the stream. Anything read ahead is discarded.
+    pub fn into_inner(self) -> R {
+        self.inner
+    }
+
+    /// Return the next frame's header and payload, reading more if needed.
+    pub fn next_frame(&mut self) -> io::Result<(FrameHeader, &[u8])> {
+        self.fill(FRAME_HEADER_SIZE)?;
+        let mut header = [0u8; FRAME_HEADER_SIZE];
+        header.copy_from_slice(&self.buf[self.start..self.start + FRAME_HEADER_SIZE]);
+        let header = parse_frame_header(&header);
+
+        self.fill(FRAME_HEADER_SIZE + header.length)?;
+        let payload_start = self.start + FRAME_HEADER_SIZE;
+        let payload_end = payload_start + header.length;
+        self.start = payload_end;
+
+        Ok((header, &self.buf[payload_start..payload_end]))
+    }
+
+    /// Number of complete frames from `device` already buffered, counting
+    /// up to `limit`. Only looks a bounded distance ahead.
+    pub fn queued_frames(&self, device: u8, limit: usize) -> usize {
+        let mut pos = self.start;
+        let mut count = 0;
+
+        for _ in 0..limit * 4 {
+            if count >= limit || self.end - pos < FRAME_HEADER_SIZE {
+                break;
+            }
+            let mut header = [0u8; FRAME_HEADER_SIZE];
+            header.copy_from_slice(&self.buf[pos..pos + FRAME_HEADER_SIZE]);
+            let header = parse_frame_header(&header);
+
+            pos += FRAME_HEADER_SIZE + header.length;
+            if pos > self.end {
+                break;
+            }
+            if header.device == device {
+                count += 1;
+            }
+        }
+        count
+    }
+
+    /// Make sure at least `needed` unconsumed bytes are buffered.
+    fn fill(&mut self, needed: usize) -> io::Result<()> {
+        if self.start == self.end {
+            self.start = 0;
+            self.end = 0;
+        }
+
+        while self.end - self.start < needed {
+            if self.buf.len() - self.start < needed {
+                self.buf.copy_within(self.start..self.end, 0);
+                self.end -= self.start;
+                self.start = 0;
+            }
+
+            match self.inner.read(&mut self.buf[self.end..]) {
+                Ok(0) => return Err(io::ErrorKind::UnexpectedEof.into()),
+                Ok(n) => self.end += n,
+                Err(e) if e.kind() == io::ErrorKind::Interrupted => {}
+                Err(e) => return Err(e),
+            }
+        }
+
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// Hands out at most `chunk` bytes per read, like a slow transport.
+    struct Chunked<'a> {
+        data: &'a [u8],
+        chunk: usize,
+    }
+
+    impl Read for Chunked<'_> {
+        fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+            let n = self.chunk.min(buf.len()).min(self.data.len());
+            buf[..n].copy_from_slice(&self.data[..n]);
+            self.data = &self.data[n..];
+            Ok(n)
+        }
+    }
+
+    fn frame(device: u8, payload: &[u8]) -> Vec<u8> {
+        let mut out = vec![device, 0];
+        out.extend_from_slice(&(payload.len() as u16).to_le_bytes());
+        out.extend_from_slice(payload);
+        out
+    }
+
+    #[test]
+    fn test_frame_reader_reassembles_split_frames() {
+        let mut stream = frame(0, &[1, 2, 3]);
+        stream.extend(frame(1, &[]));
+        stream.extend(frame(2, &[4; 300]));
+
+        for chunk in [1, 5, 4096] {
+            let mut reader = FrameReader::new(Chunked { data: &stream, chunk });
+
+            let (h, p) = reader.next_frame().unwrap();
+            assert_eq!((h.device, p), (0, &[1u8, 2, 3][..]));
+            let (h, p) = reader.next_frame().unwrap();
+            assert_eq!((h.device, p.len()), (1, 0));
+            let (h, p) = reader.next_frame().unwrap();
+            assert_eq!((h.device, p), (2, &[4u8; 300][..]));
+
+            let err = reader.next_frame().unwrap_err();
+            assert_eq!(err.kind(), io::ErrorKind::UnexpectedEof);
+        }
+    }
+
+    #[test]
+    fn test_queued_frames_counts_complete_frames_per_device() {
+        let mut stream = frame(0, &[]);
+        for device in [0, 1, 0, 0] {
+            stream.extend(frame(device, &[7; 10]));
+        }
+        stream.extend(&frame(0, &[7; 10])[..6]);
+
+        let mut reader = FrameReader::new(Chunked { data: &stream, chunk: 4096 });
+        reader.next_frame().unwrap();
+        assert_eq!(reader.queued_frames(0, 10), 3);
+        assert_eq!(reader.queued_frames(0, 2), 2);
+        assert_eq!(reader.queued_frames(1, 10), 1);
+    }
+
+    #[test]
+    fn test_decode_events_32_and_64() {
+        let mut rm2 = vec![0u8; 8];
+        rm2.extend_from_slice(&3u16.to_le_bytes());
+        rm2.extend_from_slice(&0x35u16.to_le_bytes());
+        rm2.extend_from_slice(&(-7i32).to_le_bytes());
+        let mut rmpp = vec![0u8; 8];
+        rmpp.extend_from_slice(&rm2);
+
+        let mut out = Vec::new();
+        block_decoder(INPUT_EVENT_SIZE_32)(&rm2, &mut out);
+        block_decoder(INPUT_EVENT_SIZE_64)(&rmpp, &mut out);
+        assert_eq!(out, vec![RawEvent::new(3, 0x35, -7); 2]);
+    }
+
+    #[test]
+    fn test_parse_listen() {
+        let mut payload = 40000u16.to_le_bytes().to_vec();
+        payload.extend(1..=TOKEN_SIZE as u8);
+        let (port, token) = parse_listen(&payload).unwrap();
+        assert_eq!(port, 40000);
+        assert_eq!(token[TOKEN_SIZE - 1], TOKEN_SIZE as u8);
+        assert!(parse_listen(&payload[..TOKEN_SIZE]).is_none());
+    }
+
+    #[test]
+    fn test_seq_is_newer_across_wrap() {
+        assert!(seq_is_newer(2, 1));
+        assert!(!seq_is_newer(1, 1));
+        assert!(!seq_is_newer(1, 2));
+        assert!(seq_is_newer(3, u32::MAX - 2));
+    }
+
+    #[test]
+    fn test_last_event_time() {
+        let mut rm2 = Vec::new();
+        for (sec, usec) in [(1i32, 5i32), (2, 250)] {
+            rm2.extend_from_slice(&sec.to_le_bytes());
+            rm2.extend_from_slice(&usec.to_le_bytes());
+            rm2.extend_from_slice(&[0; 8]);
+        }
+        let mut out = Vec::new();
+        assert_eq!(block_decoder(INPUT_EVENT_SIZE_32)(&rm2, &mut out), Some(2_000_250));
+        assert_eq!(block_decoder(INPUT_EVENT_SIZE_64)(&[], &mut out), None);
+    }
 }
@@ -0,0 +1,173 @@
+//! Drive every tablet from one thread.
+//!
+//! Each tablet's sockets, control commands and timers wait in one
+//! `Reactor`, so a second tablet adds fds rather than threads. Only setting
+//! a connection up blocks (the SSH handshake and starting the helper), so
+//! that runs on a short-lived thread which wakes the reactor when it is
+//! done; the other tablets' input keeps flowing meanwhile.
+
+use std::fmt::Display;
+use std::io;
+use std::mem;
+use std::os::fd::AsRawFd;
+use std::sync::mpsc::{self, Receiver, TryRecvError};
+use std::sync::Arc;
+use std::thread;
+use std::time::{Duration, Instant};
+
+use super::reactor::{Reactor, Token, Waker};
+use super::stream::{ConnectOutcome, Connection, InputForwarder};
+
+/// Delay before the first reconnection attempt; doubles with every
+/// attempt that fails, up to `RECONNECT_DELAY_MAX`.
+const RECONNECT_DELAY_MIN: Duration = Duration::from_millis(100);
+const RECONNECT_DELAY_MAX: Duration = Duration::from_secs(5);
+
+/// A connection that lasted this long was healthy: the next reconnect
+/// starts over from `RECONNECT_DELAY_MIN`.
+const HEALTHY_CONNECTION: Duration = Duration::from_secs(10);
+
+/// Longest wait without a timer due; any event that matters wakes the
+/// reactor before that.
+const IDLE_WAIT: Duration = Duration::from_secs(60);
+
+/// Where a tablet's connection stands.
+enum Link {
+    /// Disconnected; the next attempt starts at this time.
+    Waiting(Instant),
+    /// A thread is setting a connection up and sends the outcome here.
+    Connecting(Receiver<ConnectOutcome>),
+    Up { connection: Connection, since: Instant },
+}
+
+struct Tablet<'a> {
+    forwarder: InputForwarder<'a>,
+    commands: Token,
+    link: Link,
+    /// Delay before the attempt after the next failure.
+    delay: Duration,
+}
+
+/// Forward input from every tablet, reconnecting each one whenever its
+/// connection fails, until an error in the loop itself.
+pub fn run_forwarders(forwarders: Vec<InputForwarder>) -> io::Result<()> {
+    let waker = Arc::new(Waker::new()?);
+    let mut reactor = Reactor::new();
+    let woken = reactor.register(waker.as_raw_fd());
+
+    let now = Instant::now();
+    let mut tablets: Vec<Tablet> = forwarders
+        .into_iter()
+        .map(|forwarder| Tablet {
+            commands: reactor.register(forwarder.commands_fd()),
+            forwarder,
+            link: Link::Waiting(now),
+            delay: RECONNECT_DELAY_MIN,
+        })
+        .collect();
+
+    loop {
+        if reactor.take_readable(woken) {
+            waker.reset();
+        }
+        let mut deadline = Instant::now() + IDLE_WAIT;
+        for tablet in &mut tablets {
+            deadline = deadline.min(tablet.step(&mut reactor, &waker));
+        }
+        reactor.wait(deadline)?;
+    }
+}
+
+impl Tablet<'_> {
+    /// Handle whatever the tablet has ready without blocking. Returns when
+    /// it next needs to run even if none of its fds wakes the reactor.
+    fn step(&mut self, reactor: &mut Reactor, waker: &Arc<Waker>) -> Instant {
+        // Commands apply in every state, also while reconnecting
+        if reactor.take_readable(self.commands) {
+            if let Err(e) = self.forwarder.apply_commands() {
+                log::error!("[{}] Error: {}", self.forwarder.host(), e);
+            }
+        }
+
+        loop {
+            match &mut self.link {
+                Link::Waiting(retry_at) => {
+                    if Instant::now() < *retry_at {
+                        return *retry_at;
+                    }
+                    log::info!("[{}] Connecting", self.forwarder.host());
+                    match self.start_connecting(waker) {
+                        Ok(outcome) => self.link = Link::Connecting(outcome),
+                        Err(e) => self.retry_later(&e, None),
+                    }
+                }
+                Link::Connecting(outcome) => {
+                    let outcome = match outcome.try_recv() {
+                        Ok(outcome) => outcome,
+                        Err(TryRecvError::Empty) => return Instant::now() + IDLE_WAIT,
+                        // The connection cache went down with the thread; the
+                        // next attempt starts a new one
+                        Err(TryRecvError::Disconnected) => {
+                            self.retry_later(&"Connecting panicked", None);
+                            continue;
+                        }
+                    };
+                    match self.forwarder.connected(outcome, reactor) {
+                        Ok(connection) => self.link = Link::Up { connection, since: Instant::now() },
+                        Err(e) => self.retry_later(&e, None),
+                    }
+                }
+                Link::Up { connection, .. } => {
+                    let e = match self.forwarder.service(connection, reactor) {
+                        Ok(deadline) => return deadline,
+                        Err(e) => e,
+                    };
+                    let link = mem::replace(&mut self.link, Link::Waiting(Instant::now()));
+                    let Link::Up { connection, since } = link else { unreachable!() };
+                    if let Err(e) = self.forwarder.disconnected(connection, reactor) {
+                        log::error!("[{}] Error: {}", self.forwarder.host(), e);
+                    }
+                    self.retry_later(&e, Some(since));
+                }
+            }
+        }
+    }
+
+    /// Set a connection up on a thread of its own, which wakes the reactor
+    /// once the outcome is waiting on the returned channel.
+    fn start_connecting(&mut self, waker: &Arc<Waker>) -> io::Result<Receiver<ConnectOutcome>> {
+        let (sender, outcome) = mpsc::sync_channel(1);
+        let job = self.forwarder.connect_job();
+        let waker = waker.clone();
+        thread::Builder::new().name(format!("connect {}", self.forwarder.host())).spawn(move || {
+            // Wakes the reactor once the outcome is sent, or the sender
+            // dropped if the job panics
+            let _wake = WakeOnExit(waker);
+            let sender = sender;
+            let _ = sender.send(job());
+        })?;
+        Ok(outcome)
+    }
+
+    /// Log why the connection failed or ended, and schedule the next attempt.
+    /// `since` is when the connection came up, if it did.
+    fn retry_later(&mut self, error: &dyn Display, since: Option<Instant>) {
+        let host = self.forwarder.host();
+        log::error!("[{}] Error: {}", host, error);
+        if since.is_some_and(|since| since.elapsed() >= HEALTHY_CONNECTION) {
+            self.delay = RECONNECT_DELAY_MIN;
+        }
+
+        log::warn!("[{}] Disconnected, reconnecting in {}ms", host, self.delay.as_millis());
+        self.link = Link::Waiting(Instant::now() + self.delay);
+        self.delay = (self.delay * 2).min(RECONNECT_DELAY_MAX);
+    }
+}
+
+struct WakeOnExit(Arc<Waker>);
+
+impl Drop for WakeOnExit {
+    fn drop(&mut self) {
+        self.0.wake();
+    }
+}
@@ -0,0 +1,87 @@
+//! Output rate limiting for the pen and touch pipelines.
+//!
+//! The digitizers report far more often than a desktop refreshes. Frames
+//! that only move something are held back so at most one reaches uinput
+//! per interval; the pipelines merge held frames into the next one, and
+//! anything carrying an edge (contact, pressure or button change) goes out
+//! straight away, taking the held motion with it.
+
+use std::time::{Duration, Instant};
+
+pub struct RateGovernor {
+    /// Zero when rate limiting is off.
+    interval: Duration,
+    last_emit: Option<Instant>,
+    held: bool,
+}
+
+impl RateGovernor {
+    pub fn new(interval: Duration) -> Self {
+        Self {
+            interval,
+            last_emit: None,
+            held: false,
+        }
+    }
+
+    /// Whether a motion-only frame arriving now should be held back.
+    pub fn should_hold(&mut self) -> bool {
+        if self.interval.is_zero() {
+            return false;
+        }
+        let hold = self.last_emit.is_some_and(|last| last.elapsed() < self.interval);
+        self.held |= hold;
+        hold
+    }
+
+    /// Record that a frame (including any held motion) was written.
+    pub fn emitted(&mut self) {
+        if !self.interval.is_zero() {
+            self.last_emit = Some(Instant::now());
+        }
+        self.held = false;
+    }
+
+    /// When the held frame is due, if there is one.
+    pub fn deadline(&self) -> Option<Instant> {
+        self.held.then(|| self.last_emit.map_or_else(Instant::now, |last| last + self.interval))
+    }
+
+    /// Whether a held frame is due now.
+    pub fn is_due(&self) -> bool {
+        self.deadline().is_some_and(|deadline| Instant::now() >= deadline)
+    }
+}
+
+/// Interval between output frames for a rate in Hz (0 = unlimited).
+pub fn interval_for_rate(rate_hz: u32) -> Duration {
+    match rate_hz {
+        0 => Duration::ZERO,
+        hz => Duration::from_secs(1) / hz,
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_holds_only_within_interval() {
+        let mut off = RateGovernor::new(Duration::ZERO);
+        off.emitted();
+        assert!(!off.should_hold());
+
+        let mut governor = RateGovernor::new(Duration::from_millis(20));
+        assert!(!governor.should_hold(), "nothing emitted yet");
+        governor.emitted();
+        assert!(governor.should_hold());
+        assert!(governor.deadline().is_some());
+        assert!(!governor.is_due());
+
+        std::thread::sleep(Duration::from_millis(25));
+        assert!(governor.is_due());
+        assert!(!governor.should_hold());
+        governor.emitted();
+        assert!(governor.deadline().is_none());
+    }
+}
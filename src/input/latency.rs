@@ -0,0 +1,325 @@
+//! Latency measurement for the forwarded streams.
+//!
+//! Every helper frame carries the kernel timestamp of its events. With an
+//! estimate of the tablet's clock offset this gives the transit time from
+//! the digitizer to the host, and timing the processing gives the time
+//! from receipt to the uinput write. Both are kept as histograms per
+//! stream and logged periodically.
+
+use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
+
+/// How often latency percentiles are logged (and the histograms reset).
+const REPORT_INTERVAL: Duration = Duration::from_secs(30);
+
+/// Values below this are counted exactly; above it each power of two is
+/// split into `SUB_BUCKETS` buckets (about 12% precision).
+const LINEAR_LIMIT: u64 = 16;
+const SUB_BUCKETS: u64 = 8;
+
+/// Covers up to 2^25 µs (~33 s); anything larger lands in the last bucket.
+const BUCKETS: usize = (LINEAR_LIMIT + (25 - 4) * SUB_BUCKETS) as usize;
+
+/// Fixed-size log-linear histogram of microsecond values.
+pub struct Histogram {
+    buckets: [u32; BUCKETS],
+    count: u64,
+    max: u64,
+}
+
+impl Histogram {
+    pub fn new() -> Self {
+        Self {
+            buckets: [0; BUCKETS],
+            count: 0,
+            max: 0,
+        }
+    }
+
+    pub fn record(&mut self, us: u64) {
+        let bucket = &mut self.buckets[bucket_index(us)];
+        *bucket = bucket.saturating_add(1);
+        self.count += 1;
+        self.max = self.max.max(us);
+    }
+
+    pub fn count(&self) -> u64 {
+        self.count
+    }
+
+    pub fn max(&self) -> u64 {
+        self.max
+    }
+
+    /// Lower bound of the bucket holding the `p`th percentile (0.0..=1.0).
+    pub fn percentile(&self, p: f64) -> u64 {
+        let rank = ((self.count as f64 * p).ceil() as u64).max(1);
+        let mut seen = 0u64;
+        for (i, &n) in self.buckets.iter().enumerate() {
+            seen += n as u64;
+            if seen >= rank {
+                return bucket_floor(i).min(self.max);
+            }
+        }
+        self.max
+    }
+
+    pub fn clear(&mut self) {
+        *self = Self::new();
+    }
+}
+
+fn bucket_index(us: u64) -> usize {
+    if us < LINEAR_LIMIT {
+        return us as usize;
+    }
+    let exp = 63 - us.leading_zeros() as u64;
+    let sub = (us >> (exp - 3)) & (SUB_BUCKETS - 1);
+    ((LINEAR_LIMIT + (exp - 4) * SUB_BUCKETS + sub) as usize).min(BUCKETS - 1)
+}
+
+fn bucket_floor(index: usize) -> u64 {
+    let index = index as u64;
+    if index < LINEAR_LIMIT {
+        return index;
+    }
+    let exp = (index - LINEAR_LIMIT) / SUB_BUCKETS + 4;
+    let sub = (index - LINEAR_LIMIT) % SUB_BUCKETS;
+    (SUB_BUCKETS + sub) << (exp - 3)
+}
+
+/// Host wall-clock time in microseconds, comparable to evdev timestamps.
+pub fn wall_clock_us() -> i64 {
+    SystemTime::now()
+        .duration_since(UNIX_EPOCH)
+        .map(|d| d.as_micros() as i64)
+        .unwrap_or(0)
+}
+
+/// Estimates the tablet's clock offset from ping/clock round trips.
+///
+/// Each sample assumes the helper read its clock halfway through the round
+/// trip, so the sample with the shortest round trip is the most accurate.
+/// The best round trip is forgotten at every report so the estimate keeps
+/// following clock drift.
+struct ClockSync {
+    ping_sent_us: Option<i64>,
+    best_rtt_us: i64,
+    last_rtt_us: Option<i64>,
+    /// Tablet clock minus host clock.
+    offset_us: Option<i64>,
+}
+
+impl ClockSync {
+    fn new() -> Self {
+        Self {
+            ping_sent_us: None,
+            best_rtt_us: i64::MAX,
+            last_rtt_us: None,
+            offset_us: None,
+        }
+    }
+
+    fn on_clock(&mut self, tablet_us: i64, received_us: i64) {
+        let Some(sent_us) = self.ping_sent_us.take() else {
+            return;
+        };
+        let rtt = received_us - sent_us;
+        if rtt >= 0 {
+            self.last_rtt_us = Some(rtt);
+        }
+        if rtt < 0 || rtt > self.best_rtt_us {
+            return;
+        }
+        self.best_rtt_us = rtt;
+        self.offset_us = Some(tablet_us - (sent_us + rtt / 2));
+    }
+}
+
+/// Percentiles of one histogram, in microseconds.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct Quantiles {
+    pub count: u64,
+    pub p50: u64,
+    pub p99: u64,
+    pub max: u64,
+}
+
+impl Quantiles {
+    fn of(histogram: &Histogram) -> Self {
+        if histogram.count() == 0 {
+            return Self::default();
+        }
+        Self {
+            count: histogram.count(),
+            p50: histogram.percentile(0.5),
+            p99: histogram.percentile(0.99),
+            max: histogram.max(),
+        }
+    }
+}
+
+/// The current reporting interval's latencies, for the control socket.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct LatencySnapshot {
+    /// `[transit, processing]` per stream.
+    pub pen: [Quantiles; 2],
+    pub touch: [Quantiles; 2],
+    /// Round trip of the last heartbeat ping.
+    pub rtt_us: Option<i64>,
+}
+
+/// Latency histograms for one stream.
+struct StreamLatency {
+    name: &'static str,
+    transit: Histogram,
+    processing: Histogram,
+}
+
+impl StreamLatency {
+    fn new(name: &'static str) -> Self {
+        Self {
+            name,
+            transit: Histogram::new(),
+            processing: Histogram::new(),
+        }
+    }
+
+    fn report(&mut self) {
+        if self.processing.count() == 0 {
+            return;
+        }
+        let ms = |us: u64| us as f64 / 1000.0;
+        let transit = &self.transit;
+        let processing = &self.processing;
+
+        if transit.count() > 0 {
+            log::info!(
+                "{} latency ({} frames): transit p50 {:.1} ms, p99 {:.1} ms, max {:.1} ms; \
+                 processing p50 {:.2} ms, p99 {:.2} ms, max {:.2} ms",
+                self.name, processing.count(),
+                ms(transit.percentile(0.5)), ms(transit.percentile(0.99)), ms(transit.max()),
+                ms(processing.percentile(0.5)), ms(processing.percentile(0.99)), ms(processing.max()),
+            );
+        } else {
+            log::info!(
+                "{} latency ({} frames): processing p50 {:.2} ms, p99 {:.2} ms, max {:.2} ms",
+                self.name, processing.count(),
+                ms(processing.percentile(0.5)), ms(processing.percentile(0.99)), ms(processing.max()),
+            );
+        }
+
+        self.transit.clear();
+        self.processing.clear();
+    }
+}
+
+/// Which stream a frame belongs to.
+#[derive(Clone, Copy)]
+pub enum Stream {
+    Pen,
+    Touch,
+}
+
+/// Latency bookkeeping for one helper connection.
+pub struct LatencyStats {
+    clock: ClockSync,
+    pen: StreamLatency,
+    touch: StreamLatency,
+    last_report: Instant,
+}
+
+impl LatencyStats {
+    pub fn new() -> Self {
+        Self {
+            clock: ClockSync::new(),
+            pen: StreamLatency::new("Pen"),
+            touch: StreamLatency::new("Touch"),
+            last_report: Instant::now(),
+        }
+    }
+
+    /// A ping was just written to the helper.
+    pub fn ping_sent(&mut self) {
+        self.clock.ping_sent_us = Some(wall_clock_us());
+    }
+
+    /// The helper answered a ping with its current clock.
+    pub fn clock_received(&mut self, tablet_us: i64) {
+        self.clock.on_clock(tablet_us, wall_clock_us());
+    }
+
+    /// Record a forwarded frame: the tablet timestamp of its last event (if
+    /// known), when it arrived (host wall clock) and when processing began.
+    pub fn record(&mut self, stream: Stream, event_us: Option<i64>, received_us: i64, started: Instant) {
+        let latency = match stream {
+            Stream::Pen => &mut self.pen,
+            Stream::Touch => &mut self.touch,
+        };
+        latency.processing.record(started.elapsed().as_micros() as u64);
+
+        if let (Some(event_us), Some(offset_us)) = (event_us, self.clock.offset_us) {
+            let transit = received_us - (event_us - offset_us);
+            latency.transit.record(transit.max(0) as u64);
+        }
+    }
+
+    pub fn snapshot(&self) -> LatencySnapshot {
+        let quantiles = |latency: &StreamLatency| [Quantiles::of(&latency.transit), Quantiles::of(&latency.processing)];
+        LatencySnapshot {
+            pen: quantiles(&self.pen),
+            touch: quantiles(&self.touch),
+            rtt_us: self.clock.last_rtt_us,
+        }
+    }
+
+    /// Log and reset the histograms once per `REPORT_INTERVAL`.
+    pub fn maybe_report(&mut self) {
+        if self.last_report.elapsed() < REPORT_INTERVAL {
+            return;
+        }
+        self.last_report = Instant::now();
+        self.pen.report();
+        self.touch.report();
+        self.clock.best_rtt_us = i64::MAX;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_bucket_floor_inverts_index() {
+        for us in [0, 1, 15, 16, 17, 100, 1000, 12_345, 1 << 24] {
+            let floor = bucket_floor(bucket_index(us));
+            assert!(floor <= us && us - floor <= us / 8, "{} -> {}", us, floor);
+        }
+    }
+
+    #[test]
+    fn test_percentiles() {
+        let mut h = Histogram::new();
+        for us in 1..=1000 {
+            h.record(us);
+        }
+        let p50 = h.percentile(0.5);
+        assert!((440..=500).contains(&p50), "p50 {}", p50);
+        assert!(h.percentile(0.99) >= 896);
+        assert_eq!(h.max(), 1000);
+    }
+
+    #[test]
+    fn test_clock_sync_prefers_shortest_round_trip() {
+        let mut clock = ClockSync::new();
+        clock.ping_sent_us = Some(1_000);
+        clock.on_clock(50_000 + 1_400, 1_800);
+        clock.ping_sent_us = Some(2_000);
+        clock.on_clock(50_000 + 2_050, 2_100);
+        assert_eq!(clock.offset_us, Some(50_000));
+
+        // A slower sample does not replace a better one.
+        clock.ping_sent_us = Some(3_000);
+        clock.on_clock(70_000, 4_000);
+        assert_eq!(clock.offset_us, Some(50_000));
+    }
+}
@@ -1,7 +1,25 @@
+#[cfg(feature = "bench")]
+mod bench;
+mod compact;
+mod datagram;
 mod event;
+mod forwarding;
+mod governor;
+mod latency;
+mod pacer;
 mod pen;
+mod predict;
+mod reactor;
+mod signals;
+mod sink;
+mod stream;
 mod touch;
+mod udev;
 
 pub use event::parse_input_event;
-pub use pen::run_pen;
-pub use touch::run_touch;
+pub use forwarding::run_forwarders;
+pub use latency::{LatencySnapshot, Quantiles};
+pub use signals::{Rotation, RotationSignals};
+pub use stream::InputForwarder;
+#[cfg(feature = "bench")]
+pub use bench::run_bench;
@@ -0,0 +1,142 @@
+//! Replays input with the spacing it had on the tablet.
+//!
+//! uinput stamps events when they are written, so frames that arrive in a
+//! burst after a network stall reach libinput and applications microseconds
+//! apart, and look like a sudden jump in velocity. The pacer holds each
+//! frame until a fixed delay after it was captured, mapped onto the host
+//! clock, so they go out with their original spacing. Frames that arrive
+//! later than that go out at once.
+//!
+//! The mapping is the smallest receive-minus-capture time seen recently:
+//! the clock offset plus the fastest transit. It is kept over a sliding
+//! window so it follows the two clocks drifting apart.
+
+use std::collections::VecDeque;
+use std::time::{Duration, Instant};
+
+use super::event::RawEvent;
+use super::latency::wall_clock_us;
+
+/// How long each half of the offset window lasts; the minimum is taken
+/// over the current and the previous half.
+const OFFSET_WINDOW: Duration = Duration::from_secs(10);
+
+/// A frame waiting for its time.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct HeldFrame {
+    pub device: u8,
+    /// Tablet timestamp of its last event.
+    pub event_us: i64,
+    /// When it arrived, host wall clock.
+    pub received_us: i64,
+    /// Host wall clock time it is due.
+    due_us: i64,
+    len: usize,
+}
+
+pub struct Pacer {
+    delay_us: i64,
+    /// Receive-minus-capture minimum over the current and previous window.
+    min_current: Option<i64>,
+    min_previous: Option<i64>,
+    window_start: Instant,
+    frames: VecDeque<HeldFrame>,
+    /// The held frames' events, back to back.
+    events: VecDeque<RawEvent>,
+}
+
+impl Pacer {
+    pub fn new(delay: Duration) -> Self {
+        Self {
+            delay_us: delay.as_micros() as i64,
+            min_current: None,
+            min_previous: None,
+            window_start: Instant::now(),
+            frames: VecDeque::with_capacity(64),
+            events: VecDeque::with_capacity(1024),
+        }
+    }
+
+    /// Hold a frame captured at `event_us` (tablet clock) and received at
+    /// `received_us` (host wall clock).
+    pub fn push(&mut self, device: u8, events: &[RawEvent], event_us: i64, received_us: i64) {
+        if self.window_start.elapsed() >= OFFSET_WINDOW {
+            self.min_previous = self.min_current.take();
+            self.window_start = Instant::now();
+        }
+        let offset = received_us - event_us;
+        let min = self.min_current.map_or(offset, |min| min.min(offset));
+        self.min_current = Some(min);
+        let base = self.min_previous.map_or(min, |previous| previous.min(min));
+
+        self.events.extend(events);
+        self.frames.push_back(HeldFrame {
+            device,
+            event_us,
+            received_us,
+            due_us: event_us + base + self.delay_us,
+            len: events.len(),
+        });
+    }
+
+    /// When the next held frame is due, if there is one.
+    pub fn deadline(&self) -> Option<Instant> {
+        let frame = self.frames.front()?;
+        let wait_us = (frame.due_us - wall_clock_us()).max(0);
+        Some(Instant::now() + Duration::from_micros(wait_us as u64))
+    }
+
+    /// Take the next frame if it is due at `now_us`, replacing `events`
+    /// with its events.
+    pub fn pop_due(&mut self, now_us: i64, events: &mut Vec<RawEvent>) -> Option<HeldFrame> {
+        if self.frames.front()?.due_us > now_us {
+            return None;
+        }
+        let frame = self.frames.pop_front()?;
+        events.clear();
+        events.extend(self.events.drain(..frame.len));
+        Some(frame)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use super::super::event::{EV_SYN, SYN_REPORT};
+
+    const SYN: RawEvent = RawEvent::new(EV_SYN, SYN_REPORT, 0);
+
+    #[test]
+    fn test_burst_keeps_original_spacing() {
+        let mut pacer = Pacer::new(Duration::from_millis(30));
+        let mut events = Vec::new();
+
+        // Captured 5 ms apart; the first arrives 1 ms after capture, the
+        // other two together in a burst 20 ms later
+        pacer.push(0, &[SYN], 0, 1_000);
+        pacer.push(0, &[SYN, SYN], 5_000, 25_000);
+        pacer.push(1, &[SYN], 10_000, 25_000);
+
+        // Each is due at capture + 1 ms offset + 30 ms delay
+        let mut pop = |now_us| pacer.pop_due(now_us, &mut events).map(|frame| (frame.device, frame.event_us));
+        assert_eq!(pop(30_999), None);
+        assert_eq!(pop(31_000), Some((0, 0)));
+        assert_eq!(pop(35_999), None);
+        assert_eq!(pop(36_000), Some((0, 5_000)));
+        assert_eq!(pop(41_000), Some((1, 10_000)));
+        assert_eq!(pop(i64::MAX), None);
+    }
+
+    #[test]
+    fn test_late_frames_go_out_at_once() {
+        let mut pacer = Pacer::new(Duration::from_millis(10));
+        let mut events = Vec::new();
+        pacer.push(0, &[SYN], 0, 1_000);
+        pacer.push(0, &[SYN, SYN], 5_000, 50_000);
+
+        assert!(pacer.pop_due(50_000, &mut events).is_some());
+        let late = pacer.pop_due(50_000, &mut events).unwrap();
+        assert_eq!((late.event_us, events.len()), (5_000, 2));
+        assert!(pacer.deadline().is_none());
+    }
+}
@@ -1,22 +1,29 @@
-use std::io::Read;
-use std::time::Instant;
+use std::time::{Duration, Instant};
 
-use evdevil::event::{Abs, InputEvent, Key};
+use evdevil::event::{Abs, Key};
 use evdevil::uinput::{AbsSetup, UinputDevice};
 use evdevil::{AbsInfo, Bus, InputId, InputProp};
 
 use crate::config::Config;
 use crate::device::DeviceProfile;
-use crate::orientation::Orientation;
-use crate::palm::SharedPalmState;
-use crate::ssh;
+use crate::orientation::{Orientation, Transform};
+use crate::palm::{ScreenPoint, SharedPalmState};
 
-use super::event::{key_event, parse_input_event, ABS_PRESSURE, EV_ABS, EV_SYN, SYN_REPORT};
+use super::event::{RawEvent, ABS_DISTANCE, ABS_PRESSURE, COALESCE_BACKLOG, EV_ABS, EV_KEY};
+use super::governor::{interval_for_rate, RateGovernor};
+use super::predict::PenPredictor;
+use super::sink::{EventSink, FrameBuffer};
+use super::udev;
 
 const ABS_X: u16 = 0x00;
 const ABS_Y: u16 = 0x01;
 const ABS_TILT_X: u16 = 0x1a;
 const ABS_TILT_Y: u16 = 0x1b;
+const BTN_TOOL_PEN: u16 = 0x140;
+const BTN_STYLUS: u16 = 0x14b;
+
+/// Tool keys, BTN_TOUCH, five axes and SYN_REPORT.
+const FRAME_CAPACITY: usize = 3 + 6 + 1;
 
 fn create_pen_device(device: &DeviceProfile, orientation: Orientation) -> Result<UinputDevice, Box<dyn std::error::Error + Send + Sync>> {
     let (out_x_max, out_y_max) = orientation.pen_output_dimensions(device.pen_x_max, device.pen_y_max);
@@ -39,130 +46,484 @@ fn create_pen_device(device: &DeviceProfile, orientation: Orientation) -> Result
     Ok(device)
 }
 
-pub fn run_pen(
-    config: &Config,
-    device_profile: &DeviceProfile,
+/// Values reported by one pen frame (between two SYN_REPORTs), in device
+/// coordinates. `None` means the digitizer did not report that value.
+#[derive(Default)]
+struct PenFrame {
+    x: Option<i32>,
+    y: Option<i32>,
+    pressure: Option<i32>,
+    distance: Option<i32>,
+    tilt_x: Option<i32>,
+    tilt_y: Option<i32>,
+    tool_pen: Option<bool>,
+    stylus: Option<bool>,
+}
+
+impl PenFrame {
+    /// Record an event; returns false for events the virtual pen does not
+    /// forward (including the digitizer's own BTN_TOUCH, which is derived
+    /// from pressure instead).
+    fn record(&mut self, ty: u16, code: u16, value: i32) -> bool {
+        let field = match (ty, code) {
+            (EV_ABS, ABS_X) => &mut self.x,
+            (EV_ABS, ABS_Y) => &mut self.y,
+            (EV_ABS, ABS_PRESSURE) => &mut self.pressure,
+            (EV_ABS, ABS_DISTANCE) => &mut self.distance,
+            (EV_ABS, ABS_TILT_X) => &mut self.tilt_x,
+            (EV_ABS, ABS_TILT_Y) => &mut self.tilt_y,
+            (EV_KEY, BTN_TOOL_PEN) => {
+                self.tool_pen = Some(value != 0);
+                return true;
+            }
+            (EV_KEY, BTN_STYLUS) => {
+                self.stylus = Some(value != 0);
+                return true;
+            }
+            _ => return false,
+        };
+        *field = Some(value);
+        true
+    }
+}
+
+/// Forwards pen frames to a virtual pen device.
+pub struct PenProcessor<'a, S: EventSink = UinputDevice> {
+    uinput: S,
+    /// Device with the other aspect ratio, kept after an orientation
+    /// change between portrait and landscape (see `set_orientation`).
+    spare: Option<S>,
+    device_profile: &'a DeviceProfile,
+    orientation: Orientation,
+    position_transform: Transform,
+    tilt_transform: Transform,
     palm: Option<SharedPalmState>,
-) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
-    let (_cleanup, mut channel) =
-        ssh::open_input_stream(&config.pen_device, config, config.grab_input)?;
+    frame: PenFrame,
+    out: FrameBuffer<FRAME_CAPACITY>,
+    predictor: Option<PenPredictor>,
+    /// Position last written, in device coordinates; differs from
+    /// `last_x`/`last_y` while a prediction is showing.
+    out_pos: (i32, i32),
+    touch_down: bool,
+    /// The pen is in proximity (BTN_TOOL_PEN down).
+    in_range: bool,
+    frame_count: u64,
+    merged_count: u64,
+    governor: RateGovernor,
+    /// Tablet timestamp of the frame the governor is holding back.
+    held_time_us: i64,
+
+    // Last reported values. The digitizer only reports what changed, but
+    // the orientation transform needs both axes of a pair, and contact is
+    // derived from the current pressure.
+    last_x: i32,
+    last_y: i32,
+    last_tilt_x: i32,
+    last_tilt_y: i32,
+    last_pressure: i32,
+}
 
-    log::info!("Creating pen uinput device");
-    let uinput = create_pen_device(device_profile, config.orientation)?;
+impl<'a> PenProcessor<'a> {
+    pub fn new(
+        config: &Config,
+        device_profile: &'a DeviceProfile,
+        palm: Option<SharedPalmState>,
+    ) -> Result<Self, Box<dyn std::error::Error + Send + Sync>> {
+        log::info!("Creating pen uinput device");
+        let uinput = create_pen_device(device_profile, config.orientation)?;
 
-    if let Ok(name) = uinput.sysname() {
-        log::info!("Pen device ready: /sys/devices/virtual/input/{}", name.to_string_lossy());
+        if let Ok(name) = uinput.sysname() {
+            log::info!("Pen device ready: /sys/devices/virtual/input/{}", name.to_string_lossy());
+        }
+
+        if config.pen_prediction_ms > 0 {
+            log::info!("Pen prediction: {} ms ahead", config.pen_prediction_ms);
+        }
+
+        let processor = Self::with_sink(uinput, device_profile, config.orientation, palm, config.pen_prediction_ms);
+        Ok(processor.with_rate_limit(interval_for_rate(config.output_rate_hz)))
     }
 
-    std::thread::sleep(std::time::Duration::from_secs(1));
-    log::info!("Pen forwarding started");
+    /// Kernel name of the uinput device, e.g. `input17`.
+    pub fn sysname(&self) -> Option<String> {
+        self.uinput.sysname().ok().map(|name| name.to_string_lossy().into_owned())
+    }
 
-    let btn_touch_code = Key::BTN_TOUCH.raw();
-    let mut buf = vec![0u8; device_profile.input_event_size];
-    let mut batch: Vec<InputEvent> = Vec::with_capacity(32);
-    let mut touch_down = false;
-    let mut frame_count: u64 = 0;
+    /// Switch to `orientation` while running. A uinput device's axes are
+    /// fixed, so turning between portrait and landscape moves the pen to a
+    /// second device with the other aspect ratio, created on the first
+    /// such turn and kept for the next.
+    pub fn set_orientation(&mut self, orientation: Orientation) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
+        if orientation == self.orientation {
+            return Ok(());
+        }
+        let (in_range, pressure) = (self.in_range, self.last_pressure);
+        self.release_all()?;
 
-    // For collecting X/Y/tilt values within a frame
-    let mut pending_x: Option<i32> = None;
-    let mut pending_y: Option<i32> = None;
-    let mut pending_tilt_x: Option<i32> = None;
-    let mut pending_tilt_y: Option<i32> = None;
-    let orientation = config.orientation;
+        let (x_max, y_max) = (self.device_profile.pen_x_max, self.device_profile.pen_y_max);
+        if orientation.pen_output_dimensions(x_max, y_max) != self.orientation.pen_output_dimensions(x_max, y_max) {
+            let next = match self.spare.take() {
+                Some(device) => device,
+                None => {
+                    let device = create_pen_device(self.device_profile, orientation)?;
+                    if let Ok(name) = device.sysname() {
+                        log::info!("Pen device for {}: /sys/devices/virtual/input/{}", orientation, name.to_string_lossy());
+                        udev::wait_for_devices(&[name.to_string_lossy().into_owned()]);
+                    }
+                    device
+                }
+            };
+            self.spare = Some(std::mem::replace(&mut self.uinput, next));
+        }
+        self.set_transforms(orientation);
 
-    loop {
-        channel.read_exact(&mut buf)?;
+        // The digitizer only reports changes, so have its next frame
+        // restore what the release took back
+        if in_range {
+            self.frame.tool_pen = Some(true);
+            self.frame.x = Some(self.last_x);
+            self.frame.y = Some(self.last_y);
+            self.frame.pressure = Some(pressure);
+        }
+        Ok(())
+    }
+}
 
-        let Some(ev) = parse_input_event(&buf) else {
-            continue;
-        };
+impl<'a, S: EventSink> PenProcessor<'a, S> {
+    pub fn with_sink(
+        sink: S,
+        device_profile: &'a DeviceProfile,
+        orientation: Orientation,
+        palm: Option<SharedPalmState>,
+        prediction_ms: u64,
+    ) -> Self {
+        Self {
+            uinput: sink,
+            spare: None,
+            device_profile,
+            orientation,
+            position_transform: Transform::pen(orientation, device_profile.pen_x_max, device_profile.pen_y_max),
+            tilt_transform: Transform::tilt(orientation),
+            palm,
+            frame: PenFrame::default(),
+            out: FrameBuffer::new(),
+            predictor: (prediction_ms > 0).then(|| PenPredictor::new(prediction_ms)),
+            out_pos: (0, 0),
+            touch_down: false,
+            in_range: false,
+            frame_count: 0,
+            merged_count: 0,
+            governor: RateGovernor::new(Duration::ZERO),
+            held_time_us: 0,
+            last_x: 0,
+            last_y: 0,
+            last_tilt_x: 0,
+            last_tilt_y: 0,
+            last_pressure: 0,
+        }
+    }
 
-        let ty = ev.event_type().raw();
-        let code = ev.raw_code();
-        let value = ev.raw_value();
+    fn set_transforms(&mut self, orientation: Orientation) {
+        let profile = self.device_profile;
+        self.orientation = orientation;
+        self.position_transform = Transform::pen(orientation, profile.pen_x_max, profile.pen_y_max);
+        self.tilt_transform = Transform::tilt(orientation);
+    }
 
-        // Collect position and tilt values, defer transformation until SYN_REPORT
-        if ty == EV_ABS {
-            match code {
-                ABS_X => {
-                    pending_x = Some(value);
-                    continue;
-                }
-                ABS_Y => {
-                    pending_y = Some(value);
-                    continue;
-                }
-                ABS_TILT_X => {
-                    pending_tilt_x = Some(value);
-                    continue;
-                }
-                ABS_TILT_Y => {
-                    pending_tilt_y = Some(value);
-                    continue;
-                }
-                _ => {}
+    pub fn frames_written(&self) -> u64 {
+        self.frame_count
+    }
+
+    /// Write at most one motion-only frame per `interval`; see `governor.rs`.
+    pub fn with_rate_limit(mut self, interval: Duration) -> Self {
+        self.governor = RateGovernor::new(interval);
+        self
+    }
+
+    /// Process a run of events, emitting a uinput frame at each SYN_REPORT.
+    /// `time_us` is the tablet timestamp of the run, used for prediction;
+    /// `queued` is how many more pen runs are already waiting to be read.
+    pub fn handle_frame(
+        &mut self,
+        events: &[RawEvent],
+        time_us: i64,
+        queued: usize,
+    ) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
+        let mut backlog = queued + events.iter().filter(|ev| ev.is_syn_report()).count();
+
+        for &ev in events {
+            if !ev.is_syn_report() {
+                self.frame.record(ev.ty, ev.code, ev.value);
+                continue;
+            }
+
+            // A merged frame stays in `self.frame` and is overwritten by
+            // the next one, which is always in this run or a queued one.
+            backlog = backlog.saturating_sub(1);
+            if backlog >= COALESCE_BACKLOG && self.is_plain_hover() {
+                self.merged_count += 1;
+                continue;
+            }
+            if self.is_motion_only() && self.governor.should_hold() {
+                self.held_time_us = time_us;
+                self.merged_count += 1;
+                continue;
             }
+            self.emit_frame(time_us)?;
+        }
+        Ok(())
+    }
+
+    /// When the frame held back by the rate limit is due, if there is one.
+    pub fn held_deadline(&self) -> Option<Instant> {
+        self.governor.deadline()
+    }
+
+    /// Write the frame held back by the rate limit once it is due.
+    pub fn flush_held(&mut self) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
+        if self.governor.is_due() {
+            self.emit_frame(self.held_time_us)?;
         }
+        Ok(())
+    }
 
-        batch.push(ev);
+    /// Lift the pen out of proximity and forget the stream's state, e.g.
+    /// when the connection drops mid-stroke.
+    pub fn release_all(&mut self) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
+        self.frame = PenFrame::default();
+        self.frame.pressure = Some(0);
+        self.frame.tool_pen = Some(false);
+        self.frame.stylus = Some(false);
+        self.emit_frame(0)?;
 
-        if ty != EV_SYN || code != SYN_REPORT {
-            continue;
+        if let Some(predictor) = self.predictor.as_mut() {
+            predictor.reset();
         }
+        Ok(())
+    }
+
+    /// Whether the pending frame only moves a hovering pen: no contact, no
+    /// pressure edge and no key changes.
+    fn is_plain_hover(&self) -> bool {
+        let frame = &self.frame;
+        !self.touch_down
+            && frame.pressure.unwrap_or(self.last_pressure) == 0
+            && frame.tool_pen.is_none()
+            && frame.stylus.is_none()
+    }
+
+    /// Whether the pending frame carries no edge: contact and keys stay as
+    /// they are, whatever the pen moves or presses.
+    fn is_motion_only(&self) -> bool {
+        let frame = &self.frame;
+        (frame.pressure.unwrap_or(self.last_pressure) > 0) == self.touch_down
+            && frame.tool_pen.is_none()
+            && frame.stylus.is_none()
+    }
 
-        // Transform and emit position events
-        if let (Some(x), Some(y)) = (pending_x.take(), pending_y.take()) {
-            let (out_x, out_y) = orientation.transform_pen(
-                x, y,
-                device_profile.pen_x_max,
-                device_profile.pen_y_max,
-            );
-            batch.insert(0, InputEvent::new(evdevil::event::EventType::from_raw(EV_ABS), Abs::X.raw(), out_x));
-            batch.insert(1, InputEvent::new(evdevil::event::EventType::from_raw(EV_ABS), Abs::Y.raw(), out_y));
+    fn emit_frame(&mut self, time_us: i64) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
+        let frame = std::mem::take(&mut self.frame);
+        let device_profile = self.device_profile;
+        let out = &mut self.out;
+        out.clear();
+
+        if let Some(pressure) = frame.pressure {
+            self.last_pressure = pressure;
         }
+        let now_touching = self.last_pressure > 0;
 
-        // Transform and emit tilt events
-        if let (Some(tx), Some(ty)) = (pending_tilt_x.take(), pending_tilt_y.take()) {
-            let (out_tx, out_ty) = orientation.transform_tilt(tx, ty);
-            batch.insert(0, InputEvent::new(evdevil::event::EventType::from_raw(EV_ABS), Abs::TILT_X.raw(), out_tx));
-            batch.insert(1, InputEvent::new(evdevil::event::EventType::from_raw(EV_ABS), Abs::TILT_Y.raw(), out_ty));
+        if let Some(tool_pen) = frame.tool_pen {
+            out.push(EV_KEY, Key::BTN_TOOL_PEN.raw(), tool_pen as i32);
+            self.in_range = tool_pen;
+        }
+        let lifted = self.touch_down && !now_touching;
+        if now_touching != self.touch_down {
+            out.push(EV_KEY, Key::BTN_TOUCH.raw(), now_touching as i32);
+        }
+        self.touch_down = now_touching;
+        if let Some(stylus) = frame.stylus {
+            out.push(EV_KEY, Key::BTN_STYLUS.raw(), stylus as i32);
         }
 
-        let pressure = batch
-            .iter()
-            .rfind(|e| e.event_type().raw() == EV_ABS && e.raw_code() == ABS_PRESSURE)
-            .map(|e| e.raw_value())
-            .unwrap_or(0);
+        let moved = frame.x.is_some() || frame.y.is_some();
+        self.last_x = frame.x.unwrap_or(self.last_x);
+        self.last_y = frame.y.unwrap_or(self.last_y);
+        if let Some(palm) = &self.palm {
+            let (x_max, y_max) = self.orientation.pen_output_dimensions(device_profile.pen_x_max, device_profile.pen_y_max);
+            let (x, y) = self.position_transform.apply(self.last_x, self.last_y);
+            palm.update_pen(self.in_range || now_touching, ScreenPoint::from_output(x, y, x_max, y_max));
+        }
 
-        let now_touching = pressure > 0;
-        update_palm_state(&palm, now_touching);
+        let pos = match self.predictor.as_mut() {
+            None => moved.then_some((self.last_x, self.last_y)),
+            Some(predictor) if moved && !lifted && frame.tool_pen != Some(false) => {
+                let (px, py) = predictor.predict(self.last_x, self.last_y, time_us);
+                Some((px.clamp(0, device_profile.pen_x_max), py.clamp(0, device_profile.pen_y_max)))
+            }
+            Some(predictor) => {
+                // Lifted, out of proximity or stopped: drop any overshoot
+                predictor.reset();
+                Some((self.last_x, self.last_y))
+            }
+        };
 
-        if now_touching != touch_down {
-            let key_ev = key_event(btn_touch_code, if now_touching { 1 } else { 0 });
-            batch.insert(0, key_ev);
+        if let Some((x, y)) = pos.filter(|&p| moved || p != self.out_pos) {
+            self.out_pos = (x, y);
+            let (out_x, out_y) = self.position_transform.apply(x, y);
+            out.push(EV_ABS, Abs::X.raw(), out_x);
+            out.push(EV_ABS, Abs::Y.raw(), out_y);
+        }
+        if let Some(pressure) = frame.pressure {
+            out.push(EV_ABS, Abs::PRESSURE.raw(), pressure);
         }
-        touch_down = now_touching;
+        if let Some(distance) = frame.distance {
+            out.push(EV_ABS, Abs::DISTANCE.raw(), distance);
+        }
+        if frame.tilt_x.is_some() || frame.tilt_y.is_some() {
+            self.last_tilt_x = frame.tilt_x.unwrap_or(self.last_tilt_x);
+            self.last_tilt_y = frame.tilt_y.unwrap_or(self.last_tilt_y);
+            let (out_tx, out_ty) = self.tilt_transform.apply(self.last_tilt_x, self.last_tilt_y);
+            out.push(EV_ABS, Abs::TILT_X.raw(), out_tx);
+            out.push(EV_ABS, Abs::TILT_Y.raw(), out_ty);
+        }
+        out.finish();
 
-        if frame_count == 0 {
+        if self.frame_count == 0 {
             log::info!("Pen events flowing");
         }
-        frame_count += 1;
+        self.frame_count += 1;
 
-        uinput.write(&batch)?;
-        batch.clear();
+        self.uinput.write(self.out.events())?;
+        self.governor.emitted();
 
-        if frame_count.is_multiple_of(500) {
-            log::debug!("Pen frames forwarded: {}", frame_count);
+        if self.frame_count.is_multiple_of(500) {
+            log::debug!("Pen frames forwarded: {} ({} frames merged)", self.frame_count, self.merged_count);
         }
+
+        Ok(())
     }
 }
 
-fn update_palm_state(palm: &Option<SharedPalmState>, now_touching: bool) {
-    let Some(palm_state) = palm else { return };
-    let Ok(mut state) = palm_state.lock() else { return };
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::device::RM2;
+    use evdevil::event::InputEvent;
+    use std::cell::RefCell;
+    use std::io;
+
+    use super::super::event::{EV_SYN, SYN_REPORT};
+
+    #[derive(Default)]
+    struct RecordingSink {
+        frames: RefCell<Vec<Vec<(u16, u16, i32)>>>,
+    }
+
+    impl EventSink for RecordingSink {
+        fn write(&self, events: &[InputEvent]) -> io::Result<()> {
+            let frame = events.iter().map(|e| (e.event_type().raw(), e.raw_code(), e.raw_value())).collect();
+            self.frames.borrow_mut().push(frame);
+            Ok(())
+        }
+    }
+
+    fn processor() -> PenProcessor<'static, RecordingSink> {
+        PenProcessor::with_sink(RecordingSink::default(), &RM2, Orientation::Portrait, None, 0)
+    }
+
+    fn abs(code: u16, value: i32) -> RawEvent {
+        RawEvent::new(EV_ABS, code, value)
+    }
+
+    const SYN: RawEvent = RawEvent::new(EV_SYN, SYN_REPORT, 0);
+
+    #[test]
+    fn test_frame_is_serialized_in_canonical_order() {
+        let mut pen = processor();
+        pen.handle_frame(&[abs(ABS_TILT_Y, 5), abs(ABS_PRESSURE, 100), abs(ABS_Y, 200), abs(ABS_X, 100), abs(ABS_TILT_X, 7), SYN], 0, 0)
+            .unwrap();
+
+        let frames = pen.uinput.frames.borrow();
+        let codes: Vec<(u16, u16)> = frames[0].iter().map(|&(ty, code, _)| (ty, code)).collect();
+        assert_eq!(
+            codes,
+            vec![
+                (EV_KEY, Key::BTN_TOUCH.raw()),
+                (EV_ABS, ABS_X),
+                (EV_ABS, ABS_Y),
+                (EV_ABS, ABS_PRESSURE),
+                (EV_ABS, ABS_TILT_X),
+                (EV_ABS, ABS_TILT_Y),
+                (EV_SYN, SYN_REPORT),
+            ]
+        );
+    }
+
+    #[test]
+    fn test_partial_updates_carry_previous_values() {
+        let mut pen = processor();
+        pen.handle_frame(&[abs(ABS_X, 100), abs(ABS_Y, 200), abs(ABS_PRESSURE, 100), SYN], 0, 0).unwrap();
+        // Only X moves; pressure is unchanged so the digitizer omits it.
+        pen.handle_frame(&[abs(ABS_X, 150), SYN], 4000, 0).unwrap();
+
+        let frames = pen.uinput.frames.borrow();
+        let (out_x, out_y) = Orientation::Portrait.transform_pen(150, 200, RM2.pen_x_max, RM2.pen_y_max);
+        assert_eq!(frames[1], vec![(EV_ABS, ABS_X, out_x), (EV_ABS, ABS_Y, out_y), (EV_SYN, SYN_REPORT, 0)]);
+    }
+
+    #[test]
+    fn test_prediction_settles_when_pen_stops() {
+        let mut pen = PenProcessor::with_sink(RecordingSink::default(), &RM2, Orientation::LandscapeRight, None, 10);
+        for i in 0..10 {
+            pen.handle_frame(&[abs(ABS_X, 1000 + i * 40), abs(ABS_Y, 500), abs(ABS_PRESSURE, 100), SYN], i as i64 * 4000, 0)
+                .unwrap();
+        }
+        // Pressure changes without motion: the overshoot is taken back
+        pen.handle_frame(&[abs(ABS_PRESSURE, 90), SYN], 40_000, 0).unwrap();
+
+        // Landscape-right is the digitizer's native orientation
+        let frames = pen.uinput.frames.borrow();
+        let x_of = |frame: &Vec<(u16, u16, i32)>| frame.iter().find(|e| e.1 == ABS_X).unwrap().2;
+        let real = 1000 + 9 * 40;
+        assert!(x_of(&frames[9]) > real, "expected lead: {}", x_of(&frames[9]));
+        assert_eq!(x_of(&frames[10]), real);
+    }
+
+    #[test]
+    fn test_backlogged_hover_frames_are_merged() {
+        let mut pen = processor();
+        let mut run = Vec::new();
+        for i in 0..6 {
+            run.extend([abs(ABS_X, 100 + i), SYN]);
+        }
+        run.extend([abs(ABS_X, 200), abs(ABS_PRESSURE, 50), SYN, abs(ABS_X, 201), SYN]);
+        pen.handle_frame(&run, 0, 0).unwrap();
+
+        // The first four hover frames wait behind at least four more and
+        // are merged; the rest go out, and contact frames always do.
+        let frames = pen.uinput.frames.borrow();
+        assert_eq!(frames.len(), 4);
+        let (_, y_of_first) = Orientation::Portrait.transform_pen(104, 0, RM2.pen_x_max, RM2.pen_y_max);
+        assert_eq!(frames[0][1], (EV_ABS, ABS_Y, y_of_first));
+        assert_eq!(pen.merged_count, 4);
+    }
+
+    #[test]
+    fn test_rate_limit_holds_motion_but_not_contact() {
+        let mut pen = processor().with_rate_limit(Duration::from_secs(60));
+        pen.handle_frame(&[abs(ABS_X, 100), SYN], 0, 0).unwrap();
+        pen.handle_frame(&[abs(ABS_X, 110), SYN], 4000, 0).unwrap();
+        pen.handle_frame(&[abs(ABS_X, 120), SYN], 8000, 0).unwrap();
+        assert_eq!(pen.uinput.frames.borrow().len(), 1);
+        assert!(pen.held_deadline().is_some());
 
-    state.pen_down = now_touching;
-    if !now_touching {
-        state.last_pen_up = Some(Instant::now());
+        // Touching down goes out at once, carrying the held motion
+        pen.handle_frame(&[abs(ABS_PRESSURE, 50), SYN], 12_000, 0).unwrap();
+        let frames = pen.uinput.frames.borrow();
+        assert_eq!(frames.len(), 2);
+        assert_eq!(frames[1][0], (EV_KEY, Key::BTN_TOUCH.raw(), 1));
+        let (out_x, _) = Orientation::Portrait.transform_pen(120, 0, RM2.pen_x_max, RM2.pen_y_max);
+        assert!(frames[1].contains(&(EV_ABS, ABS_X, out_x)));
+        assert!(pen.held_deadline().is_none());
     }
 }
@@ -0,0 +1,108 @@
+//! Pen motion prediction.
+//!
+//! Tracks the pen's velocity from timestamped position samples with an
+//! alpha-beta style filter and extrapolates each real sample `lead` ahead.
+//! Every new sample replaces the previous prediction, so errors never
+//! accumulate; the cost is a small overshoot when the pen stops or turns.
+
+/// How strongly each sample's velocity error corrects the estimate. Lower
+/// is smoother but slower to follow changes in speed.
+const VELOCITY_GAIN: f64 = 0.4;
+
+/// Longer gaps between samples (pen lifted away, dropped frames) restart
+/// the track instead of producing a huge velocity.
+const MAX_GAP_US: i64 = 50_000;
+
+/// Samples closer together than this carry no usable velocity; frames
+/// delivered in one batch may share a timestamp.
+const MIN_DT_US: i64 = 500;
+
+/// Extrapolates pen positions (in device coordinates) a fixed time ahead.
+pub struct PenPredictor {
+    lead_us: f64,
+    track: Option<Track>,
+}
+
+struct Track {
+    pos: [f64; 2],
+    /// Device units per µs, None until two samples have been seen.
+    velocity: Option<[f64; 2]>,
+    time_us: i64,
+}
+
+impl PenPredictor {
+    pub fn new(lead_ms: u64) -> Self {
+        Self {
+            lead_us: lead_ms as f64 * 1000.0,
+            track: None,
+        }
+    }
+
+    /// Forget the motion history, e.g. when the pen leaves proximity.
+    pub fn reset(&mut self) {
+        self.track = None;
+    }
+
+    /// Feed a real sample taken at `time_us` and return the position
+    /// predicted `lead` ahead of it.
+    pub fn predict(&mut self, x: i32, y: i32, time_us: i64) -> (i32, i32) {
+        let pos = [x as f64, y as f64];
+
+        let Some(track) = self.track.as_mut() else {
+            self.track = Some(Track { pos, velocity: None, time_us });
+            return (x, y);
+        };
+
+        let dt = time_us - track.time_us;
+        if !(0..=MAX_GAP_US).contains(&dt) {
+            *track = Track { pos, velocity: None, time_us };
+            return (x, y);
+        }
+        if dt < MIN_DT_US {
+            track.pos = pos;
+        } else {
+            let measured = [(pos[0] - track.pos[0]) / dt as f64, (pos[1] - track.pos[1]) / dt as f64];
+            track.velocity = Some(match track.velocity {
+                None => measured,
+                Some(v) => [
+                    v[0] + VELOCITY_GAIN * (measured[0] - v[0]),
+                    v[1] + VELOCITY_GAIN * (measured[1] - v[1]),
+                ],
+            });
+            track.pos = pos;
+            track.time_us = time_us;
+        }
+
+        let Some(v) = track.velocity else {
+            return (x, y);
+        };
+        (
+            (pos[0] + v[0] * self.lead_us).round() as i32,
+            (pos[1] + v[1] * self.lead_us).round() as i32,
+        )
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_constant_velocity_is_extrapolated() {
+        let mut predictor = PenPredictor::new(10);
+        let mut out = (0, 0);
+        // 1 unit per 100 µs = 100 units per 10 ms
+        for i in 0..20 {
+            out = predictor.predict(1000 + i * 40, 500, i as i64 * 4000);
+        }
+        assert_eq!(out, (1000 + 19 * 40 + 100, 500));
+    }
+
+    #[test]
+    fn test_gap_restarts_track() {
+        let mut predictor = PenPredictor::new(10);
+        predictor.predict(0, 0, 0);
+        predictor.predict(100, 0, 4000);
+        assert_eq!(predictor.predict(5000, 5000, 1_000_000), (5000, 5000));
+    }
+}
@@ -0,0 +1,159 @@
+//! Single-threaded readiness loop for the input path.
+//!
+//! Every fd the forwarding loop waits on is registered here and waited on
+//! with one poll(2) bounded by the nearest timer deadline, so one thread
+//! serves all of them without blocking inside any single one.
+
+use std::io;
+use std::os::fd::{AsRawFd, FromRawFd, OwnedFd, RawFd};
+use std::time::Instant;
+
+/// Handle for a registered fd.
+#[derive(Debug, Clone, Copy)]
+pub struct Token(usize);
+
+pub struct Reactor {
+    fds: Vec<libc::pollfd>,
+}
+
+impl Reactor {
+    pub fn new() -> Self {
+        Self { fds: Vec::new() }
+    }
+
+    /// Register `fd`, initially waiting for it to become readable.
+    pub fn register(&mut self, fd: RawFd) -> Token {
+        let entry = libc::pollfd { fd, events: libc::POLLIN, revents: 0 };
+        // Reuse a slot freed by `deregister`; poll(2) skips them meanwhile
+        if let Some(free) = self.fds.iter().position(|slot| slot.fd < 0) {
+            self.fds[free] = entry;
+            return Token(free);
+        }
+        self.fds.push(entry);
+        Token(self.fds.len() - 1)
+    }
+
+    /// Stop waiting on `token`, e.g. when its connection closes. The token
+    /// must not be used afterwards.
+    pub fn deregister(&mut self, token: Token) {
+        self.fds[token.0] = libc::pollfd { fd: -1, events: 0, revents: 0 };
+    }
+
+    /// Choose what to wait for on `token`.
+    pub fn set_interest(&mut self, token: Token, readable: bool, writable: bool) {
+        let mut events = 0;
+        if readable {
+            events |= libc::POLLIN;
+        }
+        if writable {
+            events |= libc::POLLOUT;
+        }
+        self.fds[token.0].events = events;
+    }
+
+    /// Whether the last wait found `token` readable; clears that, so it is
+    /// only reported once per wait.
+    pub fn take_readable(&mut self, token: Token) -> bool {
+        let fd = &mut self.fds[token.0];
+        let readable = fd.revents & libc::POLLIN != 0;
+        fd.revents &= !libc::POLLIN;
+        readable
+    }
+
+    /// Wait until a registered fd is ready or `deadline` passes; returns
+    /// whether any fd is ready. A signal interrupting the wait counts as a
+    /// spurious wakeup.
+    pub fn wait(&mut self, deadline: Instant) -> io::Result<bool> {
+        let remaining = deadline.saturating_duration_since(Instant::now());
+        // Round up so a wakeup is never early
+        let timeout_ms = remaining.as_micros().div_ceil(1000).min(i32::MAX as u128) as i32;
+
+        for fd in &mut self.fds {
+            fd.revents = 0;
+        }
+        let ret = unsafe { libc::poll(self.fds.as_mut_ptr(), self.fds.len() as libc::nfds_t, timeout_ms) };
+        if ret < 0 {
+            let err = io::Error::last_os_error();
+            if err.kind() != io::ErrorKind::Interrupted {
+                return Err(err);
+            }
+        }
+        Ok(ret > 0)
+    }
+}
+
+/// Wakes a reactor waiting in another thread: an eventfd it registers.
+pub struct Waker {
+    fd: OwnedFd,
+}
+
+impl Waker {
+    pub fn new() -> io::Result<Self> {
+        let fd = unsafe { libc::eventfd(0, libc::EFD_NONBLOCK | libc::EFD_CLOEXEC) };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(Self { fd: unsafe { OwnedFd::from_raw_fd(fd) } })
+    }
+
+    pub fn wake(&self) {
+        let one = 1u64;
+        unsafe {
+            libc::write(self.fd.as_raw_fd(), (&raw const one).cast(), 8);
+        }
+    }
+
+    /// Consume the wakeups so far, so the fd stops being readable.
+    pub fn reset(&self) {
+        let mut count = 0u64;
+        unsafe {
+            libc::read(self.fd.as_raw_fd(), (&raw mut count).cast(), 8);
+        }
+    }
+}
+
+impl AsRawFd for Waker {
+    fn as_raw_fd(&self) -> RawFd {
+        self.fd.as_raw_fd()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::io::Write;
+    use std::os::unix::net::UnixStream;
+    use std::time::Duration;
+
+    #[test]
+    fn test_wait_wakes_on_readable_or_deadline() {
+        let (mut a, b) = UnixStream::pair().unwrap();
+        let mut reactor = Reactor::new();
+        reactor.register(b.as_raw_fd());
+
+        let start = Instant::now();
+        assert!(!reactor.wait(start + Duration::from_millis(20)).unwrap());
+        assert!(start.elapsed() >= Duration::from_millis(20));
+
+        a.write_all(b"x").unwrap();
+        assert!(reactor.wait(Instant::now() + Duration::from_secs(5)).unwrap());
+    }
+
+    #[test]
+    fn test_deregistered_slots_are_skipped_and_reused() {
+        let waker = Waker::new().unwrap();
+        let mut reactor = Reactor::new();
+        let first = reactor.register(waker.as_raw_fd());
+        let second = reactor.register(waker.as_raw_fd());
+        reactor.deregister(first);
+
+        waker.wake();
+        assert!(reactor.wait(Instant::now() + Duration::from_secs(5)).unwrap());
+        assert!(!reactor.take_readable(first));
+        assert!(reactor.take_readable(second));
+
+        assert_eq!(reactor.register(waker.as_raw_fd()).0, first.0);
+        waker.reset();
+        assert!(!reactor.wait(Instant::now()).unwrap());
+    }
+}
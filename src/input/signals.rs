@@ -0,0 +1,103 @@
+//! Orientation changes requested by signal while running:
+//! `kill -USR1` turns the output a quarter clockwise, `kill -USR2` a
+//! quarter counter-clockwise.
+//!
+//! The signals are blocked and read from a signalfd by a thread of their
+//! own, which passes them on to every tablet's forwarding loop as control
+//! commands (see `control.rs`), so they never interrupt a loop and wait
+//! in its queue while it reconnects.
+
+use std::io;
+use std::mem::MaybeUninit;
+use std::os::fd::{AsRawFd, FromRawFd, OwnedFd, RawFd};
+
+/// Which way a signal asks to turn.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Rotation {
+    Clockwise,
+    CounterClockwise,
+}
+
+pub struct RotationSignals {
+    fd: OwnedFd,
+}
+
+impl RotationSignals {
+    /// Block SIGUSR1 and SIGUSR2 for this thread and the threads it starts
+    /// later, and open a signalfd for them. Call before spawning threads,
+    /// or one without the mask could take a signal's default action.
+    pub fn new() -> io::Result<Self> {
+        unsafe {
+            let mut set = MaybeUninit::<libc::sigset_t>::uninit();
+            libc::sigemptyset(set.as_mut_ptr());
+            libc::sigaddset(set.as_mut_ptr(), libc::SIGUSR1);
+            libc::sigaddset(set.as_mut_ptr(), libc::SIGUSR2);
+            let set = set.assume_init();
+
+            let err = libc::pthread_sigmask(libc::SIG_BLOCK, &set, std::ptr::null_mut());
+            if err != 0 {
+                return Err(io::Error::from_raw_os_error(err));
+            }
+            let fd = libc::signalfd(-1, &set, libc::SFD_NONBLOCK | libc::SFD_CLOEXEC);
+            if fd < 0 {
+                return Err(io::Error::last_os_error());
+            }
+            Ok(Self { fd: OwnedFd::from_raw_fd(fd) })
+        }
+    }
+
+    /// Wait for the next request.
+    pub fn wait(&self) -> io::Result<Rotation> {
+        loop {
+            if let Some(rotation) = self.take() {
+                return Ok(rotation);
+            }
+            let mut fd = libc::pollfd { fd: self.fd.as_raw_fd(), events: libc::POLLIN, revents: 0 };
+            if unsafe { libc::poll(&mut fd, 1, -1) } < 0 {
+                let err = io::Error::last_os_error();
+                if err.kind() != io::ErrorKind::Interrupted {
+                    return Err(err);
+                }
+            }
+        }
+    }
+
+    /// Take the next pending request, if any.
+    pub fn take(&self) -> Option<Rotation> {
+        let mut info = MaybeUninit::<libc::signalfd_siginfo>::uninit();
+        let size = std::mem::size_of::<libc::signalfd_siginfo>();
+        let n = unsafe { libc::read(self.fd.as_raw_fd(), info.as_mut_ptr().cast(), size) };
+        if n != size as isize {
+            return None;
+        }
+        match unsafe { info.assume_init() }.ssi_signo as i32 {
+            libc::SIGUSR1 => Some(Rotation::Clockwise),
+            libc::SIGUSR2 => Some(Rotation::CounterClockwise),
+            _ => None,
+        }
+    }
+}
+
+impl AsRawFd for RotationSignals {
+    fn as_raw_fd(&self) -> RawFd {
+        self.fd.as_raw_fd()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_signals_become_rotations() {
+        let signals = RotationSignals::new().unwrap();
+        assert_eq!(signals.take(), None);
+
+        // raise() targets this thread, which now has the signals blocked
+        unsafe {
+            libc::raise(libc::SIGUSR2);
+        }
+        assert_eq!(signals.take(), Some(Rotation::CounterClockwise));
+        assert_eq!(signals.take(), None);
+    }
+}
@@ -0,0 +1,66 @@
+//! Output side of the pen and touch pipelines.
+
+use std::io;
+
+use evdevil::event::{EventType, InputEvent};
+use evdevil::uinput::UinputDevice;
+
+use super::event::{EV_SYN, SYN_REPORT};
+
+/// Somewhere to write finished frames, normally a uinput device.
+pub trait EventSink {
+    /// Write a batch of events (including its SYN_REPORT) in one go.
+    fn write(&self, events: &[InputEvent]) -> io::Result<()>;
+}
+
+impl EventSink for UinputDevice {
+    fn write(&self, events: &[InputEvent]) -> io::Result<()> {
+        UinputDevice::write(self, events)
+    }
+}
+
+/// Fixed-capacity buffer a uinput frame is assembled in.
+///
+/// Reused for every frame, so building and emitting a frame never touches
+/// the heap.
+pub struct FrameBuffer<const N: usize> {
+    events: [InputEvent; N],
+    len: usize,
+}
+
+impl<const N: usize> FrameBuffer<N> {
+    pub fn new() -> Self {
+        let syn = InputEvent::new(EventType::from_raw(EV_SYN), SYN_REPORT, 0);
+        Self {
+            events: std::array::from_fn(|_| syn),
+            len: 0,
+        }
+    }
+
+    pub fn clear(&mut self) {
+        self.len = 0;
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    /// Append an event. Capacity is sized for the worst case frame, so
+    /// overflowing it is a bug; extra events are dropped in release builds.
+    pub fn push(&mut self, ty: u16, code: u16, value: i32) {
+        debug_assert!(self.len < N, "frame buffer overflow");
+        if self.len < N {
+            self.events[self.len] = InputEvent::new(EventType::from_raw(ty), code, value);
+            self.len += 1;
+        }
+    }
+
+    /// Terminate the frame with a SYN_REPORT.
+    pub fn finish(&mut self) {
+        self.push(EV_SYN, SYN_REPORT, 0);
+    }
+
+    pub fn events(&self) -> &[InputEvent] {
+        &self.events[..self.len]
+    }
+}
@@ -0,0 +1,791 @@
+//! Demultiplex the evgrab helper's single output stream into the pen and
+//! touch pipelines.
+
+use std::io::{self, Write};
+use std::os::fd::{AsRawFd, RawFd};
+use std::sync::atomic::Ordering;
+use std::time::{Duration, Instant};
+
+use evdevil::uinput::UinputDevice;
+use ssh2::BlockDirections;
+
+use crate::config::Config;
+use crate::control::{Command, CommandQueue, Metrics, SharedMetrics, Target};
+use crate::device::DeviceProfile;
+use crate::grab::Filter;
+use crate::orientation::Orientation;
+use crate::palm::SharedPalmState;
+use crate::ssh::{self, ConnectionCache, GrabCleanup};
+use crate::transport::{HelperStream, Transport};
+
+use super::compact::CompactDecoder;
+use super::datagram::DatagramReceiver;
+use super::event::{
+    block_decoder, parse_clock, parse_hello, parse_listen, seq_is_newer, split_seq, BlockDecoder,
+    FrameReader, RawEvent, ABS_DISTANCE, ABS_MT_POSITION_X, ABS_MT_POSITION_Y, CONTROL_CLOCK, CONTROL_DEVICE,
+    COALESCE_BACKLOG, CONTROL_KEEPALIVE, CONTROL_LISTEN, EV_ABS, EV_KEY, FRAME_COMPACT, FRAME_HEADER_SIZE,
+    FRAME_SEQ, MOTION_AXES,
+};
+use super::latency::{wall_clock_us, LatencyStats, Stream};
+use super::pacer::Pacer;
+use super::pen::PenProcessor;
+use super::reactor::{Reactor, Token};
+use super::signals::Rotation;
+use super::sink::EventSink;
+use super::touch::TouchProcessor;
+use super::udev;
+
+/// How often to feed the helper's watchdog. It exits after 5 seconds
+/// without a heartbeat, releasing the grab.
+const HEARTBEAT_INTERVAL: Duration = Duration::from_secs(2);
+
+/// Byte sent to the helper's stdin as a heartbeat. Any byte feeds the
+/// watchdog; this one also makes the helper answer with a clock frame,
+/// which keeps the clock offset estimate for latency stats current.
+const HEARTBEAT: u8 = b'p';
+
+/// The helper sends at least a keepalive every second; this much silence
+/// means the connection is dead even if TCP hasn't noticed yet.
+const STREAM_TIMEOUT: Duration = Duration::from_secs(5);
+
+/// Forwards pen and touch input from one tablet, one connection at a time.
+///
+/// The virtual devices and what is known about the tablet outlive each
+/// connection, so a reconnect costs only the SSH session setup and is
+/// invisible to the desktop apart from the gap in input. The loop in
+/// `forwarding` drives every tablet's forwarder from one thread.
+pub struct InputForwarder<'a> {
+    config: &'a Config,
+    device_profile: &'a DeviceProfile,
+    pen: Option<PenProcessor<'a>>,
+    touch: Option<TouchProcessor<'a>>,
+    /// Lent to the thread setting up a connection while it runs.
+    connection: Option<ConnectionCache>,
+    /// Orientation the processors use now; starts out as configured.
+    orientation: Orientation,
+    metrics: SharedMetrics,
+    commands: CommandQueue,
+    paused: Paused,
+    /// Decoded events of the frame at hand.
+    events: Vec<RawEvent>,
+}
+
+/// Streams stopped from the control socket.
+#[derive(Default)]
+struct Paused {
+    pen: bool,
+    touch: bool,
+}
+
+/// What setting up a connection hands back: the cache it borrowed, and the
+/// connection if it came up.
+pub type ConnectOutcome = (ConnectionCache, Result<Connection, Box<dyn std::error::Error + Send + Sync>>);
+
+/// One connection to the helper, from its hello on.
+pub struct Connection {
+    cleanup: GrabCleanup,
+    reader: FrameReader<HelperStream>,
+    datagrams: Option<DatagramReceiver>,
+    pen_index: Option<u8>,
+    touch_index: Option<u8>,
+    decode_raw: BlockDecoder,
+    decoders: Vec<CompactDecoder>,
+    /// Sequence number of the latest frame applied per device (FRAME_SEQ)
+    last_seq: Vec<u32>,
+    pacer: Option<Pacer>,
+    latency: LatencyStats,
+    next_heartbeat: Instant,
+    heartbeat_due: bool,
+    last_frame: Instant,
+    /// Set once the connection's sockets are registered with the reactor.
+    tokens: Option<Tokens>,
+}
+
+/// A connection's sockets in the reactor.
+#[derive(Clone, Copy)]
+struct Tokens {
+    socket: Token,
+    data_socket: Option<Token>,
+    datagrams: Option<Token>,
+}
+
+impl<'a> InputForwarder<'a> {
+    /// Create the virtual devices and connect to the tablet. Both take a
+    /// while and don't depend on each other, so they run side by side.
+    pub fn new(
+        config: &'a Config,
+        device_profile: &'a DeviceProfile,
+        palm: Option<SharedPalmState>,
+        metrics: SharedMetrics,
+        commands: CommandQueue,
+        mut connection: ConnectionCache,
+    ) -> Result<Self, Box<dyn std::error::Error + Send + Sync>> {
+        let (devices, warm_up) = std::thread::scope(|s| {
+            let devices = s.spawn(|| create_devices(config, device_profile, palm));
+            let warm_up = connection.warm_up(config);
+            (devices.join(), warm_up)
+        });
+        let (pen, touch) = devices.map_err(|_| "Creating the virtual devices panicked")??;
+
+        // Not fatal: the first connection attempt connects again
+        if let Err(e) = warm_up {
+            log::warn!("[{}] Initial connection failed: {}", config.host, e);
+        }
+
+        Ok(Self {
+            config,
+            device_profile,
+            pen,
+            touch,
+            connection: Some(connection),
+            orientation: config.orientation,
+            metrics,
+            commands,
+            paused: Paused::default(),
+            events: Vec::with_capacity(256),
+        })
+    }
+
+    pub fn host(&self) -> &str {
+        &self.config.host
+    }
+
+    /// The fd that becomes readable when control commands are waiting.
+    pub fn commands_fd(&self) -> RawFd {
+        self.commands.as_raw_fd()
+    }
+
+    /// Apply the waiting control commands; they take effect whether or not
+    /// the tablet is connected.
+    pub fn apply_commands(&mut self) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
+        for command in self.commands.drain() {
+            apply_command(command, &mut self.orientation, &mut self.paused, &mut self.pen, &mut self.touch)?;
+        }
+        Ok(())
+    }
+
+    /// Take what a connection attempt needs, to run it away from the input
+    /// loop: setting a connection up blocks for the SSH handshake. Hand the
+    /// outcome to `connected`.
+    pub fn connect_job(&mut self) -> impl FnOnce() -> ConnectOutcome + Send + 'static {
+        let mut cache = self.connection.take().unwrap_or_else(|| ConnectionCache::new(None));
+        let config = self.config.clone();
+        let event_size = self.device_profile.input_event_size;
+        move || {
+            let result = connect(&config, event_size, &mut cache);
+            (cache, result)
+        }
+    }
+
+    /// Take back the cache lent to `connect_job` and, if the connection came
+    /// up, register it with the reactor for `service`.
+    pub fn connected(
+        &mut self,
+        (cache, result): ConnectOutcome,
+        reactor: &mut Reactor,
+    ) -> Result<Connection, Box<dyn std::error::Error + Send + Sync>> {
+        self.connection = Some(cache);
+        let mut connection = result?;
+
+        // From here on the sockets are only touched when poll says they are
+        // ready, and the heartbeat and stream timeout run off the deadline
+        // `service` returns.
+        connection.cleanup.session().set_blocking(false);
+        connection.reader.get_mut().set_nonblocking()?;
+        connection.tokens = Some(Tokens {
+            socket: reactor.register(connection.cleanup.session().as_raw_fd()),
+            data_socket: connection.reader.get_mut().data_fd().map(|fd| reactor.register(fd)),
+            datagrams: connection.datagrams.as_ref().map(|datagrams| reactor.register(datagrams.as_raw_fd())),
+        });
+
+        log::info!("[{}] Input forwarding started", self.config.host);
+        self.metrics.connections.fetch_add(1, Ordering::Relaxed);
+        self.metrics.connected.store(true, Ordering::Relaxed);
+        Ok(connection)
+    }
+
+    /// Forward everything `connection` has ready without blocking, and set
+    /// up the reactor to wait for more. Returns when the forwarder next
+    /// needs to run even if no socket becomes ready, or the error that
+    /// ended the connection.
+    pub fn service(
+        &mut self,
+        connection: &mut Connection,
+        reactor: &mut Reactor,
+    ) -> Result<Instant, Box<dyn std::error::Error + Send + Sync>> {
+        let Some(tokens) = connection.tokens else {
+            return Err("Connection is not registered".into());
+        };
+        let metrics = &*self.metrics;
+        let mut pipelines = Pipelines {
+            pen_index: connection.pen_index,
+            touch_index: connection.touch_index,
+            pen: &mut self.pen,
+            touch: &mut self.touch,
+            paused: &mut self.paused,
+            metrics,
+        };
+        let events = &mut self.events;
+        let Connection { reader, datagrams, decoders, last_seq, pacer, latency, .. } = connection;
+
+        loop {
+            let now = Instant::now();
+            if now >= connection.next_heartbeat {
+                connection.heartbeat_due = true;
+                connection.next_heartbeat = now + HEARTBEAT_INTERVAL;
+                metrics.publish_latency(latency.snapshot());
+                latency.maybe_report();
+            }
+            if connection.heartbeat_due && try_send_heartbeat(reader.get_mut())? {
+                connection.heartbeat_due = false;
+                latency.ping_sent();
+            }
+            if now.duration_since(connection.last_frame) >= STREAM_TIMEOUT {
+                return Err(format!("No data from the helper for {} s", STREAM_TIMEOUT.as_secs()).into());
+            }
+            if let Some(pacer) = pacer.as_mut() {
+                let backlog = |device| reader.queued_frames(device, COALESCE_BACKLOG);
+                pipelines.dispatch_paced(pacer, wall_clock_us(), backlog, events, latency)?;
+            }
+            if let Some(pen) = pipelines.pen.as_mut() {
+                pen.flush_held()?;
+                metrics.pen.frames_out.store(pen.frames_written(), Ordering::Relaxed);
+            }
+            if let Some(touch) = pipelines.touch.as_mut() {
+                touch.flush_held()?;
+                metrics.touch.frames_out.store(touch.frames_written(), Ordering::Relaxed);
+            }
+
+            let (frame, payload, from_datagram) = match reader.next_frame() {
+                Ok((frame, payload)) => (frame, payload, false),
+                Err(e) if e.kind() == io::ErrorKind::WouldBlock => {
+                    if let Some(datagrams) = datagrams.as_mut() {
+                        datagrams.drain()?;
+                    }
+                    if let Some((frame, payload)) = datagrams.as_mut().and_then(DatagramReceiver::take) {
+                        (frame, payload, true)
+                    } else {
+                        // Everything buffered is handled: wait until a socket
+                        // is ready or a timer is due
+                        let blocked = connection.cleanup.session().block_directions();
+                        let inbound = matches!(blocked, BlockDirections::Inbound | BlockDirections::Both);
+                        let outbound = matches!(blocked, BlockDirections::Outbound | BlockDirections::Both);
+                        // With a separate data connection, SSH only needs reading
+                        // when libssh2 waits on it to send the heartbeat
+                        let read_ssh = tokens.data_socket.is_none() || inbound;
+                        reactor.set_interest(tokens.socket, read_ssh, outbound || connection.heartbeat_due);
+                        let held = [
+                            pipelines.pen.as_ref().and_then(|pen| pen.held_deadline()),
+                            pipelines.touch.as_ref().and_then(|touch| touch.held_deadline()),
+                            pacer.as_ref().and_then(Pacer::deadline),
+                        ];
+                        let timers = connection.next_heartbeat.min(connection.last_frame + STREAM_TIMEOUT);
+                        return Ok(held.into_iter().flatten().fold(timers, Instant::min));
+                    }
+                }
+                Err(e) => return Err(e.into()),
+            };
+            connection.last_frame = Instant::now();
+            let received_us = wall_clock_us();
+            metrics
+                .bytes_received
+                .fetch_add((FRAME_HEADER_SIZE + payload.len()) as u64, Ordering::Relaxed);
+
+            if frame.device == CONTROL_DEVICE {
+                match frame.flags {
+                    CONTROL_KEEPALIVE => {}
+                    CONTROL_CLOCK => {
+                        if let Some(tablet_us) = parse_clock(payload) {
+                            latency.clock_received(tablet_us);
+                        }
+                    }
+                    other => log::debug!("Ignoring control frame type {:#04x}", other),
+                }
+                continue;
+            }
+
+            let Some(decoder) = decoders.get_mut(frame.device as usize) else {
+                log::warn!("Dropping frame from unknown device {}", frame.device);
+                continue;
+            };
+
+            let mut payload = payload;
+            let mut sequenced = Sequenced::Apply;
+            if frame.flags & FRAME_SEQ != 0 {
+                let Some((seq, rest)) = split_seq(payload) else {
+                    log::warn!("Dropping frame without sequence number");
+                    continue;
+                };
+                sequenced = sequence(&mut last_seq[frame.device as usize], seq, from_datagram);
+                if sequenced == Sequenced::Drop {
+                    continue;
+                }
+                payload = rest;
+            }
+
+            events.clear();
+            let event_us = if frame.flags & FRAME_COMPACT != 0 {
+                Some(decoder.decode(payload, events)?)
+            } else {
+                (connection.decode_raw)(payload, events)
+            };
+            if sequenced == Sequenced::EdgesOnly {
+                strip_motion(events);
+            }
+
+            if let (Some(pacer), Some(event_us)) = (pacer.as_mut(), event_us) {
+                pacer.push(frame.device, events, event_us, received_us);
+                continue;
+            }
+            let queued = reader.queued_frames(frame.device, COALESCE_BACKLOG);
+            pipelines.dispatch(frame.device, events, event_us, received_us, queued, latency)?;
+        }
+    }
+
+    /// Tear down a connection `service` gave up on, and release whatever
+    /// was held down through it.
+    pub fn disconnected(
+        &mut self,
+        connection: Connection,
+        reactor: &mut Reactor,
+    ) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
+        if let Some(tokens) = connection.tokens {
+            let Tokens { socket, data_socket, datagrams } = tokens;
+            for token in [Some(socket), data_socket, datagrams].into_iter().flatten() {
+                reactor.deregister(token);
+            }
+        }
+        drop(connection);
+        self.metrics.connected.store(false, Ordering::Relaxed);
+
+        // Don't leave a finger or the pen stuck down while disconnected
+        if let Some(pen) = self.pen.as_mut() {
+            pen.release_all()?;
+        }
+        if let Some(touch) = self.touch.as_mut() {
+            touch.release_all()?;
+        }
+        Ok(())
+    }
+}
+
+/// Set up a connection: start the helper over SSH, read its hello and, for
+/// the other transports, open the data connection it offers. Blocks.
+fn connect(
+    config: &Config,
+    input_event_size: usize,
+    cache: &mut ConnectionCache,
+) -> Result<Connection, Box<dyn std::error::Error + Send + Sync>> {
+    // The helper numbers devices in command-line order.
+    let mut device_paths = Vec::new();
+    if config.run_pen() {
+        device_paths.push(config.pen_device.as_str());
+    }
+    if config.run_touch() {
+        device_paths.push(config.touch_device.as_str());
+    }
+
+    let pen_index = config.run_pen().then_some(0u8);
+    let touch_index = config.run_touch().then(|| device_paths.len() as u8 - 1);
+    let filters = helper_filters(config, pen_index, touch_index);
+
+    let (cleanup, channel) = ssh::open_helper_stream(&device_paths, &filters, config, cache)?;
+    let mut reader = FrameReader::new(HelperStream::Ssh(channel));
+
+    let features = match read_hello(&mut reader) {
+        Ok(features) => features,
+        Err(e) => {
+            cache.invalidate_helper();
+            return Err(e);
+        }
+    };
+    log::debug!("Helper features: {:#04x}", features);
+
+    let mut datagrams = None;
+    if config.transport != Transport::Ssh {
+        let peer = ssh::peer_ip(cleanup.session())?;
+        if config.transport == Transport::Udp {
+            datagrams = Some(DatagramReceiver::bind(peer)?);
+        }
+
+        let (frame, payload) = reader.next_frame()?;
+        let listen = (frame.device == CONTROL_DEVICE && frame.flags == CONTROL_LISTEN)
+            .then(|| parse_listen(payload))
+            .flatten();
+        let Some((port, token)) = listen else {
+            return Err("Helper did not offer a data connection".into());
+        };
+
+        let datagram_port = datagrams.as_ref().map(DatagramReceiver::port).transpose()?;
+        let stream = reader.into_inner().connect_data(peer, port, &token, datagram_port)?;
+        reader = FrameReader::new(stream);
+        read_hello(&mut reader)?;
+        log::info!("[{}] Streaming input over {} port {}", config.host, config.transport, port);
+    }
+
+    let mut latency = LatencyStats::new();
+    reader.get_mut().write_all(&[HEARTBEAT])?;
+    latency.ping_sent();
+
+    Ok(Connection {
+        cleanup,
+        reader,
+        datagrams,
+        pen_index,
+        touch_index,
+        decode_raw: block_decoder(input_event_size),
+        decoders: device_paths.iter().map(|_| CompactDecoder::new()).collect(),
+        last_seq: vec![0; device_paths.len()],
+        pacer: (config.pacing_ms > 0).then(|| Pacer::new(Duration::from_millis(config.pacing_ms))),
+        latency,
+        next_heartbeat: Instant::now() + HEARTBEAT_INTERVAL,
+        heartbeat_due: false,
+        last_frame: Instant::now(),
+        tokens: None,
+    })
+}
+
+/// The pipelines decoded frames go to, by helper device number.
+struct Pipelines<'f, 'a, S: EventSink = UinputDevice> {
+    pen_index: Option<u8>,
+    touch_index: Option<u8>,
+    pen: &'f mut Option<PenProcessor<'a, S>>,
+    touch: &'f mut Option<TouchProcessor<'a, S>>,
+    paused: &'f mut Paused,
+    metrics: &'f Metrics,
+}
+
+impl<S: EventSink> Pipelines<'_, '_, S> {
+    /// Dispatch the frames `pacer` has due at `now_us`. The frames it still
+    /// holds are held on purpose, not a backlog, so only `backlog` (frames
+    /// from a device still waiting on the link) lets motion be merged.
+    fn dispatch_paced(
+        &mut self,
+        pacer: &mut Pacer,
+        now_us: i64,
+        backlog: impl Fn(u8) -> usize,
+        events: &mut Vec<RawEvent>,
+        latency: &mut LatencyStats,
+    ) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
+        while let Some(frame) = pacer.pop_due(now_us, events) {
+            let queued = backlog(frame.device);
+            self.dispatch(frame.device, events, Some(frame.event_us), frame.received_us, queued, latency)?;
+        }
+        Ok(())
+    }
+
+    /// Hand one device's decoded frame to its pipeline. `queued` is how
+    /// many more frames from the device are waiting, which lets the pen
+    /// merge hover; see `COALESCE_BACKLOG`.
+    fn dispatch(
+        &mut self,
+        device: u8,
+        events: &[RawEvent],
+        event_us: Option<i64>,
+        received_us: i64,
+        queued: usize,
+        latency: &mut LatencyStats,
+    ) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
+        let started = Instant::now();
+        let metrics = self.metrics;
+
+        // Paused streams are still decoded: compact frames build on the
+        // previous one
+        if Some(device) == self.pen_index {
+            metrics.pen.frames_in.fetch_add(1, Ordering::Relaxed);
+            if let Some(pen) = self.pen.as_mut().filter(|_| !self.paused.pen) {
+                pen.handle_frame(events, event_us.unwrap_or(received_us), queued)?;
+                latency.record(Stream::Pen, event_us, received_us, started);
+                metrics.pen.frames_out.store(pen.frames_written(), Ordering::Relaxed);
+            }
+        } else if Some(device) == self.touch_index {
+            metrics.touch.frames_in.fetch_add(1, Ordering::Relaxed);
+            if let Some(touch) = self.touch.as_mut().filter(|_| !self.paused.touch) {
+                touch.handle_frame(events)?;
+                latency.record(Stream::Touch, event_us, received_us, started);
+                metrics.touch.frames_out.store(touch.frames_written(), Ordering::Relaxed);
+                metrics.palm_suppressed.store(touch.palm_suppressed(), Ordering::Relaxed);
+            }
+        }
+        Ok(())
+    }
+}
+
+/// What to do with a FRAME_SEQ frame.
+#[derive(Debug, PartialEq)]
+enum Sequenced {
+    Apply,
+    /// A TCP frame overtaken by a datagram: its keys and pressure still
+    /// count, but the datagram already carried newer motion.
+    EdgesOnly,
+    /// A datagram overtaken by a later frame.
+    Drop,
+}
+
+/// Place frame `seq` against `last`, the latest one applied for its device,
+/// and advance `last` past it.
+fn sequence(last: &mut u32, seq: u32, from_datagram: bool) -> Sequenced {
+    if seq_is_newer(seq, *last) {
+        *last = seq;
+        Sequenced::Apply
+    } else if from_datagram {
+        Sequenced::Drop
+    } else {
+        Sequenced::EdgesOnly
+    }
+}
+
+fn strip_motion(events: &mut Vec<RawEvent>) {
+    events.retain(|event| event.ty != EV_ABS || !MOTION_AXES.contains(&event.code));
+}
+
+/// What the helper can drop before sending: input the host ignores, and
+/// noise inside the configured dead-bands.
+fn helper_filters(config: &Config, pen_index: Option<u8>, touch_index: Option<u8>) -> Vec<Filter> {
+    let mut filters = Vec::new();
+
+    if let Some(device) = touch_index {
+        // The touch pipeline only looks at ABS events
+        filters.push(Filter::Drop { device, ty: EV_KEY });
+        if config.touch_deadband > 0 {
+            for code in [ABS_MT_POSITION_X, ABS_MT_POSITION_Y] {
+                filters.push(Filter::DeadBand { device, code, band: config.touch_deadband });
+            }
+        }
+    }
+    if let Some(device) = pen_index {
+        if config.hover_deadband > 0 {
+            filters.push(Filter::DeadBand { device, code: ABS_DISTANCE, band: config.hover_deadband });
+        }
+        if config.hover_distance_max > 0 {
+            filters.push(Filter::Clamp { device, code: ABS_DISTANCE, max: config.hover_distance_max });
+        }
+    }
+
+    filters
+}
+
+/// Apply a command from the control socket or the rotation signals.
+fn apply_command(
+    command: Command,
+    orientation: &mut Orientation,
+    paused: &mut Paused,
+    pen: &mut Option<PenProcessor>,
+    touch: &mut Option<TouchProcessor>,
+) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
+    match command {
+        Command::Pause(Target::Pen) | Command::Resume(Target::Pen) => {
+            paused.pen = matches!(command, Command::Pause(_));
+            if let Some(pen) = pen.as_mut() {
+                pen.release_all()?;
+            }
+        }
+        Command::Pause(Target::Touch) | Command::Resume(Target::Touch) => {
+            paused.touch = matches!(command, Command::Pause(_));
+            if let Some(touch) = touch.as_mut() {
+                touch.release_all()?;
+            }
+        }
+        Command::PalmGrace(grace_ms) => {
+            if let Some(touch) = touch.as_mut() {
+                touch.set_grace_ms(grace_ms);
+            }
+        }
+        Command::Orientation(next) => switch_orientation(next, orientation, pen, touch)?,
+        Command::Rotate(rotation) => {
+            let next = match rotation {
+                Rotation::Clockwise => orientation.rotated_clockwise(),
+                Rotation::CounterClockwise => orientation.rotated_counter_clockwise(),
+            };
+            switch_orientation(next, orientation, pen, touch)?;
+        }
+    }
+    Ok(())
+}
+
+fn switch_orientation(
+    next: Orientation,
+    orientation: &mut Orientation,
+    pen: &mut Option<PenProcessor>,
+    touch: &mut Option<TouchProcessor>,
+) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
+    if next == *orientation {
+        return Ok(());
+    }
+
+    log::info!("Switching orientation: {} -> {}", orientation, next);
+    if let Some(pen) = pen.as_mut() {
+        pen.set_orientation(next)?;
+    }
+    if let Some(touch) = touch.as_mut() {
+        touch.set_orientation(next)?;
+    }
+    *orientation = next;
+    Ok(())
+}
+
+/// Read the helper's hello frame and return the features it enabled.
+fn read_hello(reader: &mut FrameReader<HelperStream>) -> Result<u8, Box<dyn std::error::Error + Send + Sync>> {
+    let (hello, payload) = reader.next_frame()?;
+    parse_hello(&hello, payload)
+}
+
+/// Create the enabled processors' uinput devices and wait until the desktop
+/// can see them.
+fn create_devices<'a>(
+    config: &Config,
+    device_profile: &'a DeviceProfile,
+    palm: Option<SharedPalmState>,
+) -> Result<(Option<PenProcessor<'a>>, Option<TouchProcessor<'a>>), Box<dyn std::error::Error + Send + Sync>> {
+    let pen = match config.run_pen() {
+        true => Some(PenProcessor::new(config, device_profile, palm.clone())?),
+        false => None,
+    };
+    let touch = match config.run_touch() {
+        true => Some(TouchProcessor::new(config, device_profile, palm)?),
+        false => None,
+    };
+
+    let sysnames: Vec<String> = pen
+        .as_ref()
+        .and_then(PenProcessor::sysname)
+        .into_iter()
+        .chain(touch.as_ref().and_then(TouchProcessor::sysname))
+        .collect();
+    udev::wait_for_devices(&sysnames);
+
+    Ok((pen, touch))
+}
+
+/// Send a heartbeat without blocking; false if the channel can't take it
+/// right now.
+fn try_send_heartbeat(stream: &mut HelperStream) -> io::Result<bool> {
+    match stream.write(&[HEARTBEAT]) {
+        Ok(n) => Ok(n == 1),
+        Err(e) if e.kind() == io::ErrorKind::WouldBlock => Ok(false),
+        Err(e) => Err(e),
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::device::RM2;
+    use evdevil::event::InputEvent;
+    use std::cell::{Cell, RefCell};
+    use std::collections::BTreeMap;
+    use std::rc::Rc;
+
+    use super::super::event::{ABS_PRESSURE, EV_SYN, SYN_REPORT};
+
+    const ABS_X: u16 = 0x00;
+    const ABS_Y: u16 = 0x01;
+    const BTN_TOUCH: u16 = 0x14a;
+
+    #[derive(Default)]
+    struct CountingSink {
+        writes: Cell<usize>,
+    }
+
+    impl EventSink for CountingSink {
+        fn write(&self, _events: &[InputEvent]) -> io::Result<()> {
+            self.writes.set(self.writes.get() + 1);
+            Ok(())
+        }
+    }
+
+    /// The latest value written per event type and code.
+    #[derive(Default, Clone)]
+    struct StateSink {
+        values: Rc<RefCell<BTreeMap<(u16, u16), i32>>>,
+    }
+
+    impl EventSink for StateSink {
+        fn write(&self, events: &[InputEvent]) -> io::Result<()> {
+            let mut values = self.values.borrow_mut();
+            for event in events {
+                values.insert((event.event_type().raw(), event.raw_code()), event.raw_value());
+            }
+            Ok(())
+        }
+    }
+
+    #[test]
+    fn test_lost_and_overtaken_frames_leave_the_pen_where_it_is() {
+        let abs = |code, value| RawEvent::new(EV_ABS, code, value);
+        let syn = RawEvent::new(EV_SYN, SYN_REPORT, 0);
+        // As the helper sends them: TCP frames with what changed, datagrams
+        // with every motion axis
+        let frames = [
+            (1, false, vec![RawEvent::new(EV_KEY, BTN_TOUCH, 1), abs(ABS_PRESSURE, 500), abs(ABS_X, 100), syn]),
+            (2, true, vec![abs(ABS_X, 110), syn]),
+            (3, true, vec![abs(ABS_X, 120), abs(ABS_Y, 100), syn]),
+            (4, true, vec![abs(ABS_X, 120), abs(ABS_Y, 120), syn]),
+            (5, false, vec![abs(ABS_PRESSURE, 700), abs(ABS_X, 125), syn]),
+            (6, true, vec![abs(ABS_X, 128), abs(ABS_Y, 130), syn]),
+        ];
+        let run = |order: &[usize]| {
+            let sink = StateSink::default();
+            let pen = PenProcessor::with_sink(sink.clone(), &RM2, Orientation::Portrait, None, 0);
+            let (mut pen, mut touch) = (Some(pen), None);
+            let (mut paused, metrics) = (Paused::default(), Metrics::new());
+            let mut pipelines = Pipelines {
+                pen_index: Some(0),
+                touch_index: None,
+                pen: &mut pen,
+                touch: &mut touch,
+                paused: &mut paused,
+                metrics: &metrics,
+            };
+            let (mut last_seq, mut latency) = (0, LatencyStats::new());
+            for &i in order {
+                let (seq, from_datagram, ref events) = frames[i];
+                let mut events = events.clone();
+                match sequence(&mut last_seq, seq, from_datagram) {
+                    Sequenced::Drop => continue,
+                    Sequenced::EdgesOnly => strip_motion(&mut events),
+                    Sequenced::Apply => {}
+                }
+                pipelines.dispatch(0, &events, None, 0, 0, &mut latency).unwrap();
+            }
+            sink.values.take()
+        };
+
+        // Datagram 3 is lost, and datagram 6 overtakes TCP frame 5
+        let received = run(&[0, 1, 3, 5, 4]);
+        assert_eq!(received, run(&[0, 1, 2, 3, 4, 5]));
+        // Datagrams are dropped once overtaken
+        assert_eq!(run(&[0, 5, 1]), run(&[0, 5]));
+    }
+
+    #[test]
+    fn test_paced_hover_is_not_merged() {
+        let pen = PenProcessor::with_sink(CountingSink::default(), &RM2, Orientation::Portrait, None, 0);
+        let (mut pen, mut touch) = (Some(pen), None);
+        let (mut paused, metrics) = (Paused::default(), Metrics::new());
+        let mut pipelines = Pipelines {
+            pen_index: Some(0),
+            touch_index: None,
+            pen: &mut pen,
+            touch: &mut touch,
+            paused: &mut paused,
+            metrics: &metrics,
+        };
+
+        // 20 ms of pacing holds ten frames of 500 Hz hover at any time
+        let mut pacer = Pacer::new(Duration::from_millis(20));
+        let (mut events, mut latency) = (Vec::new(), LatencyStats::new());
+        let hover = |i: i64| [RawEvent::new(EV_ABS, ABS_X, 100 + i as i32), RawEvent::new(EV_SYN, SYN_REPORT, 0)];
+        for i in 0..40 {
+            // Each frame arrives 1 ms after capture; the link has no backlog
+            let received_us = i * 2000 + 1000;
+            pacer.push(0, &hover(i), i * 2000, received_us);
+            pipelines.dispatch_paced(&mut pacer, received_us, |_| 0, &mut events, &mut latency).unwrap();
+            if i >= 10 {
+                assert_eq!(pipelines.pen.as_ref().unwrap().frames_written(), i as u64 - 9);
+            }
+        }
+        pipelines.dispatch_paced(&mut pacer, i64::MAX, |_| 0, &mut events, &mut latency).unwrap();
+        assert_eq!(pipelines.pen.as_ref().unwrap().frames_written(), 40);
+    }
+}
@@ -1,23 +1,46 @@
-use std::io::Read;
-use std::time::Duration;
+use std::io;
+use std::time::{Duration, Instant};
 
-use evdevil::event::{Abs, Key, KeyEvent, KeyState};
+use evdevil::event::{Abs, Key};
 use evdevil::uinput::{AbsSetup, UinputDevice};
-use evdevil::{AbsInfo, InputProp, Slot};
+use evdevil::{AbsInfo, InputProp};
 
 use crate::config::Config;
 use crate::device::DeviceProfile;
-use crate::orientation::Orientation;
-use crate::palm::SharedPalmState;
-use crate::ssh;
+use crate::orientation::{Orientation, Transform};
+use crate::palm::{ScreenPoint, SharedPalmState};
 
 use super::event::{
-    parse_input_event, ABS_MT_POSITION_X, ABS_MT_POSITION_Y, ABS_MT_SLOT, ABS_MT_TRACKING_ID,
-    EV_ABS, EV_KEY, EV_SYN, SYN_REPORT,
+    RawEvent, ABS_MT_POSITION_X, ABS_MT_POSITION_Y, ABS_MT_SLOT, ABS_MT_TOUCH_MAJOR, ABS_MT_TRACKING_ID,
+    EV_ABS, EV_KEY,
 };
+use super::governor::{interval_for_rate, RateGovernor};
+use super::sink::{EventSink, FrameBuffer};
+use super::udev;
 
 const MT_SLOTS: usize = 16;
 
+/// While the pen is about, contacts at least this large are palms.
+/// ABS_MT_TOUCH_MAJOR is in surface units, like the position; fingertips
+/// stay well below this.
+const PALM_TOUCH_MAJOR_MM: i32 = 15;
+
+/// While the pen is about, resting contacts this close to it are the hand
+/// holding it.
+const PALM_RADIUS_MM: i32 = 70;
+
+/// A contact that has moved this far from where it landed is a finger in
+/// a gesture, and stays one however close the pen comes.
+const GESTURE_TRAVEL_MM: i32 = 10;
+
+/// A new contact near the pen is held back for this many frames before it
+/// is judged, so a pan or zoom starting there has time to get moving.
+const PALM_DECISION_FRAMES: u8 = 6;
+
+/// Moving this far within its first `PALM_DECISION_FRAMES` frames makes a
+/// contact a finger; a resting hand stays put.
+const GESTURE_START_MM: i32 = 2;
+
 struct SlotState {
     x: [Option<i32>; MT_SLOTS],
     y: [Option<i32>; MT_SLOTS],
@@ -25,6 +48,24 @@ struct SlotState {
     last_y: [Option<i32>; MT_SLOTS],
     active: [bool; MT_SLOTS],
     tracking_id: [Option<i32>; MT_SLOTS],
+
+    // Palm classification, per contact: its size if the device reports it,
+    // where it landed, frames seen since, whether it has moved away, whether
+    // it waits to be judged, and whether it is a palm (held back until it
+    // lifts)
+    touch_major: [Option<i32>; MT_SLOTS],
+    origin: [Option<(i32, i32)>; MT_SLOTS],
+    age: [u8; MT_SLOTS],
+    travelled: [bool; MT_SLOTS],
+    undecided: [bool; MT_SLOTS],
+    palm: [bool; MT_SLOTS],
+
+    // Last state written to the virtual device, so frames only carry changes
+    out_x: [Option<i32>; MT_SLOTS],
+    out_y: [Option<i32>; MT_SLOTS],
+    out_slot: Option<usize>,
+    out_primary: Option<(i32, i32)>,
+    out_keys: [bool; TOOL_KEYS.len()],
 }
 
 impl SlotState {
@@ -36,6 +77,17 @@ impl SlotState {
             last_y: [None; MT_SLOTS],
             active: [false; MT_SLOTS],
             tracking_id: [None; MT_SLOTS],
+            touch_major: [None; MT_SLOTS],
+            origin: [None; MT_SLOTS],
+            age: [0; MT_SLOTS],
+            travelled: [false; MT_SLOTS],
+            undecided: [false; MT_SLOTS],
+            palm: [false; MT_SLOTS],
+            out_x: [None; MT_SLOTS],
+            out_y: [None; MT_SLOTS],
+            out_slot: None,
+            out_primary: None,
+            out_keys: [false; TOOL_KEYS.len()],
         }
     }
 
@@ -44,12 +96,27 @@ impl SlotState {
         self.y[slot] = None;
         self.last_x[slot] = None;
         self.last_y[slot] = None;
+        self.touch_major[slot] = None;
+        self.origin[slot] = None;
+        self.age[slot] = 0;
+        self.travelled[slot] = false;
+        self.undecided[slot] = false;
+        self.palm[slot] = false;
     }
 
     fn active_count(&self) -> i32 {
         self.active.iter().filter(|&&a| a).count() as i32
     }
 
+    /// An active contact that is neither a palm nor waiting to be judged.
+    fn is_finger(&self, slot: usize) -> bool {
+        self.active[slot] && !self.palm[slot] && !self.undecided[slot]
+    }
+
+    fn finger_count(&self) -> i32 {
+        (0..MT_SLOTS).filter(|&s| self.is_finger(s)).count() as i32
+    }
+
     fn get_position(&self, slot: usize) -> Option<(i32, i32)> {
         match (self.x[slot], self.y[slot]) {
             (Some(x), Some(y)) => Some((x, y)),
@@ -60,25 +127,46 @@ impl SlotState {
         }
     }
 
-    fn get_primary_position(&self, device: &DeviceProfile, orientation: Orientation) -> Option<(i32, i32)> {
+    fn get_primary_position(&self, geometry: &TouchGeometry) -> Option<(i32, i32)> {
         (0..MT_SLOTS)
-            .find(|&s| self.active[s])
+            .find(|&s| self.is_finger(s))
             .and_then(|s| self.x[s].zip(self.y[s]))
-            .map(|(ax, ay)| {
-                orientation.transform_touch(
-                    ax.clamp(0, device.touch_x_max),
-                    ay.clamp(0, device.touch_y_max),
-                    device.touch_x_max,
-                    device.touch_y_max,
-                )
-            })
+            .map(|(ax, ay)| geometry.transform(ax, ay))
+    }
+}
+
+/// The device's touch range and its orientation mapping, resolved once per
+/// processor.
+struct TouchGeometry<'a> {
+    device: &'a DeviceProfile,
+    transform: Transform,
+    out_x_max: i32,
+    out_y_max: i32,
+}
+
+impl<'a> TouchGeometry<'a> {
+    fn new(device: &'a DeviceProfile, orientation: Orientation) -> Self {
+        let (out_x_max, out_y_max) = orientation.touch_output_dimensions(device.touch_x_max, device.touch_y_max);
+        Self {
+            device,
+            transform: Transform::touch(orientation, device.touch_x_max, device.touch_y_max),
+            out_x_max,
+            out_y_max,
+        }
+    }
+
+    /// Map a device position, clamped to the touch range, to output space.
+    #[inline]
+    fn transform(&self, x: i32, y: i32) -> (i32, i32) {
+        self.transform.apply(x.clamp(0, self.device.touch_x_max), y.clamp(0, self.device.touch_y_max))
     }
 }
 
 struct FrameState {
     current_slot: usize,
     contact_count: i32,
-    pending_positions: Vec<(i32, i32)>,
+    pending_positions: [(i32, i32); MT_SLOTS],
+    pending_count: usize,
 }
 
 impl FrameState {
@@ -86,9 +174,21 @@ impl FrameState {
         Self {
             current_slot: 0,
             contact_count: 0,
-            pending_positions: Vec::with_capacity(MT_SLOTS),
+            pending_positions: [(0, 0); MT_SLOTS],
+            pending_count: 0,
         }
     }
+
+    fn push_pending(&mut self, position: (i32, i32)) {
+        if self.pending_count < MT_SLOTS {
+            self.pending_positions[self.pending_count] = position;
+            self.pending_count += 1;
+        }
+    }
+
+    fn pending(&self) -> &[(i32, i32)] {
+        &self.pending_positions[..self.pending_count]
+    }
 }
 
 fn create_touchpad_device(device: &DeviceProfile, orientation: Orientation) -> Result<UinputDevice, Box<dyn std::error::Error + Send + Sync>> {
@@ -120,77 +220,221 @@ fn create_touchpad_device(device: &DeviceProfile, orientation: Orientation) -> R
     Ok(device)
 }
 
-pub fn run_touch(
-    config: &Config,
-    device_profile: &DeviceProfile,
+/// Worst case touch frame: every slot changing its tracking ID and both
+/// positions, plus the primary position, five tool keys and SYN_REPORT.
+/// Frames normally carry only what changed and are much shorter.
+const FRAME_CAPACITY: usize = MT_SLOTS * 4 + 2 + TOOL_KEYS.len() + 1;
+
+type TouchFrame = FrameBuffer<FRAME_CAPACITY>;
+
+/// Forwards multitouch frames to a virtual touchpad.
+pub struct TouchProcessor<'a, S: EventSink = UinputDevice> {
+    uinput: S,
+    /// Device with the other aspect ratio; see `PenProcessor::set_orientation`.
+    spare: Option<S>,
+    orientation: Orientation,
+    geometry: TouchGeometry<'a>,
     palm: Option<SharedPalmState>,
-) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
-    let (_cleanup, mut channel) =
-        ssh::open_input_stream(&config.touch_device, config, config.grab_input)?;
+    grace_ms: u64,
+    slots: SlotState,
+    frame: FrameState,
+    out: TouchFrame,
+    next_tracking_id: i32,
+    frame_count: u64,
+    suppressed_count: u64,
+    governor: RateGovernor,
+}
 
-    log::info!("Creating touch uinput device");
-    let uinput = create_touchpad_device(device_profile, config.orientation)?;
+impl<'a> TouchProcessor<'a> {
+    pub fn new(
+        config: &Config,
+        device: &'a DeviceProfile,
+        palm: Option<SharedPalmState>,
+    ) -> Result<Self, Box<dyn std::error::Error + Send + Sync>> {
+        log::info!("Creating touch uinput device");
+        let uinput = create_touchpad_device(device, config.orientation)?;
+
+        if let Ok(name) = uinput.sysname() {
+            log::info!("Touch device ready: /sys/devices/virtual/input/{}", name.to_string_lossy());
+        }
 
-    if let Ok(name) = uinput.sysname() {
-        log::info!("Touch device ready: /sys/devices/virtual/input/{}", name.to_string_lossy());
+        let processor = Self::with_sink(uinput, device, config.orientation, palm, config.palm_grace_ms);
+        Ok(processor.with_rate_limit(interval_for_rate(config.output_rate_hz)))
     }
 
-    std::thread::sleep(Duration::from_secs(1));
-    log::info!("Touch forwarding started");
+    /// Kernel name of the uinput device, e.g. `input17`.
+    pub fn sysname(&self) -> Option<String> {
+        self.uinput.sysname().ok().map(|name| name.to_string_lossy().into_owned())
+    }
 
-    run_event_loop(&mut channel, &uinput, device_profile, config.orientation, palm, config.palm_grace_ms)
+    /// Switch to `orientation` while running, lifting any contacts first;
+    /// see `PenProcessor::set_orientation`.
+    pub fn set_orientation(&mut self, orientation: Orientation) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
+        self.switch_orientation(orientation, |device, orientation| {
+            let uinput = create_touchpad_device(device, orientation)?;
+            if let Ok(name) = uinput.sysname() {
+                log::info!("Touch device for {}: /sys/devices/virtual/input/{}", orientation, name.to_string_lossy());
+                udev::wait_for_devices(&[name.to_string_lossy().into_owned()]);
+            }
+            Ok(uinput)
+        })
+    }
 }
 
-fn run_event_loop(
-    channel: &mut impl Read,
-    uinput: &UinputDevice,
-    device: &DeviceProfile,
-    orientation: Orientation,
-    palm: Option<SharedPalmState>,
-    grace_ms: u64,
-) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
-    let mut buf = vec![0u8; device.input_event_size];
-    let mut slots = SlotState::new();
-    let mut frame = FrameState::new();
-    let mut next_tracking_id: i32 = 0;
-    let mut frame_count: u64 = 0;
+impl<'a, S: EventSink> TouchProcessor<'a, S> {
+    pub fn with_sink(
+        sink: S,
+        device: &'a DeviceProfile,
+        orientation: Orientation,
+        palm: Option<SharedPalmState>,
+        grace_ms: u64,
+    ) -> Self {
+        Self {
+            uinput: sink,
+            spare: None,
+            orientation,
+            geometry: TouchGeometry::new(device, orientation),
+            palm,
+            grace_ms,
+            slots: SlotState::new(),
+            frame: FrameState::new(),
+            out: TouchFrame::new(),
+            next_tracking_id: 0,
+            frame_count: 0,
+            suppressed_count: 0,
+            governor: RateGovernor::new(Duration::ZERO),
+        }
+    }
 
-    loop {
-        channel.read_exact(&mut buf)?;
+    /// `set_orientation` with `create` making the device with the other
+    /// aspect ratio the first time it is needed.
+    fn switch_orientation(
+        &mut self,
+        orientation: Orientation,
+        create: impl FnOnce(&'a DeviceProfile, Orientation) -> Result<S, Box<dyn std::error::Error + Send + Sync>>,
+    ) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
+        if orientation == self.orientation {
+            return Ok(());
+        }
+        self.release_all()?;
+
+        let device = self.geometry.device;
+        let (x_max, y_max) = (device.touch_x_max, device.touch_y_max);
+        if orientation.touch_output_dimensions(x_max, y_max) != self.orientation.touch_output_dimensions(x_max, y_max) {
+            let next = match self.spare.take() {
+                Some(uinput) => uinput,
+                None => create(device, orientation)?,
+            };
+            self.spare = Some(std::mem::replace(&mut self.uinput, next));
+            // The slot selected on this device is not the one written last
+            self.slots.out_slot = None;
+        }
+        self.orientation = orientation;
+        self.geometry = TouchGeometry::new(device, orientation);
+        Ok(())
+    }
 
-        let Some(ev) = parse_input_event(&buf) else {
-            continue;
-        };
+    /// Write at most one frame per `interval` while contacts only move;
+    /// see `governor.rs`.
+    pub fn with_rate_limit(mut self, interval: Duration) -> Self {
+        self.governor = RateGovernor::new(interval);
+        self
+    }
+
+    pub fn set_grace_ms(&mut self, grace_ms: u64) {
+        self.grace_ms = grace_ms;
+    }
+
+    /// Frames written so far.
+    pub fn frames_written(&self) -> u64 {
+        self.frame_count
+    }
+
+    /// Frames so far that had a contact held back as a palm.
+    pub fn palm_suppressed(&self) -> u64 {
+        self.suppressed_count
+    }
+
+    /// When the frame held back by the rate limit is due, if there is one.
+    pub fn held_deadline(&self) -> Option<Instant> {
+        self.governor.deadline()
+    }
+
+    /// Write the frame held back by the rate limit once it is due.
+    pub fn flush_held(&mut self) -> io::Result<()> {
+        if self.governor.is_due() {
+            build_touch_frame(&mut self.out, &mut self.slots, &mut self.next_tracking_id, &self.geometry);
+            self.write_frame()?;
+        }
+        Ok(())
+    }
 
-        let ty = ev.event_type().raw();
-        let code = ev.raw_code();
-        let value = ev.raw_value();
+    /// Lift every contact and forget the stream's state, e.g. when the
+    /// connection drops mid-gesture.
+    pub fn release_all(&mut self) -> io::Result<()> {
+        build_release(&mut self.out, &mut self.slots);
+        self.write_frame()?;
+
+        // Everything is released now, so only the selected slot is still known
+        let out_slot = self.slots.out_slot;
+        self.slots = SlotState::new();
+        self.slots.out_slot = out_slot;
+        self.frame = FrameState::new();
+        Ok(())
+    }
+
+    /// Process a run of events, emitting a uinput frame at each SYN_REPORT.
+    pub fn handle_frame(&mut self, events: &[RawEvent]) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
+        for &ev in events {
+            self.handle_event(ev)?;
+        }
+        Ok(())
+    }
+
+    fn handle_event(&mut self, ev: RawEvent) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
+        let RawEvent { ty, code, value } = ev;
 
         if ty == EV_KEY {
-            continue;
+            return Ok(());
         }
 
         if ty == EV_ABS {
-            process_abs_event(&mut slots, &mut frame, code, value);
+            process_abs_event(&mut self.slots, &mut self.frame, code, value);
         }
 
-        if ty != EV_SYN || code != SYN_REPORT {
-            continue;
+        if !ev.is_syn_report() {
+            return Ok(());
         }
 
-        resolve_pending_positions(&mut slots, &frame);
-        frame.pending_positions.clear();
+        resolve_pending_positions(&mut self.slots, &self.frame);
+        self.frame.pending_count = 0;
 
-        let contact_count = slots.active_count();
+        if let Some(palm) = &self.palm {
+            let pen = palm.pen_position(self.grace_ms);
+            classify_palms(&mut self.slots, pen, &self.geometry);
+            if (0..MT_SLOTS).any(|slot| self.slots.active[slot] && self.slots.palm[slot]) {
+                self.suppressed_count += 1;
+            }
+        }
 
-        if should_suppress_palm(&palm, grace_ms) {
-            emit_palm_suppression(uinput, &mut slots)?;
-            log_frame_progress(&mut frame_count, 0, true);
-            continue;
+        if !contacts_changed(&self.slots) && self.governor.should_hold() {
+            return Ok(());
         }
 
-        emit_touch_frame(uinput, &mut slots, &mut next_tracking_id, device, orientation)?;
-        log_frame_progress(&mut frame_count, contact_count, false);
+        build_touch_frame(&mut self.out, &mut self.slots, &mut self.next_tracking_id, &self.geometry);
+        self.write_frame()?;
+        Ok(())
+    }
+
+    /// Write the frame built in `out`, if it holds anything.
+    fn write_frame(&mut self) -> io::Result<()> {
+        self.governor.emitted();
+        if self.out.is_empty() {
+            return Ok(());
+        }
+        self.uinput.write(self.out.events())?;
+        log_frame_progress(&mut self.frame_count, self.slots.finger_count());
+        Ok(())
     }
 }
 
@@ -214,6 +458,9 @@ fn process_abs_event(slots: &mut SlotState, frame: &mut FrameState, code: u16, v
                 slots.clear_slot(slot);
             }
         }
+        ABS_MT_TOUCH_MAJOR => {
+            slots.touch_major[frame.current_slot] = Some(value);
+        }
         ABS_MT_POSITION_X => {
             let slot = frame.current_slot;
             slots.x[slot] = Some(value);
@@ -225,7 +472,7 @@ fn process_abs_event(slots: &mut SlotState, frame: &mut FrameState, code: u16, v
             activate_slot_if_needed(slots, frame, slot);
 
             if let Some(x) = slots.x[slot] {
-                frame.pending_positions.push((x, value));
+                frame.push_pending((x, value));
             }
         }
         _ => {}
@@ -241,199 +488,431 @@ fn activate_slot_if_needed(slots: &mut SlotState, frame: &mut FrameState, slot:
 }
 
 fn resolve_pending_positions(slots: &mut SlotState, frame: &FrameState) {
-    let active_slots: Vec<usize> = (0..MT_SLOTS).filter(|&s| slots.active[s]).collect();
     let contact_count = slots.active_count() as usize;
+    let pending = frame.pending();
 
     if contact_count == 0 {
         return;
     }
-    if active_slots.len() != contact_count {
-        return;
-    }
-    if frame.pending_positions.len() != contact_count {
+    if pending.len() != contact_count {
         return;
     }
 
-    for (i, &slot) in active_slots.iter().enumerate() {
-        if let Some(&(x, y)) = frame.pending_positions.get(i) {
-            slots.x[slot] = Some(x);
-            slots.y[slot] = Some(y);
-        }
+    let active_slots = (0..MT_SLOTS).filter(|&s| slots.active[s]);
+    for (slot, &(x, y)) in active_slots.zip(pending) {
+        slots.x[slot] = Some(x);
+        slots.y[slot] = Some(y);
     }
 }
 
-fn should_suppress_palm(palm: &Option<SharedPalmState>, grace_ms: u64) -> bool {
-    let Some(palm_state) = palm else { return false };
-    let Ok(state) = palm_state.lock() else { return false };
+/// Mark the contacts that belong to the hand holding the pen as palms, given
+/// where the pen is while it is about. A new contact near the pen is held
+/// back for its first `PALM_DECISION_FRAMES` frames: if it starts moving it
+/// is a finger in a gesture, if it rests it is a palm. A palm stays one
+/// until it lifts, and is released like a lifted finger if it was already
+/// forwarded.
+fn classify_palms(slots: &mut SlotState, pen: Option<ScreenPoint>, geometry: &TouchGeometry) {
+    let mm = geometry.device.touch_resolution.max(1) as i64;
+    let pen = pen.map(|point| point.to_output(geometry.out_x_max, geometry.out_y_max));
+    let within = |dx: i32, dy: i32, limit_mm: i32| {
+        let limit = limit_mm as i64 * mm;
+        (dx as i64).pow(2) + (dy as i64).pow(2) <= limit * limit
+    };
 
-    if state.pen_down {
-        return true;
+    for slot in 0..MT_SLOTS {
+        if !slots.active[slot] || slots.palm[slot] {
+            continue;
+        }
+        let Some((x, y)) = slots.get_position(slot) else {
+            continue;
+        };
+        // Only a contact not forwarded yet can still be held back
+        let deciding = slots.age[slot] < PALM_DECISION_FRAMES && slots.tracking_id[slot].is_none();
+        slots.age[slot] = slots.age[slot].saturating_add(1);
+        let (origin_x, origin_y) = *slots.origin[slot].get_or_insert((x, y));
+        let travel_mm = if deciding { GESTURE_START_MM } else { GESTURE_TRAVEL_MM };
+        slots.travelled[slot] |= !within(x - origin_x, y - origin_y, travel_mm);
+        slots.undecided[slot] = false;
+
+        let Some((pen_x, pen_y)) = pen else {
+            continue;
+        };
+        let large = slots.touch_major[slot].is_some_and(|major| major as i64 >= PALM_TOUCH_MAJOR_MM as i64 * mm);
+        let (out_x, out_y) = geometry.transform(x, y);
+        let near = !slots.travelled[slot] && within(out_x - pen_x, out_y - pen_y, PALM_RADIUS_MM);
+        if large || (near && !deciding) {
+            slots.palm[slot] = true;
+        } else if near {
+            slots.undecided[slot] = true;
+        }
     }
-
-    state
-        .last_pen_up
-        .map(|t| t.elapsed().as_millis() < grace_ms as u128)
-        .unwrap_or(false)
 }
 
-fn emit_palm_suppression(
-    uinput: &UinputDevice,
-    slots: &mut SlotState,
-) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
-    let mut writer = uinput.writer();
+fn build_release(out: &mut TouchFrame, slots: &mut SlotState) {
+    out.clear();
 
     for slot in 0..MT_SLOTS {
-        if slots.tracking_id[slot].is_none() {
-            continue;
+        if slots.tracking_id[slot].is_some() {
+            release_slot(out, slots, slot);
         }
-
-        let slot_writer = writer.slot(Slot::from(slot as u16))?;
-        writer = slot_writer
-            .write(&[evdevil::event::AbsEvent::new(Abs::MT_TRACKING_ID, -1).into()])?
-            .finish_slot()?;
-        slots.tracking_id[slot] = None;
     }
 
-    let key_events = release_all_tool_keys();
-    writer = writer.write(&key_events)?;
-    writer.finish()?;
+    push_tool_keys(out, slots, 0);
+    finish_frame(out);
+}
 
-    Ok(())
+/// Whether a finger started or ended since the last frame written.
+fn contacts_changed(slots: &SlotState) -> bool {
+    (0..MT_SLOTS).any(|slot| slots.is_finger(slot) != slots.tracking_id[slot].is_some())
 }
 
-fn emit_touch_frame(
-    uinput: &UinputDevice,
+/// Build a frame holding only what changed since the last one written; the
+/// buffer is left empty if nothing did.
+fn build_touch_frame(
+    out: &mut TouchFrame,
     slots: &mut SlotState,
     next_tracking_id: &mut i32,
-    device: &DeviceProfile,
-    orientation: Orientation,
-) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
-    let mut writer = uinput.writer();
-    let contact_count = slots.active_count();
-    let (out_x_max, out_y_max) = orientation.touch_output_dimensions(device.touch_x_max, device.touch_y_max);
+    geometry: &TouchGeometry,
+) {
+    out.clear();
+    let contact_count = slots.finger_count();
 
     for slot in 0..MT_SLOTS {
-        if slots.active[slot] {
-            let is_new = slots.tracking_id[slot].is_none();
-            if is_new {
-                *next_tracking_id = next_tracking_id.wrapping_add(1);
-                slots.tracking_id[slot] = Some(*next_tracking_id);
-            }
-
+        if slots.is_finger(slot) {
             let Some((ax, ay)) = slots.get_position(slot) else {
                 continue;
             };
 
-            let (out_x, out_y) = orientation.transform_touch(
-                ax.clamp(0, device.touch_x_max),
-                ay.clamp(0, device.touch_y_max),
-                device.touch_x_max,
-                device.touch_y_max,
-            );
-            let out_x = out_x.clamp(0, out_x_max);
-            let out_y = out_y.clamp(0, out_y_max);
+            let (out_x, out_y) = geometry.transform(ax, ay);
+            let out_x = out_x.clamp(0, geometry.out_x_max);
+            let out_y = out_y.clamp(0, geometry.out_y_max);
             slots.last_x[slot] = Some(ax);
             slots.last_y[slot] = Some(ay);
 
-            let slot_writer = writer.slot(Slot::from(slot as u16))?;
-            if is_new {
-                let id = slots.tracking_id[slot].unwrap();
-                writer = slot_writer
-                    .write(&[
-                        evdevil::event::AbsEvent::new(Abs::MT_TRACKING_ID, id).into(),
-                        evdevil::event::AbsEvent::new(Abs::MT_POSITION_X, out_x).into(),
-                        evdevil::event::AbsEvent::new(Abs::MT_POSITION_Y, out_y).into(),
-                    ])?
-                    .finish_slot()?;
-            } else {
-                writer = slot_writer
-                    .write(&[
-                        evdevil::event::AbsEvent::new(Abs::MT_POSITION_X, out_x).into(),
-                        evdevil::event::AbsEvent::new(Abs::MT_POSITION_Y, out_y).into(),
-                    ])?
-                    .finish_slot()?;
+            if slots.tracking_id[slot].is_none() {
+                *next_tracking_id = next_tracking_id.wrapping_add(1);
+                slots.tracking_id[slot] = Some(*next_tracking_id);
+                select_slot(out, slots, slot);
+                out.push(EV_ABS, ABS_MT_TRACKING_ID, *next_tracking_id);
+            }
+            if slots.out_x[slot] != Some(out_x) {
+                select_slot(out, slots, slot);
+                out.push(EV_ABS, ABS_MT_POSITION_X, out_x);
+                slots.out_x[slot] = Some(out_x);
+            }
+            if slots.out_y[slot] != Some(out_y) {
+                select_slot(out, slots, slot);
+                out.push(EV_ABS, ABS_MT_POSITION_Y, out_y);
+                slots.out_y[slot] = Some(out_y);
             }
         } else if slots.tracking_id[slot].is_some() {
-            let slot_writer = writer.slot(Slot::from(slot as u16))?;
-            writer = slot_writer
-                .write(&[evdevil::event::AbsEvent::new(Abs::MT_TRACKING_ID, -1).into()])?
-                .finish_slot()?;
-            slots.tracking_id[slot] = None;
+            release_slot(out, slots, slot);
         }
     }
 
-    if let Some((out_x, out_y)) = slots.get_primary_position(device, orientation) {
-        writer = writer.write(&[
-            evdevil::event::AbsEvent::new(Abs::X, out_x).into(),
-            evdevil::event::AbsEvent::new(Abs::Y, out_y).into(),
-        ])?;
+    if let Some((out_x, out_y)) = slots.get_primary_position(geometry) {
+        let (last_x, last_y) = slots.out_primary.unzip();
+        if last_x != Some(out_x) {
+            out.push(EV_ABS, Abs::X.raw(), out_x);
+        }
+        if last_y != Some(out_y) {
+            out.push(EV_ABS, Abs::Y.raw(), out_y);
+        }
+        slots.out_primary = Some((out_x, out_y));
     }
 
-    let key_events = build_tool_key_events(contact_count);
-    writer = writer.write(&key_events)?;
-    writer.finish()?;
-
-    Ok(())
+    push_tool_keys(out, slots, contact_count);
+    finish_frame(out);
 }
 
-fn build_tool_key_events(contact_count: i32) -> Vec<evdevil::event::InputEvent> {
-    let finger_down = contact_count > 0;
+/// Emit ABS_MT_SLOT unless the device already has `slot` selected.
+fn select_slot(out: &mut TouchFrame, slots: &mut SlotState, slot: usize) {
+    if slots.out_slot != Some(slot) {
+        out.push(EV_ABS, ABS_MT_SLOT, slot as i32);
+        slots.out_slot = Some(slot);
+    }
+}
 
-    let tool_key = match contact_count {
-        0 => None,
-        1 => Some(Key::BTN_TOOL_FINGER),
-        2 => Some(Key::BTN_TOOL_DOUBLETAP),
-        3 => Some(Key::BTN_TOOL_TRIPLETAP),
-        _ => Some(Key::BTN_TOOL_QUADTAP),
-    };
+fn release_slot(out: &mut TouchFrame, slots: &mut SlotState, slot: usize) {
+    select_slot(out, slots, slot);
+    out.push(EV_ABS, ABS_MT_TRACKING_ID, -1);
+    slots.tracking_id[slot] = None;
+    slots.out_x[slot] = None;
+    slots.out_y[slot] = None;
+}
 
-    let mut events = vec![KeyEvent::new(
-        Key::BTN_TOUCH,
-        if finger_down { KeyState::PRESSED } else { KeyState::RELEASED },
-    )
-    .into()];
-
-    for key in [
-        Key::BTN_TOOL_FINGER,
-        Key::BTN_TOOL_DOUBLETAP,
-        Key::BTN_TOOL_TRIPLETAP,
-        Key::BTN_TOOL_QUADTAP,
-    ] {
-        let state = if Some(key) == tool_key {
-            KeyState::PRESSED
-        } else {
-            KeyState::RELEASED
-        };
-        events.push(KeyEvent::new(key, state).into());
+fn finish_frame(out: &mut TouchFrame) {
+    if !out.is_empty() {
+        out.finish();
     }
-
-    events
 }
 
-fn release_all_tool_keys() -> Vec<evdevil::event::InputEvent> {
-    [
-        Key::BTN_TOUCH,
-        Key::BTN_TOOL_FINGER,
-        Key::BTN_TOOL_DOUBLETAP,
-        Key::BTN_TOOL_TRIPLETAP,
-        Key::BTN_TOOL_QUADTAP,
-    ]
-    .into_iter()
-    .map(|key| KeyEvent::new(key, KeyState::RELEASED).into())
-    .collect()
+/// BTN_TOUCH followed by the tool keys indexed by contact count.
+const TOOL_KEYS: [Key; 5] = [
+    Key::BTN_TOUCH,
+    Key::BTN_TOOL_FINGER,
+    Key::BTN_TOOL_DOUBLETAP,
+    Key::BTN_TOOL_TRIPLETAP,
+    Key::BTN_TOOL_QUADTAP,
+];
+
+/// Push whichever of BTN_TOUCH and the tool keys change state for
+/// `contact_count` contacts. Zero contacts releases everything.
+fn push_tool_keys(out: &mut TouchFrame, slots: &mut SlotState, contact_count: i32) {
+    let tool = contact_count.clamp(0, 4) as usize;
+
+    for (i, key) in TOOL_KEYS.iter().enumerate() {
+        let pressed = if i == 0 { contact_count > 0 } else { i == tool };
+        if slots.out_keys[i] != pressed {
+            out.push(EV_KEY, key.raw(), pressed as i32);
+            slots.out_keys[i] = pressed;
+        }
+    }
 }
 
-fn log_frame_progress(frame_count: &mut u64, contact_count: i32, suppressed: bool) {
+fn log_frame_progress(frame_count: &mut u64, contact_count: i32) {
     if *frame_count == 0 {
         log::info!("Touch events flowing");
     }
     *frame_count += 1;
 
     if (*frame_count).is_multiple_of(500) {
-        if suppressed {
-            log::debug!("Touch frames: {} (palm suppressed)", frame_count);
-        } else {
-            log::debug!("Touch frames: {}, contacts: {}", frame_count, contact_count);
+        log::debug!("Touch frames: {}, contacts: {}", frame_count, contact_count);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::alloc_count::allocations;
+    use crate::device::RM2;
+    use crate::palm::PalmState;
+    use evdevil::event::InputEvent;
+    use std::cell::RefCell;
+    use std::sync::Arc;
+
+    use super::super::event::{EV_SYN, SYN_REPORT};
+
+    /// Records the size of every write without keeping the events.
+    struct CountingSink {
+        writes: RefCell<Vec<usize>>,
+    }
+
+    impl EventSink for CountingSink {
+        fn write(&self, events: &[InputEvent]) -> io::Result<()> {
+            let mut writes = self.writes.borrow_mut();
+            if writes.len() < writes.capacity() {
+                writes.push(events.len());
+            }
+            Ok(())
+        }
+    }
+
+    fn processor(palm: Option<SharedPalmState>) -> TouchProcessor<'static, CountingSink> {
+        let sink = CountingSink { writes: RefCell::new(Vec::with_capacity(1024)) };
+        TouchProcessor::with_sink(sink, &RM2, Orientation::LandscapeRight, palm, 500)
+    }
+
+    fn two_finger_frame(x: i32) -> Vec<RawEvent> {
+        vec![
+            RawEvent::new(EV_ABS, ABS_MT_SLOT, 0),
+            RawEvent::new(EV_ABS, ABS_MT_TRACKING_ID, 1),
+            RawEvent::new(EV_ABS, ABS_MT_POSITION_X, x),
+            RawEvent::new(EV_ABS, ABS_MT_POSITION_Y, 400),
+            RawEvent::new(EV_ABS, ABS_MT_SLOT, 1),
+            RawEvent::new(EV_ABS, ABS_MT_TRACKING_ID, 2),
+            RawEvent::new(EV_ABS, ABS_MT_POSITION_X, x + 200),
+            RawEvent::new(EV_ABS, ABS_MT_POSITION_Y, 600),
+            RawEvent::new(EV_SYN, SYN_REPORT, 0),
+        ]
+    }
+
+    #[test]
+    fn test_one_write_per_frame() {
+        let mut touch = processor(None);
+        touch.handle_frame(&two_finger_frame(100)).unwrap();
+
+        // Two slots × (slot, id, x, y), ABS_X/Y, BTN_TOUCH and
+        // BTN_TOOL_DOUBLETAP pressed, SYN_REPORT.
+        assert_eq!(*touch.uinput.writes.borrow(), vec![2 * 4 + 2 + 2 + 1]);
+    }
+
+    #[test]
+    fn test_only_changes_are_emitted() {
+        let mut touch = processor(None);
+        touch.handle_frame(&two_finger_frame(100)).unwrap();
+        touch.handle_frame(&two_finger_frame(100)).unwrap();
+        assert_eq!(touch.uinput.writes.borrow().len(), 1, "unchanged frame should not be written");
+
+        // Moving along device X changes output Y in landscape-right: each
+        // slot emits slot + MT_POSITION_Y, the primary emits ABS_Y.
+        touch.handle_frame(&two_finger_frame(110)).unwrap();
+        assert_eq!(touch.uinput.writes.borrow()[1], 2 * 2 + 1 + 1);
+
+        // Lifting both fingers releases each slot and the two pressed keys.
+        touch.handle_frame(&[
+            RawEvent::new(EV_ABS, ABS_MT_SLOT, 0),
+            RawEvent::new(EV_ABS, ABS_MT_TRACKING_ID, -1),
+            RawEvent::new(EV_ABS, ABS_MT_SLOT, 1),
+            RawEvent::new(EV_ABS, ABS_MT_TRACKING_ID, -1),
+            RawEvent::new(EV_SYN, SYN_REPORT, 0),
+        ]).unwrap();
+        assert_eq!(touch.uinput.writes.borrow()[2], 2 * 2 + 2 + 1);
+    }
+
+    #[test]
+    fn test_frames_written_counts_every_write() {
+        let mut touch = processor(None).with_rate_limit(Duration::from_millis(10));
+        touch.handle_frame(&two_finger_frame(100)).unwrap();
+        touch.handle_frame(&two_finger_frame(110)).unwrap();
+        assert_eq!(touch.frames_written(), 1, "motion is held");
+
+        std::thread::sleep(Duration::from_millis(15));
+        touch.flush_held().unwrap();
+        assert_eq!(touch.frames_written(), 2, "the flushed frame counts");
+
+        // Nothing changed, so nothing is written or counted
+        std::thread::sleep(Duration::from_millis(15));
+        touch.handle_frame(&two_finger_frame(110)).unwrap();
+        assert_eq!(touch.frames_written(), 2);
+        assert_eq!(touch.uinput.writes.borrow().len(), 2);
+    }
+
+    #[test]
+    fn test_release_all_lifts_contacts() {
+        let mut touch = processor(None);
+        touch.handle_frame(&two_finger_frame(100)).unwrap();
+        touch.release_all().unwrap();
+        // Two slots × (slot, tracking id -1), two keys released, SYN_REPORT
+        assert_eq!(touch.uinput.writes.borrow()[1], 2 * 2 + 2 + 1);
+
+        // The same contacts after a reconnect are new contacts again
+        touch.handle_frame(&two_finger_frame(100)).unwrap();
+        assert_eq!(touch.uinput.writes.borrow()[2], 2 * 4 + 2 + 2 + 1);
+    }
+
+    #[test]
+    fn test_rotation_selects_the_slot_on_the_new_device() {
+        #[derive(Default)]
+        struct RecordingSink {
+            frames: RefCell<Vec<Vec<(u16, u16, i32)>>>,
+        }
+        impl EventSink for RecordingSink {
+            fn write(&self, events: &[InputEvent]) -> io::Result<()> {
+                let frame = events.iter().map(|e| (e.event_type().raw(), e.raw_code(), e.raw_value())).collect();
+                self.frames.borrow_mut().push(frame);
+                Ok(())
+            }
+        }
+
+        let sink = RecordingSink::default();
+        let mut touch = TouchProcessor::with_sink(sink, &RM2, Orientation::LandscapeRight, None, 500);
+        let contact = [
+            RawEvent::new(EV_ABS, ABS_MT_SLOT, 1),
+            RawEvent::new(EV_ABS, ABS_MT_TRACKING_ID, 7),
+            RawEvent::new(EV_ABS, ABS_MT_POSITION_X, 300),
+            RawEvent::new(EV_ABS, ABS_MT_POSITION_Y, 500),
+            RawEvent::new(EV_SYN, SYN_REPORT, 0),
+        ];
+        touch.handle_frame(&contact).unwrap();
+
+        // Portrait has the other aspect ratio, so the spare device takes over
+        touch.switch_orientation(Orientation::Portrait, |_, _| Ok(RecordingSink::default())).unwrap();
+        touch.handle_frame(&contact).unwrap();
+        let frames = touch.uinput.frames.borrow();
+        assert_eq!(frames[0][0], (EV_ABS, ABS_MT_SLOT, 1));
+    }
+
+    #[test]
+    fn test_only_contacts_near_the_pen_are_palms() {
+        let palm = Arc::new(PalmState::new());
+        let mut touch = processor(Some(palm.clone()));
+        let geometry = &touch.geometry;
+        let (pen_x, pen_y) = geometry.transform(100, 400);
+        palm.update_pen(true, ScreenPoint::from_output(pen_x, pen_y, geometry.out_x_max, geometry.out_y_max));
+
+        // A contact under the hand and one across the screen: only the
+        // far one goes out, as slot, id, x, y, ABS_X/Y, two keys, SYN_REPORT
+        let frame = |far_x: i32, major: i32| {
+            vec![
+                RawEvent::new(EV_ABS, ABS_MT_SLOT, 0),
+                RawEvent::new(EV_ABS, ABS_MT_TRACKING_ID, 1),
+                RawEvent::new(EV_ABS, ABS_MT_POSITION_X, 120),
+                RawEvent::new(EV_ABS, ABS_MT_POSITION_Y, 420),
+                RawEvent::new(EV_ABS, ABS_MT_SLOT, 1),
+                RawEvent::new(EV_ABS, ABS_MT_TRACKING_ID, 2),
+                RawEvent::new(EV_ABS, ABS_MT_TOUCH_MAJOR, major),
+                RawEvent::new(EV_ABS, ABS_MT_POSITION_X, far_x),
+                RawEvent::new(EV_ABS, ABS_MT_POSITION_Y, 1800),
+                RawEvent::new(EV_SYN, SYN_REPORT, 0),
+            ]
+        };
+        touch.handle_frame(&frame(1300, 40)).unwrap();
+        assert_eq!(*touch.uinput.writes.borrow(), vec![4 + 2 + 2 + 1]);
+        // The near one rests while it is judged, and then is a palm
+        for _ in 0..PALM_DECISION_FRAMES {
+            touch.handle_frame(&frame(1300, 40)).unwrap();
+        }
+        assert!(touch.slots.palm[0]);
+        assert_eq!(touch.palm_suppressed(), 1);
+
+        // The far finger pans, then grows to palm size: it is released
+        // on its own, without touching anything else
+        touch.handle_frame(&frame(1000, 40)).unwrap();
+        touch.handle_frame(&frame(1000, 15 * RM2.touch_resolution)).unwrap();
+        let writes = touch.uinput.writes.borrow();
+        assert_eq!(writes.len(), 3);
+        // Tracking id -1 (slot already selected) and both keys
+        assert_eq!(writes[2], 1 + 2 + 1);
+        assert_eq!(touch.palm_suppressed(), 3);
+    }
+
+    #[test]
+    fn test_gesture_landing_near_the_pen_is_forwarded() {
+        let palm = Arc::new(PalmState::new());
+        let mut touch = processor(Some(palm.clone()));
+        let geometry = &touch.geometry;
+        let (pen_x, pen_y) = geometry.transform(200, 500);
+        palm.update_pen(true, ScreenPoint::from_output(pen_x, pen_y, geometry.out_x_max, geometry.out_y_max));
+
+        // Two fingers land either side of the hovering pen and spread
+        // apart: held back while they are judged, then forwarded together
+        let mm = RM2.touch_resolution;
+        let frame = |spread: i32| {
+            vec![
+                RawEvent::new(EV_ABS, ABS_MT_SLOT, 0),
+                RawEvent::new(EV_ABS, ABS_MT_TRACKING_ID, 1),
+                RawEvent::new(EV_ABS, ABS_MT_POSITION_X, 100 - spread),
+                RawEvent::new(EV_ABS, ABS_MT_POSITION_Y, 400 - spread),
+                RawEvent::new(EV_ABS, ABS_MT_SLOT, 1),
+                RawEvent::new(EV_ABS, ABS_MT_TRACKING_ID, 2),
+                RawEvent::new(EV_ABS, ABS_MT_POSITION_X, 300 + spread),
+                RawEvent::new(EV_ABS, ABS_MT_POSITION_Y, 600 + spread),
+                RawEvent::new(EV_SYN, SYN_REPORT, 0),
+            ]
+        };
+        touch.handle_frame(&frame(0)).unwrap();
+        assert!(touch.uinput.writes.borrow().is_empty());
+        for step in 1..PALM_DECISION_FRAMES as i32 {
+            touch.handle_frame(&frame(step * mm)).unwrap();
+        }
+        assert_eq!(touch.slots.finger_count(), 2);
+        assert!(!touch.uinput.writes.borrow().is_empty());
+        assert_eq!(touch.palm_suppressed(), 0);
+    }
+
+    #[test]
+    fn test_steady_state_frames_do_not_allocate() {
+        let palm = Arc::new(PalmState::new());
+        let mut touch = processor(Some(palm.clone()));
+        let frames: Vec<Vec<RawEvent>> = (0..200).map(|i| two_finger_frame(100 + i)).collect();
+        touch.handle_frame(&frames[0]).unwrap();
+
+        let before = allocations();
+        for (i, frame) in frames.iter().enumerate().skip(1) {
+            palm.update_pen(i % 50 < 10, ScreenPoint { x: 0, y: 0 });
+            touch.handle_frame(frame).unwrap();
         }
+        assert_eq!(allocations() - before, 0);
     }
 }
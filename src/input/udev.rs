@@ -0,0 +1,61 @@
+//! Wait for udev to finish setting up freshly created uinput devices.
+//!
+//! The desktop learns about new input devices from udev, not from the
+//! kernel, so events written before udev is done with a device can go
+//! unseen. udev records a device in its database once its rules have run,
+//! just before announcing it, which makes that entry a readiness signal.
+
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::time::{Duration, Instant};
+
+/// Give up waiting after this long and carry on anyway.
+const READY_TIMEOUT: Duration = Duration::from_secs(1);
+
+const POLL_INTERVAL: Duration = Duration::from_millis(5);
+
+const UDEV_DATA: &str = "/run/udev/data";
+
+/// Block until udev has processed all event nodes of the given input
+/// devices (kernel names like `input17`). Returns straight away on systems
+/// without udev.
+pub fn wait_for_devices(sysnames: &[String]) {
+    if !Path::new(UDEV_DATA).is_dir() {
+        log::debug!("No udev database, not waiting for devices");
+        return;
+    }
+
+    let started = Instant::now();
+    loop {
+        let pending = sysnames.iter().filter(|name| !is_ready(name)).count();
+        if pending == 0 {
+            log::debug!("Devices ready after {} ms", started.elapsed().as_millis());
+            return;
+        }
+        if started.elapsed() >= READY_TIMEOUT {
+            log::warn!("udev has not finished with {} device(s), continuing anyway", pending);
+            return;
+        }
+        std::thread::sleep(POLL_INTERVAL);
+    }
+}
+
+/// Whether the device has an event node and udev knows about every one.
+fn is_ready(sysname: &str) -> bool {
+    let nodes = event_node_entries(Path::new("/sys/devices/virtual/input").join(sysname));
+    !nodes.is_empty() && nodes.iter().all(|entry| entry.exists())
+}
+
+/// udev database entries (`c<major>:<minor>`) for the device's event nodes.
+fn event_node_entries(device: PathBuf) -> Vec<PathBuf> {
+    let Ok(entries) = fs::read_dir(device) else {
+        return Vec::new();
+    };
+
+    entries
+        .flatten()
+        .filter(|entry| entry.file_name().to_string_lossy().starts_with("event"))
+        .filter_map(|entry| fs::read_to_string(entry.path().join("dev")).ok())
+        .map(|dev| Path::new(UDEV_DATA).join(format!("c{}", dev.trim())))
+        .collect()
+}
@@ -1,20 +1,23 @@
+#[cfg(any(test, feature = "bench"))]
+mod alloc_count;
 mod config;
+mod control;
 mod device;
 mod dump;
 mod grab;
 mod input;
 mod orientation;
 mod palm;
+mod record;
 mod ssh;
+mod transport;
 
-use std::sync::atomic::Ordering;
 use std::sync::Arc;
-use std::thread;
-use std::time::Duration;
 
 use clap::Parser;
 
 use config::{Cli, Command, Config};
+use control::Metrics;
 use device::DeviceProfile;
 use palm::{PalmState, SharedPalmState};
 
@@ -24,27 +27,61 @@ fn main() -> Result<()> {
     let cli = Cli::parse();
     
     init_logging(cli.command.is_some());
+
+    // Replays run offline, without a tablet to detect
+    #[cfg(feature = "bench")]
+    if let Some(Command::Bench { file, iterations }) = &cli.command {
+        return input::run_bench(&cli, file, *iterations);
+    }
     
-    // Detect device via SSH (required)
     let config_for_detection = Config::load(&cli, DeviceProfile::current());
-    let session = ssh::connect_for_detection(&config_for_detection)?;
-    let device = DeviceProfile::detect_via_ssh(&session)?;
-    log::info!("Using device profile: {}", device.name);
-    
-    let config = Config::load(&cli, device);
+    // Subcommands work with the first tablet
+    let hosts = match cli.command.is_some() {
+        true => &config_for_detection.hosts[..1],
+        false => &config_for_detection.hosts[..],
+    };
+    let mut tablets = Vec::new();
+    let mut connections = Vec::new();
+    for host in hosts {
+        let (tablet, connection) = detect_tablet(&cli, &config_for_detection.for_host(host))?;
+        tablets.push(tablet);
+        connections.push(connection);
+    }
 
     if let Some(command) = cli.command {
-        return run_subcommand(command, &config, device);
+        return run_subcommand(command, &tablets[0].config, tablets[0].device);
+    }
+
+    for tablet in &tablets {
+        if let Err(msg) = tablet.config.validate() {
+            eprintln!("Error: {}: {}", tablet.config.host, msg);
+            eprintln!("\nRun with --help for usage information");
+            std::process::exit(1);
+        }
     }
 
-    if let Err(msg) = config.validate() {
-        eprintln!("Error: {}", msg);
-        eprintln!("\nRun with --help for usage information");
-        std::process::exit(1);
+    for tablet in &tablets {
+        log_startup_info(&tablet.config);
     }
+    run_input_forwarding(cli, &tablets, connections)
+}
 
-    log_startup_info(&config);
-    run_input_forwarding(config, device)
+/// A tablet found at startup.
+struct Tablet {
+    config: Config,
+    device: &'static DeviceProfile,
+}
+
+/// Detect the tablet's device via SSH (required), returning it with a
+/// connection cache holding the detection session.
+fn detect_tablet(cli: &Cli, config_for_detection: &Config) -> Result<(Tablet, ssh::ConnectionCache)> {
+    let session = ssh::connect_for_detection(config_for_detection)?;
+    let device = DeviceProfile::detect_via_ssh(&session)?;
+    log::info!("Using device profile for {}: {}", config_for_detection.host, device.name);
+
+    let config = Config::load(cli, device).for_host(&config_for_detection.host);
+    // Input forwarding reuses the detection session for its first connection
+    Ok((Tablet { config, device }, ssh::ConnectionCache::new(Some(session))))
 }
 
 fn init_logging(is_dump: bool) {
@@ -58,14 +95,20 @@ fn run_subcommand(
     device_profile: &'static DeviceProfile,
 ) -> Result<()> {
     match command {
-        Command::Dump { device } => match device.as_str() {
-            "touch" => dump::run_touch(config, device_profile),
-            "pen" => dump::run_pen(config, device_profile),
+        Command::Dump { device, record } => match device.as_str() {
+            "touch" => dump::run_touch(config, device_profile, record.as_deref()),
+            "pen" => dump::run_pen(config, device_profile, record.as_deref()),
             _ => {
                 eprintln!("Unknown dump device: {}. Use 'touch' or 'pen'.", device);
                 std::process::exit(1);
             }
         },
+        Command::Selftest => {
+            print!("{}", ssh::run_helper_selftest(config)?);
+            Ok(())
+        }
+        #[cfg(feature = "bench")]
+        Command::Bench { .. } => unreachable!("bench runs before device detection"),
     }
 }
 
@@ -77,47 +120,67 @@ fn log_startup_info(config: &Config) {
     };
 
     log::info!(
-        "Starting rm-pad: host={}, pen={}, touch={}, palm_rejection={}, grab_input={}, orientation={}",
+        "Starting rm-pad: host={}, pen={}, touch={}, palm_rejection={}, grab_input={}, orientation={}, transport={}",
         config.host,
         if config.run_pen() { &config.pen_device } else { "off" },
         if config.run_touch() { &config.touch_device } else { "off" },
         palm_info,
         config.grab_input,
-        config.orientation
+        config.orientation,
+        config.transport
     );
 }
 
-fn run_input_forwarding(config: Config, device: &'static DeviceProfile) -> Result<()> {
-    let palm_state = create_palm_state(&config);
-    let config = Arc::new(config);
-
-    // If grabbing, touch the watchdog file FIRST, then start watchdog thread
-    let watchdog_stop = if config.grab_input {
-        // Touch once before starting anything - this ensures the file exists
-        // and is fresh before any grabber starts
-        log::info!("Touching watchdog file before starting...");
-        if let Err(e) = ssh::touch_watchdog_once(&config) {
-            log::error!("Failed to touch watchdog: {}", e);
-            return Err(e);
-        }
+/// Forward every tablet from this thread, with the rotation signals and
+/// the control socket shared between them.
+fn run_input_forwarding(cli: Cli, tablets: &[Tablet], connections: Vec<ssh::ConnectionCache>) -> Result<()> {
+    // Before any thread starts, so they all inherit the signal mask
+    let signals = input::RotationSignals::new()
+        .inspect_err(|e| log::warn!("Orientation signals unavailable: {}", e))
+        .ok();
+
+    let mut controls = Vec::new();
+    let mut queues = Vec::new();
+    for tablet in tablets {
+        let (commands, queue) = control::channel()?;
+        let metrics = Arc::new(Metrics::new());
+        controls.push(control::Tablet { host: tablet.config.host.clone(), metrics, commands });
+        queues.push(queue);
+    }
+    if let Some(signals) = signals {
+        control::forward_signals(signals, controls.iter().map(|control| control.commands.clone()).collect())?;
+    }
 
-        // Now start the background watchdog thread
-        Some(ssh::spawn_watchdog(&config))
-    } else {
-        None
-    };
+    // Pen and touch of a tablet share one connection and one helper process
+    let mut forwarders = Vec::new();
+    for (((tablet, control), queue), connection) in tablets.iter().zip(&controls).zip(queues).zip(connections) {
+        let config = &tablet.config;
+        let palm_state = create_palm_state(config);
+        let forwarder =
+            input::InputForwarder::new(config, tablet.device, palm_state, control.metrics.clone(), queue, connection)?;
+        forwarders.push(forwarder);
+    }
 
-    let pen_handle = spawn_pen_thread(&config, device, &palm_state);
-    let touch_handle = spawn_touch_thread(&config, device, &palm_state);
+    let device = tablets[0].device;
+    start_control_socket(&tablets[0].config, controls, move || Config::load(&cli, device));
 
-    let result = join_threads(pen_handle, touch_handle);
+    input::run_forwarders(forwarders)?;
+    Ok(())
+}
 
-    // Stop watchdog thread
-    if let Some(stop_flag) = watchdog_stop {
-        stop_flag.store(true, Ordering::Relaxed);
+/// Serve stats and commands if configured; rm-pad runs without it.
+fn start_control_socket(
+    config: &Config,
+    tablets: Vec<control::Tablet>,
+    reload: impl Fn() -> Config + Send + 'static,
+) {
+    let Some(path) = config.control_socket.as_deref() else {
+        return;
+    };
+    match control::serve(path, tablets, reload) {
+        Ok(()) => log::info!("Control socket: {}", path.display()),
+        Err(e) => log::warn!("Control socket {} unavailable: {}", path.display(), e),
     }
-
-    result
 }
 
 fn create_palm_state(config: &Config) -> Option<SharedPalmState> {
@@ -128,79 +191,5 @@ fn create_palm_state(config: &Config) -> Option<SharedPalmState> {
         return None;
     }
 
-    Some(Arc::new(std::sync::Mutex::new(PalmState::new())))
-}
-
-fn spawn_pen_thread(
-    config: &Arc<Config>,
-    device: &'static DeviceProfile,
-    palm_state: &Option<SharedPalmState>,
-) -> Option<thread::JoinHandle<()>> {
-    if !config.run_pen() {
-        return None;
-    }
-
-    let config = config.clone();
-    let palm = palm_state.clone();
-
-    Some(thread::spawn(move || {
-        run_with_reconnect("pen", || {
-            input::run_pen(&config, device, palm.clone())
-        });
-    }))
-}
-
-fn spawn_touch_thread(
-    config: &Arc<Config>,
-    device: &'static DeviceProfile,
-    palm_state: &Option<SharedPalmState>,
-) -> Option<thread::JoinHandle<()>> {
-    if !config.run_touch() {
-        return None;
-    }
-
-    let config = config.clone();
-    let palm = palm_state.clone();
-
-    Some(thread::spawn(move || {
-        run_with_reconnect("touch", || {
-            input::run_touch(&config, device, palm.clone())
-        });
-    }))
-}
-
-/// Delay between reconnection attempts.
-const RECONNECT_DELAY: Duration = Duration::from_secs(2);
-
-fn run_with_reconnect<F>(name: &str, mut run_fn: F)
-where
-    F: FnMut() -> Result<()>,
-{
-    loop {
-        log::info!("[{}] Connecting", name);
-
-        if let Err(e) = run_fn() {
-            log::error!("[{}] Error: {}", name, e);
-        }
-
-        log::warn!(
-            "[{}] Disconnected, reconnecting in {}s",
-            name,
-            RECONNECT_DELAY.as_secs()
-        );
-        thread::sleep(RECONNECT_DELAY);
-    }
-}
-
-fn join_threads(
-    pen: Option<thread::JoinHandle<()>>,
-    touch: Option<thread::JoinHandle<()>>,
-) -> Result<()> {
-    if let Some(h) = pen {
-        h.join().unwrap();
-    }
-    if let Some(h) = touch {
-        h.join().unwrap();
-    }
-    Ok(())
+    Some(Arc::new(PalmState::new()))
 }
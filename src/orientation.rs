@@ -20,6 +20,21 @@ pub enum Orientation {
 }
 
 impl Orientation {
+    /// The orientation a quarter turn clockwise from this one.
+    pub fn rotated_clockwise(self) -> Self {
+        match self {
+            Orientation::Portrait => Orientation::LandscapeRight,
+            Orientation::LandscapeRight => Orientation::Inverted,
+            Orientation::Inverted => Orientation::LandscapeLeft,
+            Orientation::LandscapeLeft => Orientation::Portrait,
+        }
+    }
+
+    /// The orientation a quarter turn counter-clockwise from this one.
+    pub fn rotated_counter_clockwise(self) -> Self {
+        self.rotated_clockwise().rotated_clockwise().rotated_clockwise()
+    }
+
     /// Transform touch coordinates from device space to output space.
     /// Touch is natively portrait-oriented but with Y=0 at bottom.
     pub fn transform_touch(&self, x: i32, y: i32, x_max: i32, y_max: i32) -> (i32, i32) {
@@ -86,6 +101,48 @@ impl Orientation {
     }
 }
 
+/// An orientation's coordinate mapping for one device, resolved once.
+///
+/// Every orientation is a rotation by a multiple of 90° plus an offset, so
+/// it reduces to an integer affine map; the per-event path is then a few
+/// multiply-adds with no branch on the configuration.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Transform {
+    xx: i32,
+    xy: i32,
+    x0: i32,
+    yx: i32,
+    yy: i32,
+    y0: i32,
+}
+
+impl Transform {
+    /// Sample a mapping at the origin and the two unit vectors.
+    fn from_fn(f: impl Fn(i32, i32) -> (i32, i32)) -> Self {
+        let (x0, y0) = f(0, 0);
+        let (x1, y1) = f(1, 0);
+        let (x2, y2) = f(0, 1);
+        Self { xx: x1 - x0, xy: x2 - x0, x0, yx: y1 - y0, yy: y2 - y0, y0 }
+    }
+
+    pub fn touch(orientation: Orientation, x_max: i32, y_max: i32) -> Self {
+        Self::from_fn(|x, y| orientation.transform_touch(x, y, x_max, y_max))
+    }
+
+    pub fn pen(orientation: Orientation, x_max: i32, y_max: i32) -> Self {
+        Self::from_fn(|x, y| orientation.transform_pen(x, y, x_max, y_max))
+    }
+
+    pub fn tilt(orientation: Orientation) -> Self {
+        Self::from_fn(|x, y| orientation.transform_tilt(x, y))
+    }
+
+    #[inline]
+    pub fn apply(&self, x: i32, y: i32) -> (i32, i32) {
+        (self.xx * x + self.xy * y + self.x0, self.yx * x + self.yy * y + self.y0)
+    }
+}
+
 impl fmt::Display for Orientation {
     fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
         match self {
@@ -136,6 +193,33 @@ mod tests {
         assert_eq!(landscape.touch_output_dimensions(100, 200), (200, 100));
     }
 
+    #[test]
+    fn test_transform_matches_orientation() {
+        let all = [
+            Orientation::Portrait,
+            Orientation::LandscapeRight,
+            Orientation::LandscapeLeft,
+            Orientation::Inverted,
+        ];
+        for o in all {
+            let (touch, pen, tilt) = (Transform::touch(o, 100, 200), Transform::pen(o, 300, 400), Transform::tilt(o));
+            for (x, y) in [(0, 0), (17, 160), (100, 200), (-5, 3)] {
+                assert_eq!(touch.apply(x, y), o.transform_touch(x, y, 100, 200), "{o}");
+                assert_eq!(pen.apply(x, y), o.transform_pen(x, y, 300, 400), "{o}");
+                assert_eq!(tilt.apply(x, y), o.transform_tilt(x, y), "{o}");
+            }
+        }
+    }
+
+    #[test]
+    fn test_rotation_round_trip() {
+        let o = Orientation::Portrait;
+        assert_eq!(o.rotated_clockwise(), Orientation::LandscapeRight);
+        assert_eq!(o.rotated_counter_clockwise(), Orientation::LandscapeLeft);
+        assert_eq!(o.rotated_clockwise().rotated_clockwise().rotated_clockwise().rotated_clockwise(), o);
+        assert_eq!(Orientation::Inverted.rotated_clockwise().rotated_counter_clockwise(), Orientation::Inverted);
+    }
+
     #[test]
     fn test_from_str() {
         assert_eq!("portrait".parse::<Orientation>().unwrap(), Orientation::Portrait);
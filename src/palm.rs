@@ -1,17 +1,141 @@
-use std::sync::{Arc, Mutex};
+use std::sync::atomic::{AtomicU32, AtomicU64, Ordering};
+use std::sync::Arc;
 use std::time::Instant;
 
-/// Shared state for palm rejection between pen and touch threads.
-#[derive(Default)]
+/// Set in the state word while the pen is over or on the screen.
+const PEN_NEAR: u64 = 1 << 63;
+
+/// A point on the screen as a fraction of the output's width and height,
+/// `u16::MAX` being the far edge. The pen and touch devices differ in
+/// range and native orientation but share the output orientation, so this
+/// is where their positions can be compared.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct ScreenPoint {
+    pub x: u16,
+    pub y: u16,
+}
+
+impl ScreenPoint {
+    /// From an output position in `0..=x_max`, `0..=y_max`.
+    pub fn from_output(x: i32, y: i32, x_max: i32, y_max: i32) -> Self {
+        let scale = |v: i32, max: i32| (v.clamp(0, max) as i64 * u16::MAX as i64 / max.max(1) as i64) as u16;
+        Self { x: scale(x, x_max), y: scale(y, y_max) }
+    }
+
+    /// Back to an output position in `0..=x_max`, `0..=y_max`.
+    pub fn to_output(self, x_max: i32, y_max: i32) -> (i32, i32) {
+        let scale = |v: u16, max: i32| (v as i64 * max as i64 / u16::MAX as i64) as i32;
+        (scale(self.x, x_max), scale(self.y, y_max))
+    }
+
+    fn pack(self) -> u32 {
+        (self.x as u32) << 16 | self.y as u32
+    }
+
+    fn unpack(packed: u32) -> Self {
+        Self { x: (packed >> 16) as u16, y: packed as u16 }
+    }
+}
+
+/// Shared state for palm rejection between pen and touch pipelines.
+///
+/// Everything lives in atomics, so neither side ever blocks on the other.
+/// The state word is `PEN_NEAR` while the pen reports proximity, otherwise
+/// the time it was last seen near, in milliseconds since `epoch` plus one
+/// (0 = never). The position word holds the pen's last `ScreenPoint`.
 pub struct PalmState {
-    pub pen_down: bool,
-    pub last_pen_up: Option<Instant>,
+    epoch: Instant,
+    state: AtomicU64,
+    position: AtomicU32,
 }
 
 impl PalmState {
     pub fn new() -> Self {
-        Self::default()
+        Self {
+            epoch: Instant::now(),
+            state: AtomicU64::new(0),
+            position: AtomicU32::new(0),
+        }
+    }
+
+    /// Record the pen's proximity and position for the current pen frame.
+    /// Only the pen moving away starts the grace period: frames without the
+    /// pen near, such as the release written on every reconnect, leave the
+    /// state alone. The pen pipeline is the only writer.
+    pub fn update_pen(&self, near: bool, position: ScreenPoint) {
+        if near {
+            self.position.store(position.pack(), Ordering::Relaxed);
+            self.state.store(PEN_NEAR, Ordering::Relaxed);
+        } else if self.state.load(Ordering::Relaxed) == PEN_NEAR {
+            self.position.store(position.pack(), Ordering::Relaxed);
+            self.state.store(self.now_ms(), Ordering::Relaxed);
+        }
+    }
+
+    /// Where the pen is, if it is near the screen or left less than
+    /// `grace_ms` ago; a hand resting there belongs to the pen.
+    pub fn pen_position(&self, grace_ms: u64) -> Option<ScreenPoint> {
+        let active = match self.state.load(Ordering::Relaxed) {
+            0 => false,
+            PEN_NEAR => true,
+            last_near => self.now_ms().saturating_sub(last_near) < grace_ms,
+        };
+        active.then(|| ScreenPoint::unpack(self.position.load(Ordering::Relaxed)))
+    }
+
+    fn now_ms(&self) -> u64 {
+        self.epoch.elapsed().as_millis() as u64 + 1
     }
 }
 
-pub type SharedPalmState = Arc<Mutex<PalmState>>;
+pub type SharedPalmState = Arc<PalmState>;
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const CENTRE: ScreenPoint = ScreenPoint { x: 0x8000, y: 0x8000 };
+
+    #[test]
+    fn test_no_pen_has_no_position() {
+        let palm = PalmState::new();
+        assert_eq!(palm.pen_position(u64::MAX), None);
+    }
+
+    #[test]
+    fn test_pen_near_has_position() {
+        let palm = PalmState::new();
+        palm.update_pen(true, CENTRE);
+        assert_eq!(palm.pen_position(0), Some(CENTRE));
+    }
+
+    #[test]
+    fn test_grace_period_after_pen_leaves() {
+        let palm = PalmState::new();
+        palm.update_pen(true, CENTRE);
+        palm.update_pen(false, CENTRE);
+        assert_eq!(palm.pen_position(60_000), Some(CENTRE));
+        assert_eq!(palm.pen_position(0), None);
+    }
+
+    #[test]
+    fn test_only_leaving_starts_the_grace_period() {
+        let palm = PalmState::new();
+        palm.update_pen(false, CENTRE);
+        assert_eq!(palm.pen_position(u64::MAX), None, "the pen was never near");
+
+        palm.update_pen(true, CENTRE);
+        palm.update_pen(false, CENTRE);
+        std::thread::sleep(std::time::Duration::from_millis(5));
+        palm.update_pen(false, ScreenPoint { x: 0, y: 0 });
+        assert_eq!(palm.pen_position(3), None, "a later release does not restart it");
+        assert_eq!(palm.pen_position(u64::MAX), Some(CENTRE));
+    }
+
+    #[test]
+    fn test_screen_point_round_trip() {
+        let point = ScreenPoint::from_output(11180, 0, 15340, 11180);
+        assert_eq!(point.to_output(1403, 1871), (1022, 0));
+        assert_eq!(ScreenPoint::from_output(20967, 15725, 20967, 15725).to_output(1871, 1403), (1871, 1403));
+    }
+}
@@ -0,0 +1,92 @@
+//! File format for recorded input sessions (`rm-pad dump --record`).
+//!
+//! A recording is a short header followed by the raw input_events exactly
+//! as the tablet's kernel produced them, timestamps included:
+//! - 8 bytes magic `RMPADREC`
+//! - u8 format version
+//! - u8 stream: 0 = pen, 1 = touch
+//! - u8 input_event size in bytes
+//! - u8 length of the device profile name, then the name
+
+use std::io::{self, Write};
+
+use crate::device::DeviceProfile;
+
+const MAGIC: &[u8; 8] = b"RMPADREC";
+const VERSION: u8 = 1;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum RecordedStream {
+    Pen,
+    Touch,
+}
+
+pub struct RecordingHeader {
+    pub stream: RecordedStream,
+    pub profile: &'static DeviceProfile,
+}
+
+pub fn write_header(out: &mut impl Write, header: &RecordingHeader) -> io::Result<()> {
+    let name = header.profile.name.as_bytes();
+    let stream = match header.stream {
+        RecordedStream::Pen => 0,
+        RecordedStream::Touch => 1,
+    };
+
+    out.write_all(MAGIC)?;
+    out.write_all(&[VERSION, stream, header.profile.input_event_size as u8, name.len() as u8])?;
+    out.write_all(name)
+}
+
+/// Split a recording into its header and the raw events that follow it.
+#[cfg(any(test, feature = "bench"))]
+pub fn parse_recording(data: &[u8]) -> Result<(RecordingHeader, &[u8]), Box<dyn std::error::Error + Send + Sync>> {
+    let fixed = MAGIC.len() + 4;
+    if data.len() < fixed || &data[..MAGIC.len()] != MAGIC {
+        return Err("Not an rm-pad recording".into());
+    }
+
+    let [version, stream, event_size, name_len] = data[MAGIC.len()..fixed] else {
+        unreachable!();
+    };
+    if version != VERSION {
+        return Err(format!("Unsupported recording version {}", version).into());
+    }
+
+    let stream = match stream {
+        0 => RecordedStream::Pen,
+        1 => RecordedStream::Touch,
+        other => return Err(format!("Unknown recorded stream {}", other).into()),
+    };
+
+    let name_end = fixed + name_len as usize;
+    let name = data.get(fixed..name_end).ok_or("Truncated recording header")?;
+    let name = std::str::from_utf8(name)?;
+    let profile = DeviceProfile::by_name(name)
+        .ok_or_else(|| format!("Recording is from an unknown device: {}", name))?;
+    if profile.input_event_size != event_size as usize {
+        return Err(format!("Recording event size {} does not match {}", event_size, name).into());
+    }
+
+    Ok((RecordingHeader { stream, profile }, &data[name_end..]))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::device::RMPP;
+
+    #[test]
+    fn test_header_round_trip() {
+        let mut data = Vec::new();
+        write_header(&mut data, &RecordingHeader { stream: RecordedStream::Touch, profile: &RMPP }).unwrap();
+        data.extend_from_slice(&[1, 2, 3]);
+
+        let (header, events) = parse_recording(&data).unwrap();
+        assert_eq!(header.stream, RecordedStream::Touch);
+        assert_eq!(header.profile.name, RMPP.name);
+        assert_eq!(events, &[1, 2, 3]);
+
+        assert!(parse_recording(&data[..10]).is_err());
+    }
+}
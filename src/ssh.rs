@@ -1,8 +1,6 @@
-use std::io::Read;
-use std::net::{TcpStream, ToSocketAddrs};
-use std::sync::atomic::{AtomicBool, Ordering};
-use std::sync::Arc;
-use std::thread;
+use std::io::{self, Read};
+use std::net::{IpAddr, SocketAddr, TcpStream, ToSocketAddrs};
+use std::os::fd::{AsRawFd, BorrowedFd};
 use std::time::Duration;
 
 use ssh2::Session;
@@ -10,18 +8,11 @@ use ssh2::Session;
 use crate::config::{Auth, Config};
 use crate::grab;
 
-/// Watchdog file path on the tablet
-pub const WATCHDOG_FILE: &str = "/tmp/rm-pad-watchdog";
-
-/// How often to touch the watchdog file
-const WATCHDOG_INTERVAL: Duration = Duration::from_secs(2);
-
 /// Timeout for SSH operations
 const SSH_TIMEOUT: Duration = Duration::from_secs(5);
 
 /// Guard that holds the SSH session.
 pub struct GrabCleanup {
-    #[allow(dead_code)]
     session: Session,
 }
 
@@ -29,43 +20,164 @@ impl GrabCleanup {
     pub fn new(session: Session) -> Self {
         Self { session }
     }
+
+    pub fn session(&self) -> &Session {
+        &self.session
+    }
 }
 
 const SSH_USER: &str = "root";
 const SSH_PORT: u16 = 22;
 
-/// Open an SSH connection and stream input from a device.
+/// What the first connection learns about the tablet, reused so that a
+/// reconnect is only a TCP connect, handshake and authentication.
+pub struct ConnectionCache {
+    /// Authenticated session not used for streaming yet (from detection).
+    spare: Option<Session>,
+    addr: Option<SocketAddr>,
+    arch: Option<grab::Arch>,
+    helper_verified: bool,
+}
+
+impl ConnectionCache {
+    pub fn new(spare: Option<Session>) -> Self {
+        Self {
+            spare,
+            addr: None,
+            arch: None,
+            helper_verified: false,
+        }
+    }
+
+    /// Check the helper binary again on the next connection, e.g. because
+    /// it failed to start (the tablet rebooted and /tmp was cleared).
+    pub fn invalidate_helper(&mut self) {
+        self.helper_verified = false;
+    }
+
+    /// Connect and make sure the helper is in place, keeping the session
+    /// for the next `open_helper_stream`. Lets that work overlap with other
+    /// startup steps.
+    pub fn warm_up(&mut self, config: &Config) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
+        let session = self.connect(config)?;
+        prepare_helper(&session, self)?;
+        self.spare = Some(session);
+        Ok(())
+    }
+
+    fn connect(&mut self, config: &Config) -> Result<Session, Box<dyn std::error::Error + Send + Sync>> {
+        if let Some(session) = self.spare.take() {
+            return Ok(session);
+        }
+
+        let addr = match self.addr {
+            Some(addr) => addr,
+            None => resolve(config)?,
+        };
+        match connect_to(addr, config) {
+            Ok(session) => {
+                self.addr = Some(addr);
+                Ok(session)
+            }
+            Err(e) => {
+                // The address may have changed (DHCP); resolve again next time
+                self.addr = None;
+                Err(e)
+            }
+        }
+    }
+}
+
+/// Open an SSH connection and stream raw input events from a device.
 pub fn open_input_stream(
     device_path: &str,
     config: &Config,
-    grab: bool,
 ) -> Result<(GrabCleanup, ssh2::Channel), Box<dyn std::error::Error + Send + Sync>> {
     log::info!("Connecting to {}", config.host);
 
     let session = connect_and_authenticate(config)?;
+    let mut channel = session.channel_session()?;
 
-    if grab {
-        prepare_grab(&session)?;
-    }
+    let cmd = format!("cat {}", device_path);
+    log::debug!("Executing: {}", cmd);
+
+    channel.exec(&cmd)?;
+
+    log::info!("Stream ready for {}", device_path);
+    Ok((GrabCleanup::new(session), channel))
+}
+
+/// Open an SSH connection and stream framed input from several devices
+/// through a single evgrab helper process.
+pub fn open_helper_stream(
+    device_paths: &[&str],
+    filters: &[grab::Filter],
+    config: &Config,
+    cache: &mut ConnectionCache,
+) -> Result<(GrabCleanup, ssh2::Channel), Box<dyn std::error::Error + Send + Sync>> {
+    log::info!("Connecting to {}", config.host);
+
+    let session = cache.connect(config)?;
+    let arch = prepare_helper(&session, cache)?;
 
     let mut channel = session.channel_session()?;
 
-    let cmd = build_stream_command(device_path, grab);
+    if config.grab_input {
+        log::info!("Using grab mode (input restored automatically on disconnect)");
+    }
+    let options = grab::HelperOptions {
+        grab: config.grab_input,
+        compact: !config.no_compact_stream,
+        transport: config.transport,
+        filters,
+        output_rate_hz: config.output_rate_hz,
+    };
+    let cmd = grab::grab_command(arch, device_paths, options);
     log::debug!("Executing: {}", cmd);
 
     channel.exec(&cmd)?;
 
-    log::info!("Stream ready for {}", device_path);
+    log::info!("Stream ready for {}", device_paths.join(", "));
     Ok((GrabCleanup::new(session), channel))
 }
 
+/// Install the helper if needed and run its self-benchmark on the tablet,
+/// returning the report it prints.
+pub fn run_helper_selftest(config: &Config) -> Result<String, Box<dyn std::error::Error + Send + Sync>> {
+    let session = connect_and_authenticate(config)?;
+    let arch = prepare_helper(&session, &mut ConnectionCache::new(None))?;
+
+    let mut channel = session.channel_session()?;
+    channel.exec(&grab::selftest_command(arch))?;
+    let mut report = String::new();
+    channel.read_to_string(&mut report)?;
+    channel.wait_close()?;
+
+    let status = channel.exit_status()?;
+    if status != 0 {
+        return Err(format!("Helper selftest failed (exit status {}): {}", status, report.trim()).into());
+    }
+    Ok(report)
+}
+
 fn connect_and_authenticate(
     config: &Config,
 ) -> Result<Session, Box<dyn std::error::Error + Send + Sync>> {
+    connect_to(resolve(config)?, config)
+}
+
+fn resolve(config: &Config) -> Result<SocketAddr, Box<dyn std::error::Error + Send + Sync>> {
     let addr = (config.host.as_str(), SSH_PORT)
         .to_socket_addrs()?
         .next()
         .ok_or("Could not resolve host address")?;
+    Ok(addr)
+}
+
+fn connect_to(
+    addr: SocketAddr,
+    config: &Config,
+) -> Result<Session, Box<dyn std::error::Error + Send + Sync>> {
     let tcp = TcpStream::connect_timeout(&addr, SSH_TIMEOUT)?;
 
     let mut session = Session::new()?;
@@ -76,6 +188,17 @@ fn connect_and_authenticate(
     Ok(session)
 }
 
+/// Address of the tablet at the other end of `session`.
+pub fn peer_ip(session: &Session) -> io::Result<IpAddr> {
+    // SAFETY: the session owns the socket and outlives this borrow
+    let fd = unsafe { BorrowedFd::borrow_raw(session.as_raw_fd()) };
+    socket2::SockRef::from(&fd)
+        .peer_addr()?
+        .as_socket()
+        .map(|addr| addr.ip())
+        .ok_or_else(|| io::Error::other("SSH session is not on an IP socket"))
+}
+
 /// Connect to the device via SSH for device detection purposes.
 /// Returns None if connection fails (e.g., device not available).
 pub fn connect_for_detection(config: &Config) -> Result<Session, Box<dyn std::error::Error + Send + Sync>> {
@@ -102,93 +225,22 @@ fn authenticate(
     Ok(())
 }
 
-fn prepare_grab(session: &Session) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
-    let arch = grab::detect_arch(session)?;
-    log::info!("Detected tablet architecture: {}", arch);
-    grab::ensure_binary_valid(session, arch)?;
-    Ok(())
-}
-
-fn build_stream_command(device_path: &str, grab: bool) -> String {
-    if grab {
-        log::info!("Using grab mode (input restored automatically on disconnect)");
-        grab::grab_command(device_path)
-    } else {
-        format!("cat {}", device_path)
+/// Make sure the helper is installed, returning the tablet's architecture.
+fn prepare_helper(
+    session: &Session,
+    cache: &mut ConnectionCache,
+) -> Result<grab::Arch, Box<dyn std::error::Error + Send + Sync>> {
+    if let (Some(arch), true) = (cache.arch, cache.helper_verified) {
+        return Ok(arch);
     }
-}
 
-/// Touch the watchdog file once. Blocks until success or error.
-/// This MUST be called before starting grabbers.
-pub fn touch_watchdog_once(config: &Config) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
-    let addr = (config.host.as_str(), SSH_PORT)
-        .to_socket_addrs()?
-        .next()
-        .ok_or("Could not resolve host address")?;
-    let tcp = TcpStream::connect_timeout(&addr, SSH_TIMEOUT)?;
-
-    let mut session = Session::new()?;
-    session.set_tcp_stream(tcp);
-    session.handshake()?;
-    authenticate(&mut session, &config.auth())?;
-
-    let mut channel = session.channel_session()?;
-    channel.exec(&format!("touch {}", WATCHDOG_FILE))?;
-
-    let mut output = String::new();
-    channel.read_to_string(&mut output)?;
-    channel.wait_close()?;
-
-    log::info!("Watchdog file touched");
-    Ok(())
-}
-
-/// Spawn a thread that periodically touches the watchdog file.
-/// Returns a stop flag.
-pub fn spawn_watchdog(config: &Config) -> Arc<AtomicBool> {
-    let stop_flag = Arc::new(AtomicBool::new(false));
-    let stop_flag_clone = stop_flag.clone();
-    let host = config.host.clone();
-    let auth = config.auth();
-
-    thread::spawn(move || {
-        log::info!("Watchdog thread started");
-
-        loop {
-            if stop_flag_clone.load(Ordering::Relaxed) {
-                log::debug!("Watchdog thread stopping");
-                break;
-            }
-
-            if let Err(e) = touch_watchdog(&host, &auth) {
-                log::warn!("Watchdog touch failed: {}", e);
-            }
-
-            thread::sleep(WATCHDOG_INTERVAL);
-        }
-    });
-
-    stop_flag
-}
-
-fn touch_watchdog(host: &str, auth: &Auth) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
-    let addr = (host, SSH_PORT)
-        .to_socket_addrs()?
-        .next()
-        .ok_or("Could not resolve host address")?;
-    let tcp = TcpStream::connect_timeout(&addr, SSH_TIMEOUT)?;
-
-    let mut session = Session::new()?;
-    session.set_tcp_stream(tcp);
-    session.handshake()?;
-    authenticate(&mut session, auth)?;
-
-    let mut channel = session.channel_session()?;
-    channel.exec(&format!("touch {}", WATCHDOG_FILE))?;
-
-    let mut output = String::new();
-    channel.read_to_string(&mut output)?;
-    channel.wait_close()?;
+    let (arch, installed) = grab::probe_tablet(session)?;
+    if cache.arch.is_none() {
+        log::info!("Detected tablet architecture: {}", arch);
+    }
+    cache.arch = Some(arch);
 
-    Ok(())
+    grab::ensure_binary_valid(session, arch, installed)?;
+    cache.helper_verified = true;
+    Ok(arch)
 }
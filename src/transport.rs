@@ -0,0 +1,148 @@
+//! How the helper's frames travel to the host.
+//!
+//! SSH always launches the helper and carries the heartbeat. The frames
+//! themselves either stay inside the SSH channel or, on a trusted link such
+//! as the USB cable, move to a plain TCP connection the helper opens for
+//! the purpose, sparing the tablet's CPU the encryption.
+
+use serde::Deserialize;
+use std::fmt;
+use std::io::{self, Read, Write};
+use std::net::{IpAddr, SocketAddr, TcpStream};
+use std::os::fd::{AsRawFd, RawFd};
+use std::str::FromStr;
+use std::time::Duration;
+
+/// Size of the token the host presents on a data connection.
+pub const TOKEN_SIZE: usize = 16;
+
+/// Timeout for setting up the data connection.
+const CONNECT_TIMEOUT: Duration = Duration::from_secs(5);
+
+/// Transport for the helper's frame stream.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Default, Deserialize)]
+#[serde(rename_all = "kebab-case")]
+pub enum Transport {
+    /// Frames travel inside the encrypted SSH channel.
+    #[default]
+    Ssh,
+    /// Frames travel over an unencrypted TCP connection, authenticated by a
+    /// one-time token handed out over SSH.
+    Tcp,
+    /// Like `Tcp`, but batches of pure pen motion come as UDP datagrams, so
+    /// a lost packet never holds up later input.
+    Udp,
+}
+
+impl fmt::Display for Transport {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            Transport::Ssh => write!(f, "ssh"),
+            Transport::Tcp => write!(f, "tcp"),
+            Transport::Udp => write!(f, "udp"),
+        }
+    }
+}
+
+impl FromStr for Transport {
+    type Err = String;
+
+    fn from_str(s: &str) -> Result<Self, Self::Err> {
+        match s.to_lowercase().as_str() {
+            "ssh" => Ok(Transport::Ssh),
+            "tcp" => Ok(Transport::Tcp),
+            "udp" => Ok(Transport::Udp),
+            _ => Err(format!("Invalid transport '{}'. Valid values: ssh, tcp, udp", s)),
+        }
+    }
+}
+
+/// The helper's frame stream. Reads return frames from wherever they
+/// arrive; writes (heartbeats) always go to the helper's stdin over SSH.
+pub enum HelperStream {
+    Ssh(ssh2::Channel),
+    Tcp { data: TcpStream, control: ssh2::Channel },
+}
+
+impl HelperStream {
+    /// Move the frame stream to the helper's TCP port at `ip`, presenting
+    /// the token it announced and, for `Transport::Udp`, the port datagrams
+    /// should go to.
+    pub fn connect_data(
+        self,
+        ip: IpAddr,
+        port: u16,
+        token: &[u8; TOKEN_SIZE],
+        datagram_port: Option<u16>,
+    ) -> io::Result<Self> {
+        let control = match self {
+            HelperStream::Ssh(channel) => channel,
+            HelperStream::Tcp { .. } => return Err(io::Error::other("Data connection already open")),
+        };
+
+        let mut data = TcpStream::connect_timeout(&SocketAddr::new(ip, port), CONNECT_TIMEOUT)?;
+        data.set_nodelay(true)?;
+        data.set_read_timeout(Some(CONNECT_TIMEOUT))?;
+        let mut hello = token.to_vec();
+        if let Some(datagram_port) = datagram_port {
+            hello.extend_from_slice(&datagram_port.to_le_bytes());
+        }
+        data.write_all(&hello)?;
+        log::debug!("Data connection open to {}:{}", ip, port);
+
+        Ok(HelperStream::Tcp { data, control })
+    }
+
+    /// Stop blocking on reads once the stream is running. The SSH channel
+    /// follows its session's blocking mode.
+    pub fn set_nonblocking(&self) -> io::Result<()> {
+        match self {
+            HelperStream::Ssh(_) => Ok(()),
+            HelperStream::Tcp { data, .. } => data.set_nonblocking(true),
+        }
+    }
+
+    /// The data connection's fd, if frames don't come through SSH.
+    pub fn data_fd(&self) -> Option<RawFd> {
+        match self {
+            HelperStream::Ssh(_) => None,
+            HelperStream::Tcp { data, .. } => Some(data.as_raw_fd()),
+        }
+    }
+}
+
+impl Read for HelperStream {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        match self {
+            HelperStream::Ssh(channel) => channel.read(buf),
+            HelperStream::Tcp { data, .. } => data.read(buf),
+        }
+    }
+}
+
+impl Write for HelperStream {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        match self {
+            HelperStream::Ssh(control) | HelperStream::Tcp { control, .. } => control.write(buf),
+        }
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        match self {
+            HelperStream::Ssh(control) | HelperStream::Tcp { control, .. } => control.flush(),
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_from_str() {
+        assert_eq!("tcp".parse::<Transport>().unwrap(), Transport::Tcp);
+        assert_eq!("SSH".parse::<Transport>().unwrap(), Transport::Ssh);
+        assert_eq!("udp".parse::<Transport>().unwrap(), Transport::Udp);
+        assert!("quic".parse::<Transport>().is_err());
+    }
+}